@@ -31,5 +31,13 @@ static const int DELETED_STUDENT_ID = 0;
 
 #define DB_FILE     "student.db"            //name of database file
 #define TMP_DB_FILE ".tmp_student.db"       //for extra credit
+#define LNAME_IDX_FILE "student.lidx"       //last name index, see sdb_index.c
+#define COLUMN_FILE "student.col"           //id/gpa columns, see sdb_column.c
+#define WAL_FILE    "student.wal"           //write-ahead log, see sdb_wal.c
+#define CHANGES_FILE "student.log"          //change log, see sdb_changes.c
+#define SLOT_MAP_FILE "student.map"         //id to slot map, see sdb_compact.c
+#define BLOOM_FILE  "student.bloom"         //id filter, see sdb_bloom.c
+#define TMP_BLOOM_FILE ".tmp_student.bloom"
+#define SERVER_SOCK_FILE "student.sock"     //server socket, see sdb_server.c
 
 #endif
\ No newline at end of file
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Batch finds and deletes (-F, -D), one student id per line of stdin.  In a
+// direct layout db each id's slot is known up front, so the records of a
+// whole batch are read (and for deletes cleared) with io_batch, which keeps
+// many requests in flight at once, see sdb_uring.c.  Hash layout and packed
+// dbs look every id up on its own.  Like -p, batch finds read without record
+// locks; deletes lock the ids of each window while they work on them.
+
+/*
+ * read_ids - Reads one id per line from in into a new array, skipping blank
+ *            and # lines.  Lines that are not a number are reported.
+ *            Returns the number of ids, or ERR_DB_OP if out of memory.
+ */
+static int read_ids(FILE *in, int **out) {
+    char *line = NULL, *end;
+    size_t line_cap = 0;
+    int *ids = NULL, n = 0, cap = 0, line_no = 0;
+
+    while (getline(&line, &line_cap, in) != -1) {
+        line_no++;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') continue;
+
+        long id = strtol(line, &end, 10);
+        if (end == line || end[strspn(end, " \t\r\n")] != '\0' || id < INT_MIN || id > INT_MAX) {
+            printf(M_ERR_BATCH_PARSE, line_no);
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            int *p = realloc(ids, cap * sizeof(int));
+            if (p == NULL) {
+                free(ids);
+                free(line);
+                return ERR_DB_OP;
+            }
+            ids = p;
+        }
+        ids[n++] = (int)id;
+    }
+    free(line);
+    *out = ids;
+    return n;
+}
+
+/*
+ * batch_slots - True if the records of the db can be read at known slots.
+ */
+static bool batch_slots(void) {
+    return !pack_active() && db_layout == DB_LAYOUT_DIRECT;
+}
+
+/*
+ * batch_id_ok - True if id can name a student of the db, so it can be
+ *               locked.  Other ids are reported as not found.
+ */
+static bool batch_id_ok(int id) {
+    if (db_layout == DB_LAYOUT_HASH) {
+        return id > DELETED_STUDENT_ID;
+    }
+    return id >= MIN_STD_ID && id <= MAX_STD_ID;
+}
+
+/*
+ * read_batch - Reads the records of ids[0..n) into recs with one io_batch.
+ *              Ids without a slot get an empty record.
+ */
+static int read_batch(int fd, const int *ids, int n, student_t *recs, io_req_t *reqs) {
+    int nreq = 0;
+
+    memset(recs, 0, (size_t)n * sizeof(student_t));
+    for (int i = 0; i < n; i++) {
+        long slot = batch_id_ok(ids[i]) ? slot_of(ids[i]) : -1;
+        if (slot < 0) continue;
+        reqs[nreq].op = IO_READ;
+        reqs[nreq].buf = &recs[i];
+        reqs[nreq].len = STUDENT_RECORD_SIZE;
+        reqs[nreq].offset = (off_t)slot * STUDENT_RECORD_SIZE;
+        nreq++;
+    }
+    if (io_batch(fd, reqs, nreq) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    for (int k = 0; k < nreq; k++) {
+        if (reqs[k].res < 0) return ERR_DB_FILE;
+        if (reqs[k].res != STUDENT_RECORD_SIZE) {
+            memset(reqs[k].buf, 0, STUDENT_RECORD_SIZE);   // past the end of the file
+        }
+    }
+    return NO_ERROR;
+}
+
+/*
+ * batch_find - Prints the students whose ids are read from in (-F), in
+ *              input order, then the ids that were not found.  Returns the
+ *              number found.
+ */
+int batch_find(int fd, FILE *in) {
+    int *ids = NULL, n, found = 0, rc = NO_ERROR;
+    student_t *recs;
+    io_req_t *reqs;
+    out_buf_t out;
+
+    n = read_ids(in, &ids);
+    recs = malloc((n > 0 ? n : 1) * sizeof(student_t));
+    reqs = malloc((n > 0 ? n : 1) * sizeof(io_req_t));
+    if (n < 0 || recs == NULL || reqs == NULL || out_open(&out, PRINT_TEXT) != NO_ERROR) {
+        printf(M_ERR_MEMORY);
+        free(ids);
+        free(recs);
+        free(reqs);
+        return ERR_DB_OP;
+    }
+
+    if (batch_slots()) {
+        rc = read_batch(fd, ids, n, recs, reqs);
+    } else {
+        for (int i = 0; i < n && rc == NO_ERROR; i++) {
+            if (read_record(fd, ids[i], &recs[i]) == ERR_DB_FILE) rc = ERR_DB_FILE;
+        }
+    }
+
+    for (int i = 0; i < n && rc == NO_ERROR; i++) {
+        if (recs[i].id == ids[i] && ids[i] != DELETED_STUDENT_ID) {
+            rc = out_record(&recs[i], &out);
+            found++;
+        }
+    }
+    if (out_close(&out) != NO_ERROR && rc == NO_ERROR) {
+        rc = ERR_DB_FILE;
+    }
+    for (int i = 0; i < n && rc == NO_ERROR; i++) {
+        if (recs[i].id != ids[i] || ids[i] == DELETED_STUDENT_ID) {
+            printf(M_STD_NOT_FND_MSG, ids[i]);
+        }
+    }
+    free(ids);
+    free(recs);
+    free(reqs);
+
+    if (rc != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    printf(M_BATCH_FOUND, found, n);
+    return found;
+}
+
+// qsort comparator for ids
+static int cmp_id(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * delete_window - Deletes ids[0..n), at most URING_DEPTH of them: locks
+ *                 them, reads them with one io_batch, clears the ones that
+ *                 exist with another and logs the deletes.  del[i] tells
+ *                 whether ids[i] was deleted.  Ids out of range are not
+ *                 locked, they are simply not deleted.
+ */
+static int delete_window(int fd, const int *ids, int n, student_t *recs, io_req_t *reqs, bool *del) {
+    int locked[URING_DEPTH], nlocked = 0, nreq = 0, rc = NO_ERROR;
+
+    // in id order, so two batch deletes can not deadlock on each other
+    for (int i = 0; i < n; i++) {
+        if (batch_id_ok(ids[i])) locked[nlocked++] = ids[i];
+    }
+    qsort(locked, nlocked, sizeof(int), cmp_id);
+    for (int i = 0; i < nlocked; i++) {
+        if (lock_record(fd, locked[i], F_WRLCK) != NO_ERROR) {
+            for (int j = 0; j < i; j++) unlock_record(fd, locked[j]);
+            return ERR_DB_FILE;
+        }
+    }
+    rc = read_batch(fd, ids, n, recs, reqs);
+
+    for (int i = 0; i < n && rc == NO_ERROR; i++) {
+        del[i] = recs[i].id == ids[i] && ids[i] != DELETED_STUDENT_ID;
+        for (int j = 0; j < i && del[i]; j++) {
+            if (ids[j] == ids[i]) del[i] = false;  // deleted earlier in the window
+        }
+        if (!del[i]) continue;
+
+        long slot = slot_of(ids[i]);
+        reqs[nreq].op = IO_WRITE;
+        reqs[nreq].buf = (void *)&EMPTY_STUDENT_RECORD;
+        reqs[nreq].len = STUDENT_RECORD_SIZE;
+        reqs[nreq].offset = (off_t)slot * STUDENT_RECORD_SIZE;
+        nreq++;
+    }
+    if (rc == NO_ERROR && io_batch(fd, reqs, nreq) != NO_ERROR) {
+        rc = ERR_DB_FILE;
+    }
+    for (int k = 0; k < nreq && rc == NO_ERROR; k++) {
+        if (reqs[k].res != STUDENT_RECORD_SIZE) rc = ERR_DB_FILE;
+    }
+
+    for (int i = 0; i < n && rc == NO_ERROR; i++) {
+        if (!del[i]) continue;
+        slot_map_set(ids[i], 0);
+        rc = wal_append(WAL_OP_DEL, ids[i], NULL);
+        if (lidx_remove(fd, &recs[i]) != NO_ERROR) {
+            unlink(LNAME_IDX_FILE);     // rebuilt from the db on next use
+        }
+        if (col_clear(fd, ids[i]) != NO_ERROR) {
+            col_close();
+            unlink(COLUMN_FILE);
+        }
+    }
+
+    for (int i = 0; i < nlocked; i++) {
+        unlock_record(fd, locked[i]);
+    }
+    return rc;
+}
+
+/*
+ * batch_del - Deletes the students whose ids are read from in (-D).  The
+ *             deletes are made durable by one log commit at the end.
+ *             Returns the number deleted.
+ */
+int batch_del(int fd, FILE *in) {
+    int *ids = NULL, n, deleted = 0, rc = NO_ERROR;
+    student_t recs[URING_DEPTH];
+    io_req_t reqs[URING_DEPTH];
+    bool del[URING_DEPTH];
+
+    if (pack_active()) {
+        printf(M_ERR_DB_PACKED);
+        return ERR_DB_OP;
+    }
+    n = read_ids(in, &ids);
+    if (n < 0) {
+        printf(M_ERR_MEMORY);
+        return ERR_DB_OP;
+    }
+
+    if (!batch_slots()) {
+        for (int i = 0; i < n; i++) {
+            if (!batch_id_ok(ids[i])) {
+                printf(M_STD_NOT_FND_MSG, ids[i]);
+                continue;
+            }
+            rc = del_student(fd, ids[i]);
+            if (rc == ERR_DB_FILE) break;
+            if (rc == NO_ERROR) deleted++;
+        }
+        free(ids);
+        return rc == ERR_DB_FILE ? ERR_DB_FILE : deleted;
+    }
+
+    for (int start = 0; start < n && rc == NO_ERROR; start += URING_DEPTH) {
+        int cnt = n - start < URING_DEPTH ? n - start : URING_DEPTH;
+        rc = delete_window(fd, &ids[start], cnt, recs, reqs, del);
+        for (int i = 0; i < cnt && rc == NO_ERROR; i++) {
+            if (del[i]) {
+                printf(M_STD_DEL_MSG, ids[start + i]);
+                deleted++;
+            } else {
+                printf(M_STD_NOT_FND_MSG, ids[start + i]);
+            }
+        }
+    }
+    free(ids);
+
+    if (rc == NO_ERROR) {
+        rc = wal_commit();
+    }
+    if (rc != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+    return deleted;
+}
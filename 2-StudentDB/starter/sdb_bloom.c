@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Bloom filter of the ids in a hash layout db (BLOOM_FILE), so lookups of
+// ids that are not there, like the duplicate check of every add, are
+// answered from memory instead of probing the table.  A compacted direct
+// layout db needs no filter, its slot map already knows every absent id.
+//
+// The filter has 1 << BLOOM_BITS_SHIFT bits per table bucket and is mapped
+// shared, so a bit set by one process is seen by every other process with
+// the db open.  Bits are set before the record is written and never
+// cleared: deleted ids stay "maybe there" until the table is rebuilt by a
+// resize or -x, which builds a new filter.  The header records the inode of
+// the db it belongs to, and a filter that does not match is rebuilt by the
+// next process that has the db to itself; until then lookups probe the
+// table.  An add still in the write-ahead log sets its bits again when the
+// log is replayed, so the filter is flushed before the log is emptied by a
+// checkpoint and a committed add is never hidden by bits lost in a crash.
+
+static bloom_hdr_t *bloom_map = NULL;
+static size_t bloom_len = 0;
+
+/*
+ * bloom_hash - Mixes id into 64 bits (the splitmix64 finalizer).  Bit i of
+ *              the filter for id is (h + i * (h >> 32 | 1)) mod its size.
+ */
+static uint64_t bloom_hash(int id) {
+    uint64_t h = (uint32_t)id + 0x9e3779b97f4a7c15ull;
+
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+/*
+ * bloom_set - Sets the bits of id in the filter words of 1 << bits bits.
+ */
+static void bloom_set(uint64_t *words, uint32_t bits, int id) {
+    uint64_t h = bloom_hash(id), step = h >> 32 | 1, mask = ((uint64_t)1 << bits) - 1;
+
+    for (int i = 0; i < BLOOM_HASHES; i++, h += step) {
+        uint64_t b = h & mask;
+        __atomic_fetch_or(&words[b / 64], (uint64_t)1 << (b % 64), __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * bloom_close - Unmaps the filter, lookups then probe the table.
+ */
+void bloom_close(void) {
+    if (bloom_map != NULL) {
+        munmap(bloom_map, bloom_len);
+    }
+    bloom_map = NULL;
+    bloom_len = 0;
+}
+
+/*
+ * bloom_reset - Removes the filter, used when the db is truncated or new.
+ */
+int bloom_reset(void) {
+    bloom_close();
+    if (unlink(BLOOM_FILE) == -1 && access(BLOOM_FILE, F_OK) == 0) {
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * bloom_build - Writes the filter of the n records in recs for the db file
+ *               with inode ino and a table of 1 << table_bits buckets,
+ *               through a temporary file renamed over BLOOM_FILE.
+ */
+int bloom_build(uint64_t ino, uint32_t table_bits, const student_t *recs, size_t n) {
+    bloom_hdr_t h = {0};
+    uint64_t *words;
+    size_t nwords;
+    int tfd, rc = NO_ERROR;
+
+    h.magic = BLOOM_MAGIC;
+    h.bits = table_bits + BLOOM_BITS_SHIFT;
+    h.db_ino = ino;
+    nwords = ((size_t)1 << h.bits) / 64;
+
+    words = calloc(nwords, sizeof(uint64_t));
+    if (words == NULL) {
+        return ERR_DB_OP;
+    }
+    for (size_t i = 0; i < n; i++) {
+        bloom_set(words, h.bits, recs[i].id);
+    }
+
+    tfd = open(TMP_BLOOM_FILE, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (tfd == -1) {
+        free(words);
+        return ERR_DB_FILE;
+    }
+    const char *p = (const char *)words;
+    size_t left = nwords * sizeof(uint64_t);
+    if (pwrite(tfd, &h, sizeof(h), 0) != sizeof(h)) rc = ERR_DB_FILE;
+    for (off_t off = 0; left > 0 && rc == NO_ERROR; ) {
+        ssize_t w = pwrite(tfd, p + off, left, sizeof(h) + off);
+        if (w <= 0) rc = ERR_DB_FILE;
+        else { off += w; left -= w; }
+    }
+    free(words);
+
+    // the bits must be on disk before the header that vouches for them is
+    if (rc == NO_ERROR && fsync(tfd) == -1) rc = ERR_DB_FILE;
+    if (close(tfd) == -1) rc = ERR_DB_FILE;
+    if (rc == NO_ERROR && rename(TMP_BLOOM_FILE, BLOOM_FILE) == -1) rc = ERR_DB_FILE;
+    if (rc != NO_ERROR) {
+        unlink(TMP_BLOOM_FILE);
+    }
+    return rc;
+}
+
+/*
+ * bloom_map_file - Maps BLOOM_FILE if it is a filter of the db in fd.
+ */
+static bool bloom_map_file(int fd) {
+    struct stat st, db_st;
+    bloom_hdr_t h;
+    int bfd = open(BLOOM_FILE, O_RDWR);
+    bool ok = false;
+
+    if (bfd == -1) {
+        return false;
+    }
+    if (fstat(fd, &db_st) == 0 && fstat(bfd, &st) == 0 &&
+        pread(bfd, &h, sizeof(h), 0) == sizeof(h) && h.magic == BLOOM_MAGIC &&
+        h.db_ino == (uint64_t)db_st.st_ino && h.bits >= 6 && h.bits < 48 &&
+        (uint64_t)st.st_size == sizeof(h) + ((uint64_t)1 << h.bits) / 8) {
+        bloom_map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, bfd, 0);
+        if (bloom_map == MAP_FAILED) {
+            bloom_map = NULL;
+        } else {
+            bloom_len = st.st_size;
+            ok = true;
+        }
+    }
+    close(bfd);
+    return ok;
+}
+
+/*
+ * bloom_open - Maps the filter of the hash layout db in fd.  A missing or
+ *              stale filter is rebuilt from the table if rebuild is true
+ *              (the db is held by this process alone), otherwise lookups
+ *              go without it.
+ */
+int bloom_open(int fd, bool rebuild) {
+    bloom_close();
+    if (bloom_map_file(fd) || !rebuild) {
+        return NO_ERROR;
+    }
+    if (hash_bloom_rebuild(fd) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    bloom_map_file(fd);
+    return NO_ERROR;
+}
+
+/*
+ * bloom_maybe - Returns false if id is certainly not in the db.
+ */
+bool bloom_maybe(int id) {
+    if (bloom_map == NULL) {
+        return true;
+    }
+
+    const uint64_t *words = (const uint64_t *)(bloom_map + 1);
+    uint64_t h = bloom_hash(id), step = h >> 32 | 1, mask = ((uint64_t)1 << bloom_map->bits) - 1;
+
+    for (int i = 0; i < BLOOM_HASHES; i++, h += step) {
+        uint64_t b = h & mask;
+        if (!(__atomic_load_n(&words[b / 64], __ATOMIC_RELAXED) & ((uint64_t)1 << (b % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * bloom_add - Records that id is in the db, before its record is written.
+ */
+void bloom_add(int id) {
+    if (bloom_map == NULL) {
+        return;
+    }
+    bloom_set((uint64_t *)(bloom_map + 1), bloom_map->bits, id);
+}
+
+/*
+ * bloom_sync - Writes the filter to disk, including bits set by other
+ *              processes through the shared mapping.
+ */
+int bloom_sync(void) {
+    if (bloom_map == NULL) {
+        return NO_ERROR;
+    }
+    return msync(bloom_map, bloom_len, MS_SYNC) == -1 ? ERR_DB_FILE : NO_ERROR;
+}
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Change log.  Every add and delete is appended to CHANGES_FILE as a
+// wal_record_t with its own magic, and -z appends a CHG_OP_ZERO record.
+// Unlike the write-ahead log it is never truncated, so a consumer that
+// copies the db downstream can read it from any point instead of rescanning
+// the db.  The LSN of a change is its position in the file (the first
+// change is LSN 1), which makes LSNs dense and lets a reader resume at
+// (lsn - 1) * sizeof(wal_record_t).
+//
+// A change is written when it is made, while its record lock is still held,
+// so changes of the same id are in the log in the order they were made.
+// Appends from different processes are serialized with a lock on the log
+// file itself.  The log is made durable together with the write-ahead log,
+// see wal_commit.  -e and -w read it without opening the db.
+
+int chg_enabled = 1;            // SDB_CHANGES=off turns the change log off
+
+static int chg_fd = -1;
+static bool chg_dirty = false;  // written since the last sync
+
+/*
+ * chg_config_from_env - Reads SDB_CHANGES (on|off).
+ */
+void chg_config_from_env(void) {
+    char *v = getenv(SDB_CHANGES_ENV);
+
+    chg_enabled = !(v != NULL && strcmp(v, "off") == 0);
+}
+
+/*
+ * chg_open - Opens the change log for appending, creating it if needed.
+ */
+int chg_open(void) {
+    chg_close();
+    if (!chg_enabled) {
+        return NO_ERROR;
+    }
+    chg_fd = open(CHANGES_FILE, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    return chg_fd == -1 ? ERR_DB_FILE : NO_ERROR;
+}
+
+/*
+ * chg_append - Appends a change: op is WAL_OP_PUT with the new record in s,
+ *              WAL_OP_DEL or CHG_OP_ZERO.  A torn record left at the end by
+ *              a crash is overwritten.
+ */
+int chg_append(int op, int id, const student_t *s) {
+    wal_record_t r;
+    struct stat st;
+    int rc = NO_ERROR;
+
+    if (chg_fd == -1) {
+        return NO_ERROR;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.magic = CHG_MAGIC;
+    r.op = op;
+    r.id = id;
+    if (op == WAL_OP_PUT) {
+        r.rec = *s;
+    }
+
+    if (db_lock_range(chg_fd, 0, 0, F_WRLCK, true) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    if (fstat(chg_fd, &st) == -1) {
+        rc = ERR_DB_FILE;
+    } else {
+        uint64_t n = st.st_size / sizeof(r);
+        r.lsn = n + 1;
+        r.crc = wal_checksum(&r);
+        if (pwrite(chg_fd, &r, sizeof(r), n * sizeof(r)) != sizeof(r)) rc = ERR_DB_FILE;
+    }
+    db_lock_range(chg_fd, 0, 0, F_UNLCK, false);
+
+    chg_dirty = true;
+    return rc;
+}
+
+/*
+ * chg_sync - Makes the changes written so far durable.
+ */
+int chg_sync(void) {
+    if (chg_fd == -1 || !chg_dirty) {
+        return NO_ERROR;
+    }
+    if (fdatasync(chg_fd) == -1) {
+        return ERR_DB_FILE;
+    }
+    chg_dirty = false;
+    return NO_ERROR;
+}
+
+/*
+ * chg_close - Closes the change log.
+ */
+void chg_close(void) {
+    if (chg_fd != -1) {
+        close(chg_fd);
+    }
+    chg_fd = -1;
+    chg_dirty = false;
+}
+
+/*
+ * chg_read - Prints the complete changes in the log after lsn and returns
+ *            the LSN of the last one printed.  A record that is still
+ *            being written ends the read, it is printed next time.
+ */
+static int64_t chg_read(int fd, int64_t lsn, out_buf_t *out) {
+    wal_record_t recs[CHG_READ_BATCH];
+
+    for (;;) {
+        ssize_t got = pread(fd, recs, sizeof(recs), lsn * sizeof(wal_record_t));
+        if (got < 0) {
+            return ERR_DB_FILE;
+        }
+
+        size_t n = got / sizeof(wal_record_t);
+        for (size_t i = 0; i < n; i++) {
+            if (recs[i].magic != CHG_MAGIC || recs[i].lsn != (uint64_t)lsn + 1 ||
+                recs[i].crc != wal_checksum(&recs[i])) {
+                return lsn;
+            }
+            if (out_change(&recs[i], out) != NO_ERROR) {
+                return ERR_DB_FILE;
+            }
+            lsn++;
+        }
+        if (n < CHG_READ_BATCH) {
+            return lsn;
+        }
+    }
+}
+
+/*
+ * chg_wait - Waits until the log at CHANGES_FILE may have grown: for an
+ *            inotify event on it, or CHG_POLL_MS if there is no watch.
+ */
+static void chg_wait(int ifd) {
+    char events[4096];
+
+    if (ifd == -1) {
+        usleep(CHG_POLL_MS * 1000);
+        return;
+    }
+    struct pollfd p = {.fd = ifd, .events = POLLIN};
+    if (poll(&p, 1, CHG_POLL_MS) > 0) {
+        while (read(ifd, events, sizeof(events)) > 0) {}   // drain
+    }
+}
+
+/*
+ * stream_changes - Prints the changes after lsn (-e), and with follow set
+ *                  keeps printing new ones as they are made until stdout is
+ *                  closed (-w).  Every line is "lsn,op,id,first_name,
+ *                  last_name,gpa" with op put, del or zero.
+ */
+int stream_changes(int64_t lsn, bool follow) {
+    int fd, ifd = -1;
+    out_buf_t out;
+
+    if (out_open(&out, PRINT_TEXT) != NO_ERROR) {
+        printf(M_ERR_MEMORY);
+        return ERR_DB_OP;
+    }
+
+    // the log is created by the first process that opens the db
+    while ((fd = open(CHANGES_FILE, O_RDONLY)) == -1) {
+        if (errno != ENOENT || !follow) {
+            out_close(&out);
+            printf(M_ERR_CHANGES_OPEN);
+            return ERR_DB_FILE;
+        }
+        usleep(CHG_POLL_MS * 1000);
+    }
+    if (follow) {
+        ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (ifd != -1 && inotify_add_watch(ifd, CHANGES_FILE, IN_MODIFY) == -1) {
+            close(ifd);
+            ifd = -1;
+        }
+    }
+
+    for (;;) {
+        lsn = chg_read(fd, lsn, &out);
+        if (lsn < 0 || out_flush(&out) != NO_ERROR || fflush(stdout) == EOF) {
+            break;
+        }
+        if (!follow) {
+            break;
+        }
+        chg_wait(ifd);
+    }
+
+    if (ifd != -1) close(ifd);
+    close(fd);
+    out_close(&out);
+    if (lsn < 0) {
+        printf(M_ERR_CHANGES_READ);
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
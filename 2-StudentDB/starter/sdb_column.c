@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// The column sidecar (COLUMN_FILE) mirrors the db layout with one
+// col_entry_t per slot: the entry for student id lives at
+// id*sizeof(col_entry_t), and an entry with id 0 is an empty slot.  Range
+// and gpa queries filter on these 8 byte entries and only read the full
+// 64 byte record of students that match.  Entry 0, which no student uses,
+// holds a sidecar_hdr_t naming the db file the sidecar was built from, so a
+// sidecar left over from another db (say one restored from a snapshot) is
+// rebuilt instead of trusted.  A hash layout db has no sidecar, its ids may
+// be spread over the whole int range; queries scan the table.
+
+static int col_fd = -1;     // open sidecar, opened on first use
+
+// db_scan callback used by col_rebuild
+static int put_entry(const student_t *s, void *arg) {
+    col_entry_t e = {s->id, s->gpa};
+    off_t offset = (off_t)s->id * sizeof(col_entry_t);
+
+    (void)arg;
+    if (pwrite(col_fd, &e, sizeof(e), offset) != sizeof(e)) {
+        return ERR_DB_FILE;
+    }
+    return 0;
+}
+
+/*
+ * col_create - Truncates the sidecar opened as col_fd and stamps it with the
+ *              inode of the db in fd.
+ */
+static int col_create(int fd) {
+    sidecar_hdr_t h = {0};
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+    h.db_ino = st.st_ino;
+    if (ftruncate(col_fd, 0) == -1 || pwrite(col_fd, &h, sizeof(h), 0) != sizeof(h)) {
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * col_rebuild - Recreates the column sidecar from the records in the db.
+ */
+int col_rebuild(int fd) {
+    int rc = NO_ERROR;
+
+    col_close();
+    if (db_layout == DB_LAYOUT_HASH) {
+        return NO_ERROR;
+    }
+    lock_meta(fd, LOCK_COL, F_WRLCK);
+    col_fd = open(COLUMN_FILE, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (col_fd == -1) {
+        rc = ERR_DB_FILE;
+    } else if (col_create(fd) != NO_ERROR || db_scan(fd, put_entry, NULL) != NO_ERROR) {
+        col_close();
+        unlink(COLUMN_FILE);
+        rc = ERR_DB_FILE;
+    }
+    unlock_meta(fd, LOCK_COL);
+    return rc;
+}
+
+/*
+ * col_open - Opens the sidecar for the db in fd, rebuilding it from the db if
+ *            it does not exist or was built from another db file.
+ */
+static int col_open(int fd) {
+    struct stat st;
+    sidecar_hdr_t h;
+
+    if (col_fd != -1) {
+        return NO_ERROR;
+    }
+
+    col_fd = open(COLUMN_FILE, O_RDWR);
+    if (col_fd == -1) {
+        return errno == ENOENT ? col_rebuild(fd) : ERR_DB_FILE;
+    }
+    if (fstat(fd, &st) == -1 || pread(col_fd, &h, sizeof(h), 0) != sizeof(h) ||
+        h.db_ino != (uint64_t)st.st_ino) {
+        return col_rebuild(fd);
+    }
+    return NO_ERROR;
+}
+
+/*
+ * col_close - Closes the sidecar, it is reopened on next use.
+ */
+void col_close(void) {
+    if (col_fd != -1) {
+        close(col_fd);
+    }
+    col_fd = -1;
+}
+
+/*
+ * col_reset - Empties the sidecar of the db in fd, used when the db is
+ *             truncated or new.
+ */
+int col_reset(int fd) {
+    col_close();
+    if (db_layout == DB_LAYOUT_HASH) {
+        // rebuilt from the db if it is ever unpacked to the direct layout
+        unlink(COLUMN_FILE);
+        return NO_ERROR;
+    }
+    col_fd = open(COLUMN_FILE, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (col_fd == -1) {
+        return ERR_DB_FILE;
+    }
+    if (col_create(fd) != NO_ERROR) {
+        col_close();
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * col_write_run - Stores the entries of n records with consecutive ids,
+ *                 starting at run[0]->id, with a single write.
+ */
+int col_write_run(int fd, student_t * const *run, int n) {
+    col_entry_t buf[512];
+
+    if (db_layout == DB_LAYOUT_HASH) {
+        return NO_ERROR;
+    }
+    if (col_open(fd) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+
+    for (int done = 0; done < n; ) {
+        int cnt = n - done < 512 ? n - done : 512;
+        for (int i = 0; i < cnt; i++) {
+            buf[i].id = run[done + i]->id;
+            buf[i].gpa = run[done + i]->gpa;
+        }
+
+        off_t offset = (off_t)run[done]->id * sizeof(col_entry_t);
+        ssize_t want = cnt * sizeof(col_entry_t);
+        if (pwrite(col_fd, buf, want, offset) != want) {
+            return ERR_DB_FILE;
+        }
+        done += cnt;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * col_clear - Marks the sidecar slot for id as empty.
+ */
+int col_clear(int fd, int id) {
+    col_entry_t e = {0, 0};
+    struct stat st;
+    off_t offset = (off_t)id * sizeof(col_entry_t);
+
+    if (db_layout == DB_LAYOUT_HASH) {
+        return NO_ERROR;
+    }
+    if (col_open(fd) != NO_ERROR || fstat(col_fd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+    if (offset >= st.st_size) {
+        return NO_ERROR;    // never stored, nothing to clear
+    }
+    if (pwrite(col_fd, &e, sizeof(e), offset) != sizeof(e)) {
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * col_map - Maps the sidecar read only, setting *col and its number of
+ *           entries *n, the header in entry 0 included.  Nothing is mapped
+ *           when it is empty.
+ */
+int col_map(int fd, const col_entry_t **col, size_t *n) {
+    struct stat st;
+
+    if (col_open(fd) != NO_ERROR || fstat(col_fd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+    *n = st.st_size / sizeof(col_entry_t);
+    *col = NULL;
+    if (*n == 0) {
+        return NO_ERROR;
+    }
+    *col = mmap(NULL, *n * sizeof(col_entry_t), PROT_READ, MAP_SHARED, col_fd, 0);
+    return *col == MAP_FAILED ? ERR_DB_FILE : NO_ERROR;
+}
+
+typedef struct query_scan {
+    int lo_id, hi_id, min_gpa, max_gpa;
+    student_t *recs;
+    size_t n, cap;
+} query_scan_t;
+
+// db_scan callback used by query_by_scan, keeps the students that match
+static int match_rec(const student_t *s, void *arg) {
+    query_scan_t *q = arg;
+
+    if (s->id < q->lo_id || s->id > q->hi_id || s->gpa < q->min_gpa || s->gpa > q->max_gpa) {
+        return 0;
+    }
+    if (q->n == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 256;
+        student_t *p = realloc(q->recs, cap * sizeof(student_t));
+        if (p == NULL) return ERR_DB_OP;
+        q->recs = p;
+        q->cap = cap;
+    }
+    q->recs[q->n++] = *s;
+    return 0;
+}
+
+// orders matches by id for query_by_scan
+static int cmp_match_id(const void *a, const void *b) {
+    const student_t *sa = a, *sb = b;
+    return (sa->id > sb->id) - (sa->id < sb->id);
+}
+
+/*
+ * query_by_scan - query_students for a hash layout db: scans the table and
+ *                 prints the matches in id order like the sidecar path.
+ */
+static int query_by_scan(int fd, int lo_id, int hi_id, int min_gpa, int max_gpa) {
+    query_scan_t q = {lo_id, hi_id, min_gpa, max_gpa, NULL, 0, 0};
+
+    if (db_scan(fd, match_rec, &q) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        free(q.recs);
+        return ERR_DB_FILE;
+    }
+    qsort(q.recs, q.n, sizeof(student_t), cmp_match_id);
+    for (size_t i = 0; i < q.n; i++) {
+        if (i == 0) {
+            printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+        }
+        printf(STUDENT_PRINT_FMT_STRING, q.recs[i].id, q.recs[i].fname, q.recs[i].lname,
+               q.recs[i].gpa / 100.0);
+    }
+    free(q.recs);
+
+    if (q.n == 0) {
+        printf(M_DB_NO_MATCH);
+        return SRCH_NOT_FOUND;
+    }
+    return (int)q.n;
+}
+
+/*
+ * query_students - Prints every student with lo_id <= id <= hi_id and
+ *                  min_gpa <= gpa <= max_gpa.  Only the matching slice of the
+ *                  column sidecar is read to evaluate the filter.  Returns
+ *                  the number of students printed, or SRCH_NOT_FOUND.
+ */
+int query_students(int fd, int lo_id, int hi_id, int min_gpa, int max_gpa) {
+    const col_entry_t *col;
+    student_t student;
+    size_t n;
+    int found = 0;
+
+    // an empty or wholly negative range matches nothing; a negative hi_id
+    // must not reach the size_t clamp below, where it wraps to the last id
+    if (hi_id < 0 || hi_id < lo_id) {
+        printf(M_DB_NO_MATCH);
+        return SRCH_NOT_FOUND;
+    }
+    if (db_layout == DB_LAYOUT_HASH) {
+        return query_by_scan(fd, lo_id, hi_id, min_gpa, max_gpa);
+    }
+    if (col_map(fd, &col, &n) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    if (lo_id < MIN_STD_ID) lo_id = MIN_STD_ID;   // entry 0 is the header
+    if (n > 0 && (size_t)hi_id >= n) hi_id = (int)(n - 1);
+
+    if (n > 0 && lo_id <= hi_id) {
+        for (int id = lo_id; id <= hi_id; id++) {
+            if (col[id].id == DELETED_STUDENT_ID) continue;
+            if (col[id].gpa < min_gpa || col[id].gpa > max_gpa) continue;
+            if (get_student(fd, col[id].id, &student) != NO_ERROR) continue;
+
+            if (found++ == 0) {
+                printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+            }
+            printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname, student.lname, student.gpa / 100.0);
+        }
+    }
+    if (n > 0) {
+        munmap((void *)col, n * sizeof(col_entry_t));
+    }
+
+    if (found == 0) {
+        printf(M_DB_NO_MATCH);
+        return SRCH_NOT_FOUND;
+    }
+    return found;
+}
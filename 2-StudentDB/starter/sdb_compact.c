@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// In-place compaction.  Records are normally stored in slot id of the db
+// file.  The first compaction creates SLOT_MAP_FILE, a header followed by
+// an int32 slot number for every possible id (0 = not stored), and from then
+// on the map decides where each record lives: get_student stays a single
+// lookup and new records are appended at the end of the file.
+//
+// Compaction walks the file in batches of COMPACT_BATCH slots, moving live
+// records down into the packed area at the front of the file.  The header
+// records how far it got (src) and where the packed area ends (dst), so it
+// can stop after any batch and resume later.  A record is only ever moved
+// into a slot the map on disk does not reference, and the moved records are
+// synced before the map is updated, so a crash at any point leaves a
+// consistent db (at worst with stale copies, which scans skip).  The space
+// between dst and src is released by punching holes instead of rewriting
+// the file.
+
+#define SLOT_MAP_LEN (sizeof(slot_map_hdr_t) + (MAX_STD_ID + 1) * sizeof(int32_t))
+
+int32_t *slot_map = NULL;                   // slot of every id, NULL if direct
+static slot_map_hdr_t *map_hdr = NULL;      // mapping of SLOT_MAP_FILE
+static int map_fd = -1;
+
+/*
+ * slot_map_close - Unmaps and closes the slot map.
+ */
+void slot_map_close(void) {
+    if (map_hdr != NULL) {
+        munmap(map_hdr, SLOT_MAP_LEN);
+    }
+    if (map_fd != -1) {
+        close(map_fd);
+    }
+    map_hdr = NULL;
+    slot_map = NULL;
+    map_fd = -1;
+}
+
+/*
+ * map_slot_file - Maps the slot map file opened as map_fd.
+ */
+static int map_slot_file(void) {
+    void *p = mmap(NULL, SLOT_MAP_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, 0);
+
+    if (p == MAP_FAILED) {
+        slot_map_close();
+        return ERR_DB_FILE;
+    }
+    map_hdr = p;
+    slot_map = (int32_t *)(map_hdr + 1);
+    return NO_ERROR;
+}
+
+/*
+ * slot_map_open - Loads the slot map of a compacted db.  A db that was never
+ *                 compacted has no map and uses direct id addressing.
+ */
+int slot_map_open(void) {
+    struct stat st;
+
+    slot_map_close();
+    map_fd = open(SLOT_MAP_FILE, O_RDWR);
+    if (map_fd == -1) {
+        return errno == ENOENT ? NO_ERROR : ERR_DB_FILE;
+    }
+
+    if (fstat(map_fd, &st) == -1 || st.st_size != (off_t)SLOT_MAP_LEN ||
+        map_slot_file() != NO_ERROR || map_hdr->magic != SLOT_MAP_MAGIC) {
+        slot_map_close();
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * slot_map_reset - Removes the slot map, used when the db is truncated.
+ */
+int slot_map_reset(void) {
+    slot_map_close();
+    if (unlink(SLOT_MAP_FILE) == -1 && errno != ENOENT) {
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * slot_of - Returns the slot that holds student id, or -1 if the id is not
+ *           stored.  Without a slot map this is the id itself.
+ */
+long slot_of(int id) {
+    if (slot_map == NULL) {
+        return id;
+    }
+    if (id < MIN_STD_ID || id > MAX_STD_ID || slot_map[id] == 0) {
+        return -1;
+    }
+    return slot_map[id];
+}
+
+/*
+ * slot_map_set - Records that student id now lives in slot (0 = removed).
+ */
+void slot_map_set(int id, long slot) {
+    if (slot_map != NULL && id >= MIN_STD_ID && id <= MAX_STD_ID) {
+        slot_map[id] = (int32_t)slot;
+    }
+}
+
+/*
+ * slot_is_current - Returns false for a stale copy of a record, one the slot
+ *                   map does not point to (left behind by an interrupted
+ *                   compaction).
+ */
+bool slot_is_current(const student_t *s, size_t slot) {
+    if (slot == 0) {
+        return false;   // never a record, may hold a packed or hash header
+    }
+    if (slot_map == NULL) {
+        return true;
+    }
+    return s->id >= MIN_STD_ID && s->id <= MAX_STD_ID && (size_t)slot_map[s->id] == slot;
+}
+
+// db_scan callback used by slot_map_create, records are still in slot id
+static int map_direct(const student_t *s, void *arg) {
+    int32_t *map = arg;
+
+    if (s->id >= MIN_STD_ID && s->id <= MAX_STD_ID) {
+        map[s->id] = s->id;
+    }
+    return 0;
+}
+
+/*
+ * slot_map_create - Creates the slot map for a db that still uses direct
+ *                   addressing.  The map is durable before anything moves.
+ */
+static int slot_map_create(int fd) {
+    int rc;
+
+    map_fd = open(SLOT_MAP_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (map_fd == -1) {
+        return ERR_DB_FILE;
+    }
+    if (ftruncate(map_fd, SLOT_MAP_LEN) == -1 || map_slot_file() != NO_ERROR) {
+        slot_map_reset();
+        return ERR_DB_FILE;
+    }
+
+    // scan with direct addressing, the map only takes effect once filled
+    int32_t *map = slot_map;
+    slot_map = NULL;
+    rc = db_scan(fd, map_direct, map);
+    slot_map = map;
+    if (rc != NO_ERROR) {
+        slot_map_reset();
+        return ERR_DB_FILE;
+    }
+    map_hdr->magic = SLOT_MAP_MAGIC;
+
+    if (msync(map_hdr, SLOT_MAP_LEN, MS_SYNC) == -1 || sync_dir(SLOT_MAP_FILE) != NO_ERROR) {
+        slot_map_reset();
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * clear_slots - Zeroes slots [from, to) of the db.  Whole pages are released
+ *               with a hole punch, only partial pages at the edges are
+ *               written.
+ */
+static int clear_slots(int fd, long from, long to) {
+    static const char zeros[SCAN_PAGE_SIZE] = {0};
+    off_t start = (off_t)from * STUDENT_RECORD_SIZE;
+    off_t end = (off_t)to * STUDENT_RECORD_SIZE;
+    off_t a = (start + SCAN_PAGE_SIZE - 1) / SCAN_PAGE_SIZE * SCAN_PAGE_SIZE;
+    off_t b = end / SCAN_PAGE_SIZE * SCAN_PAGE_SIZE;
+
+    if (start >= end) {
+        return NO_ERROR;
+    }
+    if (a >= b) {
+        a = b = end;    // no whole page inside, zero everything by hand
+    } else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, a, b - a) == -1) {
+        a = b = end;
+    }
+
+    for (off_t off = start; off < a; ) {
+        size_t len = a - off < SCAN_PAGE_SIZE ? a - off : SCAN_PAGE_SIZE;
+        if (pwrite(fd, zeros, len, off) != (ssize_t)len) return ERR_DB_FILE;
+        off += len;
+    }
+    if (b < end && pwrite(fd, zeros, end - b, b) != end - b) {
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * flush_moves - Writes the nout records in out to the slots starting at
+ *               out_start and syncs them, then points the map at them and
+ *               records the progress src and dst in the header.
+ */
+static int flush_moves(int fd, const student_t *out, const int *ids, int nout, long out_start,
+                       long src, long dst) {
+    ssize_t want = (ssize_t)nout * STUDENT_RECORD_SIZE;
+
+    if (nout > 0) {
+        if (pwrite(fd, out, want, (off_t)out_start * STUDENT_RECORD_SIZE) != want ||
+            fdatasync(fd) == -1) {
+            return ERR_DB_FILE;
+        }
+    }
+    for (int k = 0; k < nout; k++) {
+        slot_map_set(ids[k], out_start + k);
+    }
+    map_hdr->src = src;
+    map_hdr->dst = dst;
+    return msync(map_hdr, SLOT_MAP_LEN, MS_SYNC) == -1 ? ERR_DB_FILE : NO_ERROR;
+}
+
+/*
+ * compact_batch - Runs one batch of the compaction, examining the slots from
+ *                 map_hdr->src up to COMPACT_BATCH of them, ending before
+ *                 slot end.
+ */
+static int compact_batch(int fd, long end, student_t *buf, student_t *out, int *ids) {
+    long batch_start = map_hdr->src;
+    long dst = map_hdr->dst, out_start = 0, i;
+    long limit = end - batch_start < COMPACT_BATCH ? end : batch_start + COMPACT_BATCH;
+    ssize_t want = (limit - batch_start) * STUDENT_RECORD_SIZE;
+    int nout = 0;
+
+    if (pread(fd, buf, want, (off_t)batch_start * STUDENT_RECORD_SIZE) != want) {
+        return ERR_DB_FILE;
+    }
+
+    for (i = batch_start; i < limit; i++) {
+        student_t *r = &buf[i - batch_start];
+
+        if (r->id == DELETED_STUDENT_ID || !slot_is_current(r, i)) continue;
+        if (dst == i) {             // already packed, stays where it is
+            dst++;
+            continue;
+        }
+        // only overwrite slots the map on disk does not point to: those
+        // before the batch, or ones that held no live record when read.  A
+        // live record queued to move out of dst is flushed first, after
+        // which the map no longer points at dst and the batch goes on.
+        if (dst >= batch_start && buf[dst - batch_start].id != DELETED_STUDENT_ID &&
+            slot_is_current(&buf[dst - batch_start], dst)) {
+            if (flush_moves(fd, out, ids, nout, out_start, i, dst) != NO_ERROR) {
+                return ERR_DB_FILE;
+            }
+            nout = 0;
+        }
+        if (nout == 0) {
+            out_start = dst;        // records before it stayed in place
+        }
+        out[nout] = *r;
+        ids[nout++] = r->id;
+        dst++;
+    }
+
+    if (flush_moves(fd, out, ids, nout, out_start, i, dst) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+
+    // nothing references [dst, src) any more
+    return clear_slots(fd, dst, i);
+}
+
+/*
+ * compact_db - Compacts the db in fd in place, stopping after max_batches
+ *              batches (0 = run to completion).  Returns 1 once the db is
+ *              fully compacted, 0 if it stopped early, or ERR_DB_FILE.
+ *              *done and *total report the progress in slots.
+ */
+int compact_db(int fd, long max_batches, long *done, long *total) {
+    struct stat st;
+    student_t *buf, *out;
+    int *ids, rc = NO_ERROR;
+
+    if (slot_map == NULL && slot_map_create(fd) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    if (!map_hdr->active) {
+        map_hdr->src = 1;      // slot 0 is never used, ids start at 1
+        map_hdr->dst = 1;
+        map_hdr->active = 1;
+    }
+    if (fstat(fd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+    long end = st.st_size / STUDENT_RECORD_SIZE;
+
+    buf = malloc(COMPACT_BATCH * sizeof(student_t));
+    out = malloc(COMPACT_BATCH * sizeof(student_t));
+    ids = malloc(COMPACT_BATCH * sizeof(int));
+    if (buf == NULL || out == NULL || ids == NULL) {
+        rc = ERR_DB_FILE;
+    }
+
+    for (long n = 0; rc == NO_ERROR && map_hdr->src < end; n++) {
+        if (max_batches > 0 && n == max_batches) break;
+        rc = compact_batch(fd, end, buf, out, ids);
+    }
+    free(buf);
+    free(out);
+    free(ids);
+    if (rc != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+
+    *done = map_hdr->src;
+    *total = end;
+    if (map_hdr->src < end) {
+        return 0;
+    }
+
+    // everything past the packed area is garbage now
+    if (ftruncate(fd, (off_t)map_hdr->dst * STUDENT_RECORD_SIZE) == -1) {
+        return ERR_DB_FILE;
+    }
+    map_hdr->src = map_hdr->dst;
+    map_hdr->active = 0;
+    if (msync(map_hdr, sizeof(*map_hdr), MS_SYNC) == -1) {
+        return ERR_DB_FILE;
+    }
+    *done = *total = map_hdr->dst;
+    return 1;
+}
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Output of -p.  Records are formatted into an OUT_BUF_SIZE buffer that is
+// handed to stdout in a few large fwrites, instead of one printf per record.
+// The text format produces exactly what STUDENT_PRINT_FMT_STRING would, with
+// the gpa formatted from the integer instead of through gpa / 100.0.  CSV
+// output, names quoted where needed, can be fed back to -b, and binary
+// output is raw student_t records as read by -b bin.  A parallel print
+// formats every range of the db into a part buffer of the same size, and
+// the parts take turns writing to stdout in order: the first part writes
+// its buffer whenever it fills, a later part that fills its buffer waits
+// until every part before it is done.  The change stream of -e and -w is
+// written with the same CSV fields, see out_change.
+
+/*
+ * put_int - Writes v in decimal at p, returns the end.
+ */
+static char *put_int(char *p, long v) {
+    char tmp[24];
+    int n = 0;
+    unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+
+    if (v < 0) *p++ = '-';
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    while (n > 0) *p++ = tmp[--n];
+    return p;
+}
+
+/*
+ * put_padded - Writes at most max chars of s at p, padded with blanks to
+ *              width, like "%-width.maxs".
+ */
+static char *put_padded(char *p, const char *s, size_t max, size_t width) {
+    size_t n = strnlen(s, max);
+
+    memcpy(p, s, n);
+    if (n < width) {
+        memset(p + n, ' ', width - n);
+        n = width;
+    }
+    return p + n;
+}
+
+/*
+ * put_gpa - Writes gpa / 100 with two decimals, what "%.2f" prints for
+ *           gpa / 100.0.
+ */
+static char *put_gpa(char *p, int gpa) {
+    long v = gpa;
+
+    if (v < 0) {
+        *p++ = '-';
+        v = -v;
+    }
+    p = put_int(p, v / 100);
+    *p++ = '.';
+    *p++ = '0' + v % 100 / 10;
+    *p++ = '0' + v % 10;
+    return p;
+}
+
+/*
+ * put_csv_field - Writes a name as a CSV field, quoted if it is empty or
+ *                 holds a comma, quote, blank or line break, all of which -b
+ *                 would otherwise take for a field separator.
+ */
+static char *put_csv_field(char *p, const char *s, size_t max) {
+    size_t n = strnlen(s, max);
+
+    if (n > 0 && strcspn(s, ",\" \t\r\n") >= n) {
+        memcpy(p, s, n);
+        return p + n;
+    }
+    *p++ = '"';
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '"') *p++ = '"';
+        *p++ = s[i];
+    }
+    *p++ = '"';
+    return p;
+}
+
+/*
+ * out_flush - Hands the buffered output to stdout.
+ */
+int out_flush(out_buf_t *o) {
+    if (o->len > 0 && fwrite(o->buf, 1, o->len, stdout) != o->len) {
+        return ERR_DB_FILE;
+    }
+    o->len = 0;
+    return NO_ERROR;
+}
+
+/*
+ * out_open - Prepares o for writing records in format (PRINT_TEXT,
+ *            PRINT_CSV or PRINT_BIN).
+ */
+int out_open(out_buf_t *o, int format) {
+    o->buf = malloc(OUT_BUF_SIZE);
+    o->len = 0;
+    o->cap = OUT_BUF_SIZE;
+    o->part = false;
+    o->format = format;
+    o->nrecs = 0;
+    o->turn = NULL;
+    o->index = 0;
+    if (o->buf == NULL) {
+        return ERR_DB_OP;
+    }
+    if (format == PRINT_CSV) {
+        o->len = strlen(CSV_HEADER);
+        memcpy(o->buf, CSV_HEADER, o->len);
+    }
+    return NO_ERROR;
+}
+
+/*
+ * out_turn_init - Prepares t for a parallel print, part 0 writes first.
+ */
+void out_turn_init(out_turn_t *t) {
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    t->next = 0;
+    t->hdr = false;
+    t->rc = NO_ERROR;
+}
+
+/*
+ * out_turn_destroy - Frees what out_turn_init set up.
+ */
+void out_turn_destroy(out_turn_t *t) {
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+}
+
+/*
+ * out_open_part - Prepares o for the records of range index of a parallel
+ *                 print.  It holds no headers: the CSV header is written by
+ *                 the output before the scan, and the text header by the
+ *                 first part that has records.
+ */
+int out_open_part(out_buf_t *o, int format, out_turn_t *turn, int index) {
+    if (out_open(o, format) != NO_ERROR) {
+        return ERR_DB_OP;
+    }
+    o->len = 0;
+    o->part = true;
+    o->turn = turn;
+    o->index = index;
+    return NO_ERROR;
+}
+
+/*
+ * out_wait_turn - Waits until part o may write to stdout.  The turn only
+ *                 moves on in out_part_done, so until then the part owns
+ *                 the output and the rest of its out_turn_t.
+ */
+static void out_wait_turn(out_buf_t *o) {
+    pthread_mutex_lock(&o->turn->lock);
+    while (o->turn->next != o->index) {
+        pthread_cond_wait(&o->turn->cond, &o->turn->lock);
+    }
+    pthread_mutex_unlock(&o->turn->lock);
+}
+
+/*
+ * out_flush_part - Writes what part o buffered once it is its turn.
+ *                  Fails without writing if an earlier part failed.
+ */
+static int out_flush_part(out_buf_t *o) {
+    out_turn_t *t = o->turn;
+
+    out_wait_turn(o);
+    if (t->rc != NO_ERROR) {
+        return t->rc;
+    }
+    if (o->len == 0) {
+        return NO_ERROR;
+    }
+    if (o->format == PRINT_TEXT && !t->hdr) {
+        printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+        t->hdr = true;
+    }
+    if (fwrite(o->buf, 1, o->len, stdout) != o->len) {
+        return ERR_DB_FILE;
+    }
+    o->len = 0;
+    return NO_ERROR;
+}
+
+/*
+ * out_part_done - db_scan_parts done hook of a parallel print: writes what
+ *                 is left of the part in arg and hands the turn to the next
+ *                 part, also when the scan of the part failed.
+ */
+int out_part_done(void *arg, int rc) {
+    out_buf_t *o = arg;
+    out_turn_t *t = o->turn;
+
+    if (rc == NO_ERROR) {
+        rc = out_flush_part(o);
+    } else {
+        out_wait_turn(o);
+    }
+    if (rc != NO_ERROR && t->rc == NO_ERROR) {
+        t->rc = rc;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    t->next++;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    return rc;
+}
+
+/*
+ * out_reserve - Makes room for one more line by flushing, for a part once
+ *               it is its turn.
+ */
+static int out_reserve(out_buf_t *o) {
+    if (o->len + OUT_LINE_MAX <= o->cap) {
+        return NO_ERROR;
+    }
+    return o->part ? out_flush_part(o) : out_flush(o);
+}
+
+/*
+ * out_record - db_scan callback that appends one record to the out_buf_t
+ *              in arg, flushing first if it might not fit.
+ */
+int out_record(const student_t *s, void *arg) {
+    out_buf_t *o = arg;
+    char *p;
+    int rc;
+
+    if ((rc = out_reserve(o)) != NO_ERROR) {
+        return rc;
+    }
+    p = o->buf + o->len;
+
+    switch (o->format) {
+        case PRINT_BIN:
+            memcpy(p, s, STUDENT_RECORD_SIZE);
+            p += STUDENT_RECORD_SIZE;
+            break;
+
+        case PRINT_CSV:
+            p = put_int(p, s->id);
+            *p++ = ',';
+            p = put_csv_field(p, s->fname, sizeof(s->fname));
+            *p++ = ',';
+            p = put_csv_field(p, s->lname, sizeof(s->lname));
+            *p++ = ',';
+            p = put_int(p, s->gpa);
+            *p++ = '\n';
+            break;
+
+        default:
+            if (o->nrecs == 0 && !o->part) {
+                p += sprintf(p, STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+            }
+            char *start = p;
+            p = put_int(p, s->id);
+            while (p - start < 6) *p++ = ' ';
+            *p++ = ' ';
+            p = put_padded(p, s->fname, 24, 24);
+            *p++ = ' ';
+            p = put_padded(p, s->lname, 32, 32);
+            *p++ = ' ';
+            p = put_gpa(p, s->gpa);     // never shorter than the width of 3
+            *p++ = '\n';
+    }
+
+    o->len = p - o->buf;
+    o->nrecs++;
+    return 0;
+}
+
+/*
+ * out_change - Appends one change log record as a "lsn,op," prefix and the
+ *              CSV fields of the record, empty where the op has none.
+ */
+int out_change(const wal_record_t *r, out_buf_t *o) {
+    char *p;
+
+    if (out_reserve(o) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    p = o->buf + o->len;
+
+    p = put_int(p, (long)r->lsn);
+    if (r->op == WAL_OP_PUT) {
+        memcpy(p, ",put,", 5);
+        p += 5;
+        p = put_int(p, r->id);
+        *p++ = ',';
+        p = put_csv_field(p, r->rec.fname, sizeof(r->rec.fname));
+        *p++ = ',';
+        p = put_csv_field(p, r->rec.lname, sizeof(r->rec.lname));
+        *p++ = ',';
+        p = put_int(p, r->rec.gpa);
+    } else if (r->op == WAL_OP_DEL) {
+        memcpy(p, ",del,", 5);
+        p += 5;
+        p = put_int(p, r->id);
+        memcpy(p, ",,,", 3);
+        p += 3;
+    } else {
+        memcpy(p, ",zero,,,,", 9);
+        p += 9;
+    }
+    *p++ = '\n';
+
+    o->len = p - o->buf;
+    o->nrecs++;
+    return NO_ERROR;
+}
+
+/*
+ * out_close - Flushes what is left and frees the buffer.  A part is only
+ *             freed, out_part_done has written it.
+ */
+int out_close(out_buf_t *o) {
+    int rc = o->part ? NO_ERROR : out_flush(o);
+
+    free(o->buf);
+    o->buf = NULL;
+    return rc;
+}
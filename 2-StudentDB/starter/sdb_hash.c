@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Hash layout.  A db created with SDB_LAYOUT=hash is an open addressing hash
+// table instead of keeping student id in slot id, so ids can use the whole
+// positive int range without the file growing with the largest id:
+//
+//   hash_hdr_t          in slot 0
+//   bucket b            in slot b + 1, for 1 << bits buckets
+//
+// A record lives in its home bucket (a multiplicative hash of its id) or the
+// first free bucket after it.  Lookups read HASH_WINDOW buckets at a time,
+// one or two pages, and the table is kept at most 3/4 full so they rarely
+// need a second window.  Deletes shift the rest of the cluster back instead
+// of leaving tombstones.  Buckets are guarded by LOCK_HASH (writes move
+// records of other ids); growing the table rebuilds it in TMP_DB_FILE and
+// renames it over the db with the db locked exclusively.  A Bloom filter of
+// the ids answers most lookups of absent ids without probing, see
+// sdb_bloom.c.
+
+/*
+ * hash_home - Returns the home bucket of id in a table of 1 << bits buckets.
+ */
+static uint32_t hash_home(int id, uint32_t bits) {
+    return ((uint32_t)id * 2654435769u) >> (32 - bits);
+}
+
+/*
+ * read_hdr - Reads and checks the table header.
+ */
+static int read_hdr(int fd, hash_hdr_t *h) {
+    student_t rec;
+
+    if (read_slots(fd, 0, 1, &rec) != 1) {
+        return ERR_DB_FILE;
+    }
+    memcpy(h, &rec, sizeof(*h));
+    if (h->magic != HASH_MAGIC || h->bits < HASH_MIN_BITS || h->bits > HASH_MAX_BITS) {
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * write_hdr - Stores the table header in slot 0.
+ */
+static int write_hdr(int fd, const hash_hdr_t *h) {
+    student_t rec;
+
+    memcpy(&rec, h, sizeof(rec));
+    return write_slot(fd, 0, &rec);
+}
+
+/*
+ * hash_find - Probes for id.  Returns NO_ERROR with the record in s and its
+ *             bucket in pos, or SRCH_NOT_FOUND with pos set to the free
+ *             bucket where id would go.  ERR_DB_OP means the table is full.
+ */
+static int hash_find(int fd, const hash_hdr_t *h, int id, uint32_t *pos, student_t *s) {
+    student_t win[HASH_WINDOW];
+    uint32_t mask = (1u << h->bits) - 1;
+    uint32_t b = hash_home(id, h->bits);
+
+    for (uint32_t seen = 0; seen <= mask; ) {
+        size_t n = mask + 1 - b < HASH_WINDOW ? mask + 1 - b : HASH_WINDOW;
+        if (read_slots(fd, (size_t)b + 1, n, win) != n) {
+            return ERR_DB_FILE;
+        }
+        for (size_t i = 0; i < n && seen <= mask; i++, seen++) {
+            if (win[i].id == id) {
+                *pos = b + i;
+                *s = win[i];
+                return NO_ERROR;
+            }
+            if (win[i].id == DELETED_STUDENT_ID) {
+                *pos = b + i;
+                return SRCH_NOT_FOUND;
+            }
+        }
+        b = (b + n) & mask;
+    }
+    return ERR_DB_OP;
+}
+
+/*
+ * hash_create - Writes an empty table of 1 << HASH_MIN_BITS buckets and its
+ *               empty filter to the empty db in fd.
+ */
+int hash_create(int fd) {
+    hash_hdr_t h = {0};
+
+    struct stat st;
+
+    h.magic = HASH_MAGIC;
+    h.bits = HASH_MIN_BITS;
+    if (ftruncate(fd, ((off_t)1 + (1 << h.bits)) * STUDENT_RECORD_SIZE) == -1 ||
+        pwrite(fd, &h, sizeof(h), 0) != sizeof(h) || fstat(fd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+    db_layout = DB_LAYOUT_HASH;
+    return bloom_build(st.st_ino, h.bits, NULL, 0);
+}
+
+/*
+ * hash_open - Sets db_layout from the db in fd, hash if slot 0 holds a
+ *             table header.
+ */
+int hash_open(int fd) {
+    hash_hdr_t h;
+
+    db_layout = DB_LAYOUT_DIRECT;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != HASH_MAGIC) {
+        return NO_ERROR;
+    }
+    if (h.bits < HASH_MIN_BITS || h.bits > HASH_MAX_BITS) {
+        return ERR_DB_FILE;
+    }
+    db_layout = DB_LAYOUT_HASH;
+    return NO_ERROR;
+}
+
+/*
+ * hash_get - Reads the record of student id.  Returns SRCH_NOT_FOUND if
+ *            the id is not in the table, without probing if the filter
+ *            rules it out.
+ */
+int hash_get(int fd, int id, student_t *s) {
+    hash_hdr_t h;
+    uint32_t pos;
+    int rc;
+
+    if (!bloom_maybe(id)) {
+        return SRCH_NOT_FOUND;
+    }
+    lock_meta(fd, LOCK_HASH, F_RDLCK);
+    rc = read_hdr(fd, &h);
+    if (rc == NO_ERROR) {
+        rc = hash_find(fd, &h, id, &pos, s);
+        if (rc == ERR_DB_OP) rc = SRCH_NOT_FOUND;   // full and not there
+    }
+    unlock_meta(fd, LOCK_HASH);
+    return rc;
+}
+
+/*
+ * hash_put - Stores s, replacing the record with the same id if there is
+ *            one.  The caller makes room with hash_resize beforehand.
+ */
+int hash_put(int fd, const student_t *s) {
+    hash_hdr_t h;
+    student_t cur;
+    uint32_t pos;
+    int rc;
+
+    lock_meta(fd, LOCK_HASH, F_WRLCK);
+    rc = read_hdr(fd, &h);
+    if (rc == NO_ERROR) {
+        rc = hash_find(fd, &h, s->id, &pos, &cur);
+    }
+    if (rc == NO_ERROR || rc == SRCH_NOT_FOUND) {
+        bool added = rc == SRCH_NOT_FOUND;
+        // before readers can find the record.  Also when it is already
+        // stored: a log replay rewrites records whose bits the filter on
+        // disk may never have received
+        bloom_add(s->id);
+        rc = write_slot(fd, (size_t)pos + 1, s);
+        if (rc == NO_ERROR && added) {
+            h.count++;
+            rc = write_hdr(fd, &h);
+        }
+    }
+    unlock_meta(fd, LOCK_HASH);
+    return rc == NO_ERROR ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ * hash_del - Removes student id.  Records after it in the cluster whose
+ *            home bucket does not lie between the hole and themselves are
+ *            moved back into the hole, so every record stays reachable from
+ *            its home bucket without tombstones.
+ */
+int hash_del(int fd, int id) {
+    hash_hdr_t h;
+    student_t cur;
+    uint32_t hole, mask;
+    int rc;
+
+    lock_meta(fd, LOCK_HASH, F_WRLCK);
+    rc = read_hdr(fd, &h);
+    if (rc == NO_ERROR) {
+        rc = hash_find(fd, &h, id, &hole, &cur);
+    }
+    if (rc != NO_ERROR) {
+        unlock_meta(fd, LOCK_HASH);
+        return rc == ERR_DB_FILE ? ERR_DB_FILE : NO_ERROR;  // nothing to remove
+    }
+
+    mask = (1u << h.bits) - 1;
+    for (uint32_t j = (hole + 1) & mask; rc == NO_ERROR; j = (j + 1) & mask) {
+        if (read_slots(fd, (size_t)j + 1, 1, &cur) != 1) {
+            rc = ERR_DB_FILE;
+            break;
+        }
+        if (cur.id == DELETED_STUDENT_ID) break;
+
+        // cur can move if its home is not cyclically in (hole, j]
+        uint32_t k = hash_home(cur.id, h.bits);
+        bool stays = hole <= j ? (hole < k && k <= j) : (hole < k || k <= j);
+        if (!stays) {
+            rc = write_slot(fd, (size_t)hole + 1, &cur);
+            hole = j;
+        }
+    }
+    if (rc == NO_ERROR) rc = write_slot(fd, (size_t)hole + 1, &EMPTY_STUDENT_RECORD);
+    if (rc == NO_ERROR) {
+        h.count--;
+        rc = write_hdr(fd, &h);
+    }
+    unlock_meta(fd, LOCK_HASH);
+    return rc;
+}
+
+/*
+ * hash_full - Returns true if adding extra records would take the table
+ *             past 3/4 full.
+ */
+bool hash_full(int fd, long extra) {
+    hash_hdr_t h;
+
+    if (read_hdr(fd, &h) != NO_ERROR) {
+        return false;   // let the write report the error
+    }
+    return ((uint64_t)h.count + extra) * 4 > ((uint64_t)3 << h.bits);
+}
+
+typedef struct hash_build {
+    student_t *recs;
+    size_t n, cap;
+} hash_build_t;
+
+// db_scan callback used by hash_resize
+static int collect_rec(const student_t *s, void *arg) {
+    hash_build_t *b = arg;
+
+    if (b->n == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 1024;
+        student_t *p = realloc(b->recs, cap * sizeof(student_t));
+        if (p == NULL) return ERR_DB_OP;
+        b->recs = p;
+        b->cap = cap;
+    }
+    b->recs[b->n++] = *s;
+    return 0;
+}
+
+/*
+ * hash_resize - Rebuilds the table at the smallest size that holds its
+ *               records plus extra more, with LOCK_OPEN held exclusively.
+ *               With extra > 0 the table only grows (an add or bulk load
+ *               making room), with extra 0 it may shrink (-x).  The new
+ *               table is written to TMP_DB_FILE with a new filter and
+ *               renamed over the db, then fd follows it.
+ */
+int hash_resize(int fd, long extra) {
+    hash_build_t b = {NULL, 0, 0};
+    hash_hdr_t h;
+    student_t *table;
+    struct stat st;
+    uint32_t bits = HASH_MIN_BITS;
+    int tfd, rc = NO_ERROR;
+
+    if (read_hdr(fd, &h) != NO_ERROR || db_scan(fd, collect_rec, &b) != NO_ERROR) {
+        free(b.recs);
+        return ERR_DB_FILE;
+    }
+    while (bits < HASH_MAX_BITS && ((uint64_t)b.n + extra) * 4 > ((uint64_t)3 << bits)) {
+        bits++;
+    }
+    if (bits == h.bits || (extra > 0 && bits < h.bits)) {
+        // a compaction at the same size still drops deleted ids from the filter
+        if (extra == 0) {
+            rc = fstat(fd, &st) == -1 ? ERR_DB_FILE : bloom_build(st.st_ino, h.bits, b.recs, b.n);
+            if (rc == NO_ERROR) rc = bloom_open(fd, false);
+        }
+        free(b.recs);
+        return rc;
+    }
+
+    size_t nbuckets = (size_t)1 << bits;
+    table = calloc(nbuckets + 1, sizeof(student_t));
+    if (table == NULL) {
+        free(b.recs);
+        return ERR_DB_OP;
+    }
+    h.bits = bits;
+    h.count = (uint32_t)b.n;
+    memcpy(&table[0], &h, sizeof(h));
+    for (size_t i = 0; i < b.n; i++) {
+        uint32_t k = hash_home(b.recs[i].id, bits);
+        while (table[k + 1].id != DELETED_STUDENT_ID) k = (k + 1) & (nbuckets - 1);
+        table[k + 1] = b.recs[i];
+    }
+
+    tfd = open(TMP_DB_FILE, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (tfd == -1) {
+        free(table);
+        free(b.recs);
+        return ERR_DB_FILE;
+    }
+    const char *p = (const char *)table;
+    size_t left = (nbuckets + 1) * sizeof(student_t);
+    for (off_t off = 0; left > 0 && rc == NO_ERROR; ) {
+        ssize_t n = pwrite(tfd, p + off, left, off);
+        if (n <= 0) rc = ERR_DB_FILE;
+        else { off += n; left -= n; }
+    }
+    free(table);
+
+    if (rc == NO_ERROR && fsync(tfd) == -1) rc = ERR_DB_FILE;
+    if (rc == NO_ERROR && (fstat(tfd, &st) == -1 ||
+                           bloom_build(st.st_ino, bits, b.recs, b.n) != NO_ERROR)) {
+        rc = ERR_DB_FILE;
+    }
+    free(b.recs);
+    if (close(tfd) == -1) rc = ERR_DB_FILE;
+    if (rc == NO_ERROR && rename(TMP_DB_FILE, DB_FILE) == -1) rc = ERR_DB_FILE;
+    if (rc != NO_ERROR) {
+        unlink(TMP_DB_FILE);
+        return rc;
+    }
+    if (sync_dir(DB_FILE) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    return db_follow(fd);
+}
+
+/*
+ * hash_bloom_rebuild - Writes a new filter of the ids in the table in fd,
+ *                      with the db held by this process alone.
+ */
+int hash_bloom_rebuild(int fd) {
+    hash_build_t b = {NULL, 0, 0};
+    hash_hdr_t h;
+    struct stat st;
+    int rc;
+
+    if (read_hdr(fd, &h) != NO_ERROR || fstat(fd, &st) == -1 ||
+        db_scan(fd, collect_rec, &b) != NO_ERROR) {
+        free(b.recs);
+        return ERR_DB_FILE;
+    }
+    rc = bloom_build(st.st_ino, h.bits, b.recs, b.n);
+    free(b.recs);
+    return rc;
+}
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// The last name index is a sorted array of lname_entry_t stored in
+// LNAME_IDX_FILE after a sidecar_hdr_t, ordered by last name, then first
+// name, then id.  Lookups binary search the mapped file, add and delete
+// shift the tail of the array by one entry.  Processes sharing the db
+// serialize their changes with LOCK_LIDX, lookups hold it shared.  An index
+// whose header names another db file is rebuilt like a missing one.
+
+/*
+ * cmp_lname_entry - Orders index entries by lname, fname and then id.
+ */
+static int cmp_lname_entry(const void *a, const void *b) {
+    const lname_entry_t *ea = a, *eb = b;
+    int rc;
+
+    if ((rc = strncmp(ea->lname, eb->lname, sizeof(ea->lname))) != 0) return rc;
+    if ((rc = strncmp(ea->fname, eb->fname, sizeof(ea->fname))) != 0) return rc;
+    return (ea->id > eb->id) - (ea->id < eb->id);
+}
+
+/*
+ * make_entry - Builds the index entry for a student record.
+ */
+static void make_entry(const student_t *s, lname_entry_t *e) {
+    memset(e, 0, sizeof(*e));
+    memcpy(e->lname, s->lname, sizeof(e->lname));
+    memcpy(e->fname, s->fname, sizeof(e->fname));
+    e->lname[sizeof(e->lname) - 1] = '\0';
+    e->fname[sizeof(e->fname) - 1] = '\0';
+    e->id = s->id;
+}
+
+/*
+ * lower_bound - Returns the position of the first entry that is not less
+ *               than key in the sorted array e[0..n).
+ */
+static size_t lower_bound(const lname_entry_t *e, size_t n, const lname_entry_t *key,
+                          int (*cmp)(const void *, const void *)) {
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cmp(&e[mid], key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * map_index - Opens and maps the index of the db in fd with room for extra
+ *             more entries.  On success *entries and *n describe the current
+ *             contents and the caller must call unmap_index.  Returns the
+ *             index fd, or ERR_DB_FILE.  *stale is set, and nothing mapped,
+ *             if the file did not exist yet or belongs to another db file.
+ */
+static int map_index(int fd, size_t extra, lname_entry_t **entries, size_t *n, bool *stale) {
+    struct stat st, db_st;
+    sidecar_hdr_t h;
+    int ifd;
+
+    *stale = false;
+    *entries = NULL;
+    *n = 0;
+    ifd = open(LNAME_IDX_FILE, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (ifd == -1) return ERR_DB_FILE;
+
+    if (fstat(ifd, &st) == -1 || fstat(fd, &db_st) == -1) {
+        close(ifd);
+        return ERR_DB_FILE;
+    }
+    if (pread(ifd, &h, sizeof(h), 0) != sizeof(h) || h.db_ino != (uint64_t)db_st.st_ino) {
+        *stale = true;
+        return ifd;
+    }
+
+    *n = (st.st_size - sizeof(h)) / sizeof(lname_entry_t);
+    size_t len = sizeof(h) + (*n + extra) * sizeof(lname_entry_t);
+
+    if (extra > 0 && ftruncate(ifd, len) == -1) {
+        close(ifd);
+        return ERR_DB_FILE;
+    }
+
+    char *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, ifd, 0);
+    if (p == MAP_FAILED) {
+        close(ifd);
+        return ERR_DB_FILE;
+    }
+    *entries = (lname_entry_t *)(p + sizeof(h));
+    return ifd;
+}
+
+/*
+ * unmap_index - Releases a mapping from map_index and sets the final size of
+ *               the index file to n entries.
+ */
+static int unmap_index(int ifd, lname_entry_t *entries, size_t mapped, size_t n) {
+    int rc = NO_ERROR;
+
+    if (entries != NULL) {
+        munmap((char *)entries - sizeof(sidecar_hdr_t),
+               sizeof(sidecar_hdr_t) + mapped * sizeof(lname_entry_t));
+    }
+    if (ftruncate(ifd, sizeof(sidecar_hdr_t) + n * sizeof(lname_entry_t)) == -1) rc = ERR_DB_FILE;
+    close(ifd);
+    return rc;
+}
+
+/*
+ * write_index - Replaces the contents of the index with a header for the db
+ *               in fd followed by the n entries in e.
+ */
+static int write_index(int fd, const lname_entry_t *e, size_t n) {
+    sidecar_hdr_t h = {0};
+    struct stat st;
+    int ifd, rc = NO_ERROR;
+
+    if (fstat(fd, &st) == -1) return ERR_DB_FILE;
+    h.db_ino = st.st_ino;
+
+    ifd = open(LNAME_IDX_FILE, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (ifd == -1) return ERR_DB_FILE;
+
+    ssize_t want = n * sizeof(lname_entry_t);
+    if (write(ifd, &h, sizeof(h)) != sizeof(h) || (want > 0 && write(ifd, e, want) != want)) {
+        rc = ERR_DB_FILE;
+    }
+    close(ifd);
+    return rc;
+}
+
+// growable array used while rebuilding the index from a db scan
+typedef struct lname_build {
+    lname_entry_t *e;
+    size_t n, cap;
+} lname_build_t;
+
+// db_scan callback used by lidx_rebuild
+static int collect_entry(const student_t *s, void *arg) {
+    lname_build_t *b = arg;
+
+    if (b->n == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 1024;
+        lname_entry_t *p = realloc(b->e, cap * sizeof(lname_entry_t));
+        if (p == NULL) return ERR_DB_OP;
+        b->e = p;
+        b->cap = cap;
+    }
+    make_entry(s, &b->e[b->n++]);
+    return 0;
+}
+
+/*
+ * lidx_rebuild - Recreates the last name index from the records in the db.
+ */
+int lidx_rebuild(int fd) {
+    lname_build_t b = {NULL, 0, 0};
+    int rc;
+
+    lock_meta(fd, LOCK_LIDX, F_WRLCK);
+    if (db_scan(fd, collect_entry, &b) != NO_ERROR) {
+        unlock_meta(fd, LOCK_LIDX);
+        free(b.e);
+        return ERR_DB_FILE;
+    }
+    qsort(b.e, b.n, sizeof(lname_entry_t), cmp_lname_entry);
+
+    rc = write_index(fd, b.e, b.n);
+    unlock_meta(fd, LOCK_LIDX);
+    free(b.e);
+    return rc;
+}
+
+/*
+ * lidx_reset - Empties the last name index of the db in fd, used when the
+ *              db is truncated.
+ */
+int lidx_reset(int fd) {
+    return write_index(fd, NULL, 0);
+}
+
+/*
+ * lidx_insert - Adds the entry for s to the index.  s must already be
+ *               written to the db, a missing index is rebuilt from the db.
+ */
+int lidx_insert(int fd, const student_t *s) {
+    lname_entry_t *entries, key;
+    size_t n;
+    bool stale;
+    int ifd, rc;
+
+    lock_meta(fd, LOCK_LIDX, F_WRLCK);
+    ifd = map_index(fd, 1, &entries, &n, &stale);
+    if (ifd < 0 || stale) {
+        if (ifd >= 0) unmap_index(ifd, entries, 0, 0);
+        unlock_meta(fd, LOCK_LIDX);
+        return ifd < 0 ? ERR_DB_FILE : lidx_rebuild(fd);
+    }
+
+    make_entry(s, &key);
+    size_t pos = lower_bound(entries, n, &key, cmp_lname_entry);
+    memmove(&entries[pos + 1], &entries[pos], (n - pos) * sizeof(lname_entry_t));
+    entries[pos] = key;
+
+    rc = unmap_index(ifd, entries, n + 1, n + 1);
+    unlock_meta(fd, LOCK_LIDX);
+    return rc;
+}
+
+/*
+ * lidx_remove - Removes the entry for s from the index.
+ */
+int lidx_remove(int fd, const student_t *s) {
+    lname_entry_t *entries, key;
+    size_t n;
+    bool stale;
+    int ifd, rc;
+
+    lock_meta(fd, LOCK_LIDX, F_WRLCK);
+    ifd = map_index(fd, 0, &entries, &n, &stale);
+    if (ifd < 0 || stale) {
+        if (ifd >= 0) unmap_index(ifd, entries, 0, 0);
+        unlock_meta(fd, LOCK_LIDX);
+        return ifd < 0 ? ERR_DB_FILE : lidx_rebuild(fd);
+    }
+
+    make_entry(s, &key);
+    size_t pos = lower_bound(entries, n, &key, cmp_lname_entry);
+    if (pos < n && cmp_lname_entry(&entries[pos], &key) == 0) {
+        memmove(&entries[pos], &entries[pos + 1], (n - pos - 1) * sizeof(lname_entry_t));
+        rc = unmap_index(ifd, entries, n, n - 1);
+    } else {
+        rc = unmap_index(ifd, entries, n, n);
+    }
+    unlock_meta(fd, LOCK_LIDX);
+    return rc;
+}
+
+// compares entries on the last name only, used to find all matches of -l
+static int cmp_lname_only(const void *a, const void *b) {
+    const lname_entry_t *ea = a, *eb = b;
+    return strncmp(ea->lname, eb->lname, sizeof(ea->lname));
+}
+
+/*
+ * find_by_lname - Prints every student whose last name is lname using a
+ *                 binary search of the index.  Returns the number of
+ *                 students printed, or SRCH_NOT_FOUND if there are none.
+ */
+int find_by_lname(int fd, char *lname) {
+    lname_entry_t *entries, key = {0};
+    student_t student;
+    size_t n;
+    bool stale;
+    int ifd, found = 0;
+
+    lock_meta(fd, LOCK_LIDX, F_RDLCK);
+    ifd = map_index(fd, 0, &entries, &n, &stale);
+    if (ifd >= 0 && stale) {
+        unmap_index(ifd, entries, 0, 0);
+        unlock_meta(fd, LOCK_LIDX);
+        ifd = lidx_rebuild(fd);
+        lock_meta(fd, LOCK_LIDX, F_RDLCK);
+        if (ifd == NO_ERROR) {
+            ifd = map_index(fd, 0, &entries, &n, &stale);
+        }
+    }
+    if (ifd < 0) {
+        unlock_meta(fd, LOCK_LIDX);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    strncpy(key.lname, lname, sizeof(key.lname) - 1);
+    for (size_t i = lower_bound(entries, n, &key, cmp_lname_only);
+         i < n && cmp_lname_only(&entries[i], &key) == 0; i++) {
+        if (get_student(fd, entries[i].id, &student) != NO_ERROR) continue;
+        if (found++ == 0) {
+            printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+        }
+        printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname, student.lname, student.gpa / 100.0);
+    }
+    unmap_index(ifd, entries, n, n);
+    unlock_meta(fd, LOCK_LIDX);
+
+    if (found == 0) {
+        printf(M_STD_LNAME_NOT_FND, key.lname);
+        return SRCH_NOT_FOUND;
+    }
+    return found;
+}
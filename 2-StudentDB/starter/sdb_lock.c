@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Locking between processes that have the same db open.  All locks are open
+// file description (OFD) byte range locks on the db file, so they belong to
+// the open db rather than to the process and are dropped when it is closed.
+//
+// Student id is locked through bytes [id*64, id*64+64), the range slot id
+// covers without a slot map, so writers of different ids never wait for
+// each other.  The LOCK_* meta locks are single bytes past the range of the
+// largest possible id:
+// LOCK_OPEN is held shared by every open db and exclusively by operations
+// that rewrite the whole file (-b, -x, -z); the others guard the end of the
+// file, the log and the sidecars.
+
+/*
+ * db_lock_range - Sets a lock of type (F_RDLCK, F_WRLCK or F_UNLCK) on len
+ *                 bytes of fd starting at start.  With wait false it fails
+ *                 with ERR_DB_OP instead of waiting for another holder.
+ */
+int db_lock_range(int fd, off_t start, off_t len, short type, bool wait) {
+    struct flock fl;
+    int rc;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+
+    do {
+        rc = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+    } while (rc == -1 && errno == EINTR);
+
+    if (rc == -1) {
+        return errno == EAGAIN || errno == EACCES ? ERR_DB_OP : ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * lock_record - Waits for a lock of type on student id.
+ */
+int lock_record(int fd, int id, short type) {
+    return db_lock_range(fd, (off_t)id * STUDENT_RECORD_SIZE, STUDENT_RECORD_SIZE, type, true);
+}
+
+/*
+ * unlock_record - Releases the lock on student id.
+ */
+void unlock_record(int fd, int id) {
+    db_lock_range(fd, (off_t)id * STUDENT_RECORD_SIZE, STUDENT_RECORD_SIZE, F_UNLCK, false);
+}
+
+/*
+ * lock_meta - Waits for a lock of type on one of the LOCK_* meta locks.
+ */
+int lock_meta(int fd, off_t which, short type) {
+    return db_lock_range(fd, which, 1, type, true);
+}
+
+/*
+ * unlock_meta - Releases one of the LOCK_* meta locks.
+ */
+void unlock_meta(int fd, off_t which) {
+    db_lock_range(fd, which, 1, F_UNLCK, false);
+}
+
+/*
+ * db_follow - Called with LOCK_OPEN held exclusively.  If DB_FILE was
+ *             replaced by a new file (-k, -u or a rehash) fd is pointed at
+ *             the new one, with the lock moved over, and the db state is
+ *             reloaded from it.
+ */
+int db_follow(int fd) {
+    struct stat st, path_st;
+
+    for (;;) {
+        if (fstat(fd, &st) == -1 || stat(DB_FILE, &path_st) == -1) {
+            return ERR_DB_FILE;
+        }
+        if (st.st_ino == path_st.st_ino) {
+            break;
+        }
+
+        int nfd = open(DB_FILE, O_RDWR);
+        if (nfd == -1) return ERR_DB_FILE;
+        if (lock_meta(nfd, LOCK_OPEN, F_WRLCK) != NO_ERROR || dup2(nfd, fd) == -1) {
+            close(nfd);
+            return ERR_DB_FILE;
+        }
+        close(nfd);     // fd shares the open file description and its lock
+    }
+    return db_reload(fd);
+}
+
+/*
+ * db_lock_exclusive - Waits until no other process has the db open and
+ *                     keeps it that way until it is closed.  The shared
+ *                     lock is dropped first, two processes upgrading at the
+ *                     same time would wait for each other forever.  Since
+ *                     others may have changed or replaced the db meanwhile,
+ *                     its state is reloaded.
+ */
+int db_lock_exclusive(int fd) {
+    unlock_meta(fd, LOCK_OPEN);
+    if (lock_meta(fd, LOCK_OPEN, F_WRLCK) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    return db_follow(fd);
+}
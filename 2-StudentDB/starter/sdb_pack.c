@@ -0,0 +1,401 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Packed db format.  A 64 byte record spends 56 bytes on fixed width names
+// that are mostly zero padding, so -k rewrites student.db as:
+//
+//   pack_hdr_t          in slot 0, which is always empty in the 64 byte
+//                       format, so the magic tells the two formats apart
+//   uint32 names[]      offset of every distinct name in strings
+//   char strings[]      the names, sorted and NUL terminated
+//   uint32 index[]      first id of every block of PACK_BLOCK_RECS records
+//   packed_rec_t data[] records sorted by id, 12 bytes each
+//
+// A packed db is read only: lookups binary search the block index and then
+// one block, scans decode the records in id order.  -u converts it back.
+
+static const char *pack_map = NULL;     // mapping of the packed file
+static size_t pack_len = 0;
+static const pack_hdr_t *pack_hdr = NULL;
+
+/*
+ * pack_active - Returns true if the open db is packed.
+ */
+bool pack_active(void) {
+    return pack_hdr != NULL;
+}
+
+/*
+ * pack_close - Unmaps the packed db, if any.
+ */
+void pack_close(void) {
+    if (pack_map != NULL) {
+        munmap((void *)pack_map, pack_len);
+    }
+    pack_map = NULL;
+    pack_len = 0;
+    pack_hdr = NULL;
+}
+
+/*
+ * pack_is_packed - Returns true if slot 0 of fd holds the packed header.
+ */
+bool pack_is_packed(int fd) {
+    pack_hdr_t hdr;
+
+    return pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.magic == PACK_MAGIC;
+}
+
+/*
+ * pack_open - Maps the packed db in fd and checks that its sections fit in
+ *             the file.
+ */
+int pack_open(int fd) {
+    struct stat st;
+    const pack_hdr_t *h;
+
+    pack_close();
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(pack_hdr_t)) {
+        return ERR_DB_FILE;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        return ERR_DB_FILE;
+    }
+    pack_map = p;
+    pack_len = st.st_size;
+    h = p;
+
+    if (h->magic != PACK_MAGIC || h->version != PACK_VERSION ||
+        h->block_recs != PACK_BLOCK_RECS ||
+        h->names_off + (uint64_t)h->nnames * sizeof(uint32_t) > pack_len ||
+        h->strings_off + h->strings_len > pack_len ||
+        h->index_off + (uint64_t)h->nblocks * sizeof(uint32_t) > pack_len ||
+        h->data_off + (uint64_t)h->nrecs * sizeof(packed_rec_t) > pack_len) {
+        pack_close();
+        return ERR_DB_FILE;
+    }
+    pack_hdr = h;
+    return NO_ERROR;
+}
+
+/*
+ * pack_name - Returns name number i of the dictionary.
+ */
+static const char *pack_name(uint32_t i) {
+    const uint32_t *names = (const uint32_t *)(pack_map + pack_hdr->names_off);
+
+    if (i >= pack_hdr->nnames || names[i] >= pack_hdr->strings_len) {
+        return "";
+    }
+    return pack_map + pack_hdr->strings_off + names[i];
+}
+
+/*
+ * pack_decode - Expands a packed record into a 64 byte student_t.
+ */
+static void pack_decode(const packed_rec_t *r, student_t *s) {
+    memset(s, 0, sizeof(*s));
+    s->id = PACK_ID(r->id_gpa);
+    s->gpa = PACK_GPA(r->id_gpa);
+    strncpy(s->fname, pack_name(r->fname), sizeof(s->fname) - 1);
+    strncpy(s->lname, pack_name(r->lname), sizeof(s->lname) - 1);
+}
+
+/*
+ * pack_get - Looks up student id in the packed db.  The block index is
+ *            searched for the last block starting at or before id, then
+ *            that block alone.
+ */
+int pack_get(int id, student_t *s) {
+    const uint32_t *index = (const uint32_t *)(pack_map + pack_hdr->index_off);
+    const packed_rec_t *data = (const packed_rec_t *)(pack_map + pack_hdr->data_off);
+    size_t lo = 0, hi = pack_hdr->nblocks;
+
+    while (lo < hi) {           // first block whose first id is > id
+        size_t mid = lo + (hi - lo) / 2;
+        if (index[mid] <= (uint32_t)id) lo = mid + 1; else hi = mid;
+    }
+    if (lo == 0) {
+        return SRCH_NOT_FOUND;
+    }
+
+    size_t first = (lo - 1) * PACK_BLOCK_RECS;
+    size_t n = pack_hdr->nrecs - first < PACK_BLOCK_RECS ? pack_hdr->nrecs - first : PACK_BLOCK_RECS;
+    lo = first;
+    hi = first + n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int mid_id = PACK_ID(data[mid].id_gpa);
+        if (mid_id == id) {
+            pack_decode(&data[mid], s);
+            return NO_ERROR;
+        }
+        if (mid_id < id) lo = mid + 1; else hi = mid;
+    }
+    return SRCH_NOT_FOUND;
+}
+
+/*
+ * pack_scan - Calls fn for every record of the packed db in id order.
+ */
+int pack_scan(db_scan_fn fn, void *arg) {
+    const packed_rec_t *data = (const packed_rec_t *)(pack_map + pack_hdr->data_off);
+    student_t s;
+
+    for (uint32_t i = 0; i < pack_hdr->nrecs; i++) {
+        pack_decode(&data[i], &s);
+        int rc = fn(&s, arg);
+        if (rc != 0) return rc;
+    }
+    return NO_ERROR;
+}
+
+// records and names collected from the db by pack_db
+typedef struct pack_build {
+    student_t *recs;
+    size_t n, cap;
+} pack_build_t;
+
+// db_scan callback used by pack_db
+static int collect_rec(const student_t *s, void *arg) {
+    pack_build_t *b = arg;
+
+    if (b->n == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 1024;
+        student_t *p = realloc(b->recs, cap * sizeof(student_t));
+        if (p == NULL) return ERR_DB_OP;
+        b->recs = p;
+        b->cap = cap;
+    }
+    b->recs[b->n] = *s;
+    b->recs[b->n].fname[sizeof(s->fname) - 1] = '\0';
+    b->recs[b->n].lname[sizeof(s->lname) - 1] = '\0';
+    b->n++;
+    return 0;
+}
+
+// orders records by id for pack_db, the scan of a compacted db is not
+static int cmp_rec_id(const void *a, const void *b) {
+    const student_t *sa = a, *sb = b;
+    return (sa->id > sb->id) - (sa->id < sb->id);
+}
+
+// orders name pointers for the dictionary
+static int cmp_name(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * name_index - Returns the position of name in the sorted dictionary.
+ */
+static uint32_t name_index(char **dict, size_t n, const char *name) {
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(dict[mid], name) < 0) lo = mid + 1; else hi = mid;
+    }
+    return (uint32_t)lo;
+}
+
+/*
+ * write_tmp_db - Writes len bytes at offset of the temporary db file.
+ */
+static int write_tmp_db(int tfd, const void *buf, size_t len, off_t offset) {
+    return pwrite(tfd, buf, len, offset) == (ssize_t)len ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ * replace_db - Makes the finished temporary file durable and renames it
+ *              over the db.
+ */
+static int replace_db(int tfd) {
+    if (fsync(tfd) == -1 || close(tfd) == -1 || rename(TMP_DB_FILE, DB_FILE) == -1 ||
+        sync_dir(DB_FILE) != NO_ERROR) {
+        unlink(TMP_DB_FILE);
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * pack_db - Converts the 64 byte db in fd to the packed format (-k).  The
+ *           packed file is built in TMP_DB_FILE and renamed over the db.
+ */
+int pack_db(int fd) {
+    pack_build_t b = {NULL, 0, 0};
+    char **dict = NULL;
+    uint32_t *offs = NULL, *index = NULL;
+    packed_rec_t *data = NULL;
+    size_t ndict = 0, slen = 0;
+    int tfd = -1, rc = ERR_DB_FILE;
+
+    if (db_lock_exclusive(fd) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+    if (pack_active()) {
+        printf(M_DB_ALREADY_PACKED);
+        return NO_ERROR;
+    }
+    if (db_scan(fd, collect_rec, &b) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        free(b.recs);
+        return ERR_DB_FILE;
+    }
+    qsort(b.recs, b.n, sizeof(student_t), cmp_rec_id);
+    if (b.n > 0 && b.recs[b.n - 1].id > MAX_STD_ID) {
+        printf(M_ERR_PACK_ID, MAX_STD_ID);     // a hash layout db can hold them
+        free(b.recs);
+        return ERR_DB_OP;
+    }
+
+    // dictionary of every distinct first and last name
+    size_t nblocks = (b.n + PACK_BLOCK_RECS - 1) / PACK_BLOCK_RECS;
+    dict = malloc((2 * b.n + 1) * sizeof(char *));
+    offs = malloc((2 * b.n + 1) * sizeof(uint32_t));
+    index = malloc((nblocks + 1) * sizeof(uint32_t));
+    data = malloc((b.n + 1) * sizeof(packed_rec_t));
+    if (dict == NULL || offs == NULL || index == NULL || data == NULL) {
+        printf(M_ERR_MEMORY);
+        goto out;
+    }
+    for (size_t i = 0; i < b.n; i++) {
+        dict[2 * i] = b.recs[i].fname;
+        dict[2 * i + 1] = b.recs[i].lname;
+    }
+    qsort(dict, 2 * b.n, sizeof(char *), cmp_name);
+    for (size_t i = 0; i < 2 * b.n; i++) {
+        if (ndict > 0 && strcmp(dict[ndict - 1], dict[i]) == 0) continue;
+        dict[ndict] = dict[i];
+        offs[ndict++] = (uint32_t)slen;
+        slen += strlen(dict[i]) + 1;
+    }
+
+    for (size_t i = 0; i < b.n; i++) {
+        data[i].id_gpa = PACK_ID_GPA(b.recs[i].id, b.recs[i].gpa);
+        data[i].fname = name_index(dict, ndict, b.recs[i].fname);
+        data[i].lname = name_index(dict, ndict, b.recs[i].lname);
+        if (i % PACK_BLOCK_RECS == 0) index[i / PACK_BLOCK_RECS] = b.recs[i].id;
+    }
+
+    pack_hdr_t hdr = {0};
+    hdr.magic = PACK_MAGIC;
+    hdr.version = PACK_VERSION;
+    hdr.nrecs = (uint32_t)b.n;
+    hdr.nblocks = (uint32_t)nblocks;
+    hdr.nnames = (uint32_t)ndict;
+    hdr.block_recs = PACK_BLOCK_RECS;
+    hdr.names_off = sizeof(hdr);
+    hdr.strings_off = hdr.names_off + ndict * sizeof(uint32_t);
+    hdr.strings_len = slen;
+    hdr.index_off = (hdr.strings_off + slen + 3) / 4 * 4;
+    hdr.data_off = hdr.index_off + nblocks * sizeof(uint32_t);
+
+    tfd = open(TMP_DB_FILE, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (tfd == -1 ||
+        write_tmp_db(tfd, &hdr, sizeof(hdr), 0) != NO_ERROR ||
+        write_tmp_db(tfd, offs, ndict * sizeof(uint32_t), hdr.names_off) != NO_ERROR ||
+        write_tmp_db(tfd, index, nblocks * sizeof(uint32_t), hdr.index_off) != NO_ERROR ||
+        write_tmp_db(tfd, data, b.n * sizeof(packed_rec_t), hdr.data_off) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        goto out;
+    }
+    for (size_t i = 0; i < ndict; i++) {
+        if (write_tmp_db(tfd, dict[i], strlen(dict[i]) + 1, hdr.strings_off + offs[i]) != NO_ERROR) {
+            printf(M_ERR_DB_WRITE);
+            goto out;
+        }
+    }
+
+    // the packed file is sorted by id and never uses the slot map, drop it
+    // only once the rename is durable
+    rc = replace_db(tfd);
+    tfd = -1;
+    if (rc == NO_ERROR) {
+        wal_reset();
+        slot_map_reset();
+        printf(M_DB_PACKED, (int)b.n, (long)(hdr.data_off + b.n * sizeof(packed_rec_t)));
+    } else {
+        printf(M_ERR_DB_WRITE);
+    }
+
+out:
+    if (tfd != -1) {
+        close(tfd);
+        unlink(TMP_DB_FILE);
+    }
+    free(b.recs);
+    free(dict);
+    free(offs);
+    free(index);
+    free(data);
+    return rc;
+}
+
+/*
+ * unpack_db - Converts the packed db in fd back to 64 byte records stored
+ *             in slot id (-u).
+ */
+int unpack_db(int fd) {
+    const packed_rec_t *data;
+    student_t *buf;
+    int tfd, rc = NO_ERROR;
+
+    if (db_lock_exclusive(fd) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+    if (!pack_active()) {
+        printf(M_DB_NOT_PACKED);
+        return NO_ERROR;
+    }
+
+    buf = malloc(COMPACT_BATCH * sizeof(student_t));
+    tfd = open(TMP_DB_FILE, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (buf == NULL || tfd == -1) {
+        printf(M_ERR_DB_WRITE);
+        free(buf);
+        if (tfd != -1) close(tfd);
+        return ERR_DB_FILE;
+    }
+
+    // records are sorted by id, write each run of consecutive ids at once
+    data = (const packed_rec_t *)(pack_map + pack_hdr->data_off);
+    for (uint32_t i = 0; i < pack_hdr->nrecs && rc == NO_ERROR; ) {
+        int first = PACK_ID(data[i].id_gpa);
+        size_t n = 0;
+        while (i < pack_hdr->nrecs && n < COMPACT_BATCH && PACK_ID(data[i].id_gpa) == first + (int)n) {
+            pack_decode(&data[i++], &buf[n++]);
+        }
+        rc = write_tmp_db(tfd, buf, n * sizeof(student_t), (off_t)first * STUDENT_RECORD_SIZE);
+    }
+    free(buf);
+
+    // the map must be gone before the rename, the packed file ignores it
+    // but the unpacked one would use it
+    if (rc == NO_ERROR) rc = slot_map_reset();
+    if (rc != NO_ERROR) {
+        close(tfd);
+        unlink(TMP_DB_FILE);
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+    if (replace_db(tfd) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+    printf(M_DB_UNPACKED, (int)pack_hdr->nrecs);
+    return NO_ERROR;
+}
@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Server mode.  sdbsc -S opens the db once and serves requests on the Unix
+// domain socket SERVER_SOCK_FILE, so the mapping, slot map and sidecars stay
+// open between operations instead of being set up by every process.  The
+// client side is the normal command line: -a, -c, -d, -f and -p send a
+// srv_request_t to the server when one is running and print the output it
+// sends back, so scripts do not change.  Requests are executed one at a
+// time by a single thread and each change is committed to the log before
+// its response is sent.
+
+static volatile sig_atomic_t srv_stop = 0;
+
+// SIGINT/SIGTERM handler, makes the accept loop exit
+static void srv_on_signal(int sig) {
+    (void)sig;
+    srv_stop = 1;
+}
+
+/*
+ * sock_addr - Fills in the address of SERVER_SOCK_FILE.
+ */
+static void sock_addr(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, SERVER_SOCK_FILE, sizeof(addr->sun_path) - 1);
+}
+
+/*
+ * read_full - Reads exactly len bytes, returns false on EOF or error.
+ */
+static bool read_full(int sock, void *buf, size_t len) {
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = read(sock, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * write_full - Writes exactly len bytes, returns false on error.
+ */
+static bool write_full(int sock, const void *buf, size_t len) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * connect_server - Connects to a running server, returns -1 if there is none.
+ */
+static int connect_server(void) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (sock == -1) {
+        return -1;
+    }
+    sock_addr(&addr);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * server_running - Returns true if a server is accepting requests.
+ */
+bool server_running(void) {
+    int sock = connect_server();
+
+    if (sock == -1) {
+        return false;
+    }
+    close(sock);
+    return true;
+}
+
+/*
+ * serve_request - Executes one request with stdout captured and sends the
+ *                 status and output back.  Returns false if the client is
+ *                 gone.
+ */
+static bool serve_request(int fd, int sock, const srv_request_t *req) {
+    srv_response_t rsp = {0};
+    char *out = NULL;
+    size_t len = 0;
+    FILE *saved = stdout;
+    FILE *mem = open_memstream(&out, &len);
+
+    if (mem == NULL) {
+        rsp.status = EXIT_FAIL_DB;
+        return write_full(sock, &rsp, sizeof(rsp));
+    }
+
+    stdout = mem;
+    rsp.status = exec_request(fd, req);
+    // the reply promises the change is durable, do not wait for the group
+    if (wal_commit() != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rsp.status = EXIT_FAIL_DB;
+    }
+    stdout = saved;
+    fclose(mem);
+
+    rsp.len = (uint32_t)len;
+    bool ok = write_full(sock, &rsp, sizeof(rsp)) && write_full(sock, out, len);
+    free(out);
+    return ok;
+}
+
+/*
+ * serve_client - Serves the requests of one connection until the client
+ *                closes it.  Returns true if a stop was requested.
+ */
+static bool serve_client(int fd, int sock) {
+    srv_request_t req;
+
+    while (read_full(sock, &req, sizeof(req))) {
+        if (req.magic != SRV_MAGIC) {
+            break;
+        }
+        if (req.op == SRV_OP_STOP) {
+            srv_response_t rsp = {EXIT_OK, 0};
+            write_full(sock, &rsp, sizeof(rsp));
+            return true;
+        }
+        // names come off the wire, make sure they are terminated
+        req.fname[sizeof(req.fname) - 1] = '\0';
+        req.lname[sizeof(req.lname) - 1] = '\0';
+        if (!serve_request(fd, sock, &req)) {
+            break;
+        }
+    }
+    return false;
+}
+
+/*
+ * start_server - Runs the server in the foreground until it is stopped with
+ *                -S stop, SIGINT or SIGTERM.
+ */
+int start_server(void) {
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct timeval tv = {SRV_IO_TIMEOUT, 0};
+    int fd, lsock, rc = EXIT_OK;
+
+    if (server_running()) {
+        printf(M_ERR_SRV_START, SERVER_SOCK_FILE);
+        return EXIT_FAIL_DB;
+    }
+
+    fd = open_db(DB_FILE, false);
+    if (fd < 0) {
+        return EXIT_FAIL_DB;
+    }
+
+    lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sock_addr(&addr);
+    unlink(SERVER_SOCK_FILE);   // left behind by a server that crashed
+    if (lsock == -1 || bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(lsock, SOMAXCONN) == -1) {
+        printf(M_ERR_SRV_START, SERVER_SOCK_FILE);
+        if (lsock != -1) close(lsock);
+        close_db(fd);
+        return EXIT_FAIL_DB;
+    }
+
+    // no SA_RESTART so a signal interrupts accept
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = srv_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf(M_SRV_STARTED, SERVER_SOCK_FILE);
+    fflush(stdout);
+
+    while (!srv_stop) {
+        int sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            rc = EXIT_FAIL_DB;
+            break;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (serve_client(fd, sock)) {
+            srv_stop = 1;
+        }
+        close(sock);
+    }
+
+    close(lsock);
+    unlink(SERVER_SOCK_FILE);
+    if (close_db(fd) != NO_ERROR) {
+        rc = EXIT_FAIL_DB;
+    }
+    printf(M_SRV_STOPPED);
+    return rc;
+}
+
+/*
+ * client_request - Sends a request to the running server and prints its
+ *                  output.  Returns the exit code of the operation, or -1
+ *                  if no server is running so the caller can run it itself.
+ */
+int client_request(const srv_request_t *req) {
+    srv_response_t rsp;
+    char buf[SCAN_CHUNK_SIZE / 16];
+    int sock = connect_server();
+
+    if (sock == -1) {
+        return -1;
+    }
+
+    if (!write_full(sock, req, sizeof(*req)) || !read_full(sock, &rsp, sizeof(rsp))) {
+        printf(M_ERR_SRV_COMM);
+        close(sock);
+        return EXIT_FAIL_DB;
+    }
+    for (size_t left = rsp.len; left > 0; ) {
+        size_t n = left < sizeof(buf) ? left : sizeof(buf);
+        if (!read_full(sock, buf, n)) {
+            printf(M_ERR_SRV_COMM);
+            close(sock);
+            return EXIT_FAIL_DB;
+        }
+        fwrite(buf, 1, n, stdout);
+        left -= n;
+    }
+    close(sock);
+    return rsp.status;
+}
+
+/*
+ * stop_server - Asks the running server to exit (-S stop).
+ */
+int stop_server(void) {
+    srv_request_t req = {SRV_MAGIC, SRV_OP_STOP, 0, 0, "", ""};
+    int rc = client_request(&req);
+
+    if (rc < 0) {
+        printf(M_ERR_SRV_NONE, SERVER_SOCK_FILE);
+        return EXIT_FAIL_DB;
+    }
+    return rc;
+}
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Snapshots (-s dest).  The db is locked exclusively, so changes in flight
+// in other processes finish first and new ones wait in open_db, and the log
+// is checkpointed so the file alone holds every change.  The file is then
+// cloned with FICLONE, which shares its extents with the copy and moves no
+// data, or copied extent by extent with copy_file_range (holes stay holes),
+// or with read/write if neither is supported.  The copy is written next to
+// dest and renamed over it.  A compacted db also needs its slot map, which
+// is copied to dest.map the same way.
+
+static const char *snap_methods[] = {"reflink", "copy_file_range", "read/write"};
+
+/*
+ * copy_range - Copies bytes [start, end) of sfd to the same offsets of dfd,
+ *              dropping from copy_file_range to read/write (updating
+ *              *method) if the kernel or file system can not do it.  The
+ *              read/write buffer is allocated in *buf on first use.
+ */
+static int copy_range(int sfd, int dfd, off_t start, off_t end, int *method, char **buf) {
+    while (start < end) {
+        size_t want = end - start < SNAP_CHUNK_SIZE ? end - start : SNAP_CHUNK_SIZE;
+
+        if (*method == SNAP_COPY_RANGE) {
+            loff_t in = start, out = start;
+            ssize_t n = copy_file_range(sfd, &in, dfd, &out, want, 0);
+            if (n > 0) {
+                start += n;
+                continue;
+            }
+            if (n == 0) return NO_ERROR;    // the source ended early
+            if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+                return ERR_DB_FILE;
+            }
+            *method = SNAP_READ_WRITE;
+        }
+
+        if (*buf == NULL && (*buf = malloc(SNAP_CHUNK_SIZE)) == NULL) {
+            return ERR_DB_OP;
+        }
+        ssize_t n = pread(sfd, *buf, want, start);
+        if (n < 0) return ERR_DB_FILE;
+        if (n == 0) return NO_ERROR;
+        if (pwrite(dfd, *buf, n, start) != n) return ERR_DB_FILE;
+        start += n;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * copy_file - Makes dfd a copy of sfd, by reflink if possible, otherwise by
+ *             copying only the allocated extents.  Sets *method to the
+ *             SNAP_* way it was done.
+ */
+static int copy_file(int sfd, int dfd, int *method) {
+    struct stat st;
+    char *buf = NULL;
+    int rc = NO_ERROR;
+
+    if (fstat(sfd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+    *method = SNAP_REFLINK;
+    if (ioctl(dfd, FICLONE, sfd) == 0) {
+        return NO_ERROR;
+    }
+
+    *method = SNAP_COPY_RANGE;
+    if (ftruncate(dfd, st.st_size) == -1) {
+        return ERR_DB_FILE;
+    }
+    for (off_t offset = 0; offset < st.st_size && rc == NO_ERROR; ) {
+        off_t data = lseek(sfd, offset, SEEK_DATA), hole;
+        if (data == -1) {
+            if (errno == ENXIO) break;      // only a hole is left
+            data = offset;
+            hole = st.st_size;
+        } else {
+            hole = lseek(sfd, data, SEEK_HOLE);
+            if (hole == -1 || hole > st.st_size) hole = st.st_size;
+        }
+        rc = copy_range(sfd, dfd, data, hole, method, &buf);
+        offset = hole;
+    }
+    free(buf);
+    return rc;
+}
+
+/*
+ * snapshot_file - Copies sfd to dest through a temporary file renamed over
+ *                 dest once it is on disk.
+ */
+static int snapshot_file(int sfd, const char *dest, int *method) {
+    char tmp[PATH_MAX];
+    int dfd, rc;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", dest) >= (int)sizeof(tmp)) {
+        return ERR_DB_OP;
+    }
+    dfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (dfd == -1) {
+        return ERR_DB_FILE;
+    }
+
+    rc = copy_file(sfd, dfd, method);
+    if (rc == NO_ERROR && fsync(dfd) == -1) rc = ERR_DB_FILE;
+    if (close(dfd) == -1) rc = ERR_DB_FILE;
+    if (rc == NO_ERROR && rename(tmp, dest) == -1) rc = ERR_DB_FILE;
+    if (rc != NO_ERROR) {
+        unlink(tmp);
+        return rc;
+    }
+    return sync_dir(dest);
+}
+
+/*
+ * snapshot_db - Writes a consistent copy of the db in fd to dest (-s).
+ */
+int snapshot_db(int fd, const char *dest) {
+    char map_dest[PATH_MAX];
+    struct stat st;
+    int method, rc;
+
+    if (snprintf(map_dest, sizeof(map_dest), "%s.map", dest) >= (int)sizeof(map_dest)) {
+        printf(M_ERR_SNAPSHOT, dest);
+        return ERR_DB_OP;
+    }
+    if (db_lock_exclusive(fd) != NO_ERROR || wal_checkpoint() != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    rc = snapshot_file(fd, dest, &method);
+    if (rc == NO_ERROR && slot_map != NULL) {
+        int map_fd = open(SLOT_MAP_FILE, O_RDONLY);
+        int map_method;
+        rc = map_fd == -1 ? ERR_DB_FILE : snapshot_file(map_fd, map_dest, &map_method);
+        if (map_fd != -1) close(map_fd);
+    } else if (rc == NO_ERROR && unlink(map_dest) == -1 && errno != ENOENT) {
+        rc = ERR_DB_FILE;   // a map left by an older snapshot would be used
+    }
+    if (rc != NO_ERROR || fstat(fd, &st) == -1) {
+        printf(M_ERR_SNAPSHOT, dest);
+        return ERR_DB_FILE;
+    }
+
+    printf(M_DB_SNAPSHOT, (long)st.st_size, dest, snap_methods[method]);
+    return NO_ERROR;
+}
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdbool.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Aggregate statistics (-t): student count, average, lowest and highest
+// gpa and a gpa histogram of STATS_BUCKETS buckets, all in one pass.  In a
+// direct layout db the pass runs over the column sidecar, 8 bytes per slot
+// instead of 64, four entries per step with SSE2: a lane is counted when
+// its id is non-zero, and the histogram is kept as running counts of gpas
+// at or above every bucket's lower bound, so it needs compares only.  The
+// sidecar can be split over several threads, each reducing its own range.
+// Hash layout and packed dbs are reduced record by record with db_scan.
+
+typedef struct stats_part {
+    const col_entry_t *col;
+    size_t lo, hi;          // entries [lo, hi) of col
+    db_stats_t st;
+} stats_part_t;
+
+/*
+ * stats_init - Empties st.
+ */
+static void stats_init(db_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    st->min = INT_MAX;
+    st->max = INT_MIN;
+}
+
+/*
+ * stats_add - Adds one gpa to st.
+ */
+static void stats_add(db_stats_t *st, int gpa) {
+    int b = gpa / STATS_BUCKET_GPA;
+
+    st->count++;
+    st->sum += gpa;
+    if (gpa < st->min) st->min = gpa;
+    if (gpa > st->max) st->max = gpa;
+    st->hist[b < 0 ? 0 : b >= STATS_BUCKETS ? STATS_BUCKETS - 1 : b]++;
+}
+
+/*
+ * stats_merge - Adds the totals of part to st.
+ */
+static void stats_merge(db_stats_t *st, const db_stats_t *part) {
+    st->count += part->count;
+    st->sum += part->sum;
+    if (part->min < st->min) st->min = part->min;
+    if (part->max > st->max) st->max = part->max;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        st->hist[b] += part->hist[b];
+    }
+}
+
+#ifdef __SSE2__
+// lanes of a where mask is set, b elsewhere (SSE2 has no blend)
+static __m128i select_epi32(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// sum of the four lanes of v
+static long hsum_epi32(__m128i v) {
+    int32_t l[4];
+    _mm_storeu_si128((__m128i *)l, v);
+    return (long)l[0] + l[1] + l[2] + l[3];
+}
+#endif
+
+/*
+ * stats_range - Reduces sidecar entries [lo, hi) of col into st.  Per lane
+ *               sums stay far from overflowing since there are at most
+ *               MAX_STD_ID + 1 entries with gpas of at most MAX_STD_GPA.
+ */
+static void stats_range(const col_entry_t *col, size_t lo, size_t hi, db_stats_t *st) {
+    size_t i = lo;
+
+    stats_init(st);
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i cnt = zero, sum = zero;
+    __m128i vmin = _mm_set1_epi32(INT_MAX), vmax = _mm_set1_epi32(INT_MIN);
+    __m128i ge[STATS_BUCKETS], bound[STATS_BUCKETS];
+
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        ge[b] = zero;
+        bound[b] = _mm_set1_epi32(b * STATS_BUCKET_GPA - 1);
+    }
+
+    for (; i + 4 <= hi; i += 4) {
+        // two entries per vector, split into 4 ids and 4 gpas
+        __m128 v0 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)&col[i]));
+        __m128 v1 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)&col[i + 2]));
+        __m128i ids = _mm_castps_si128(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i gpas = _mm_castps_si128(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1)));
+        __m128i live = _mm_xor_si128(_mm_cmpeq_epi32(ids, zero), _mm_set1_epi32(-1));
+
+        if (_mm_movemask_epi8(live) == 0) continue;
+        cnt = _mm_sub_epi32(cnt, live);
+        sum = _mm_add_epi32(sum, _mm_and_si128(live, gpas));
+
+        __m128i lo_gpa = select_epi32(live, gpas, _mm_set1_epi32(INT_MAX));
+        __m128i hi_gpa = select_epi32(live, gpas, _mm_set1_epi32(INT_MIN));
+        vmin = select_epi32(_mm_cmplt_epi32(lo_gpa, vmin), lo_gpa, vmin);
+        vmax = select_epi32(_mm_cmpgt_epi32(hi_gpa, vmax), hi_gpa, vmax);
+        for (int b = 1; b < STATS_BUCKETS; b++) {
+            ge[b] = _mm_sub_epi32(ge[b], _mm_and_si128(live, _mm_cmpgt_epi32(gpas, bound[b])));
+        }
+    }
+
+    int32_t l[4];
+    st->count = hsum_epi32(cnt);
+    st->sum = hsum_epi32(sum);
+    _mm_storeu_si128((__m128i *)l, vmin);
+    for (int k = 0; k < 4; k++) if (l[k] < st->min) st->min = l[k];
+    _mm_storeu_si128((__m128i *)l, vmax);
+    for (int k = 0; k < 4; k++) if (l[k] > st->max) st->max = l[k];
+
+    // bucket b holds the gpas at or above its bound but not the next one
+    long above = st->count;
+    for (int b = 1; b <= STATS_BUCKETS; b++) {
+        long next = b < STATS_BUCKETS ? hsum_epi32(ge[b]) : 0;
+        st->hist[b - 1] = above - next;
+        above = next;
+    }
+#endif
+    for (; i < hi; i++) {
+        if (col[i].id != DELETED_STUDENT_ID) stats_add(st, col[i].gpa);
+    }
+}
+
+// thread body of stats_col
+static void *stats_worker(void *arg) {
+    stats_part_t *p = arg;
+
+    stats_range(p->col, p->lo, p->hi, &p->st);
+    return NULL;
+}
+
+/*
+ * stats_col - Reduces the column sidecar of the db in fd with nthreads
+ *             threads, each taking an equal range of entries.
+ */
+static int stats_col(int fd, int nthreads, db_stats_t *st) {
+    stats_part_t parts[STATS_MAX_THREADS];
+    pthread_t tids[STATS_MAX_THREADS];
+    const col_entry_t *col;
+    size_t n, len;
+    int started = 0, rc = NO_ERROR;
+
+    if (col_map(fd, &col, &n) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    stats_init(st);
+    if (n == 0) {
+        return NO_ERROR;
+    }
+    len = n * sizeof(col_entry_t);
+    if (nthreads > 1) {
+        madvise((void *)col, len, MADV_WILLNEED);
+    }
+
+    // entry 0 is the sidecar header, the ranges split the entries after it
+    for (int t = 0; t < nthreads; t++) {
+        parts[t].col = col;
+        parts[t].lo = MIN_STD_ID + (n - MIN_STD_ID) * t / nthreads;
+        parts[t].hi = MIN_STD_ID + (n - MIN_STD_ID) * (t + 1) / nthreads;
+    }
+    // the calling thread takes the first range
+    for (int t = 1; t < nthreads; t++, started++) {
+        if (pthread_create(&tids[t], NULL, stats_worker, &parts[t]) != 0) {
+            rc = ERR_DB_OP;
+            break;
+        }
+    }
+    stats_worker(&parts[0]);
+    stats_merge(st, &parts[0].st);
+    for (int t = 1; t <= started; t++) {
+        pthread_join(tids[t], NULL);
+        stats_merge(st, &parts[t].st);
+    }
+
+    munmap((void *)col, len);
+    return rc;
+}
+
+// db_scan callback used by db_stats for dbs without a sidecar
+static int stats_rec(const student_t *s, void *arg) {
+    stats_add(arg, s->gpa);
+    return 0;
+}
+
+/*
+ * db_stats - Prints the number of students, their average, lowest and
+ *            highest gpa and a histogram of gpas (-t), computed with
+ *            nthreads threads where the db has a sidecar.
+ */
+int db_stats(int fd, int nthreads) {
+    db_stats_t st;
+    int rc;
+
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > STATS_MAX_THREADS) nthreads = STATS_MAX_THREADS;
+
+    if (!pack_active() && db_layout == DB_LAYOUT_DIRECT) {
+        rc = stats_col(fd, nthreads, &st);
+    } else {
+        stats_init(&st);
+        rc = db_scan(fd, stats_rec, &st);
+    }
+    if (rc != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    if (st.count == 0) {
+        printf(M_DB_EMPTY);
+        return 0;
+    }
+    printf(M_DB_RECORD_CNT, (int)st.count);
+    printf(M_STATS_GPA, st.sum / (double)st.count / 100.0, st.min / 100.0, st.max / 100.0);
+    printf(STATS_HDR_STRING, "GPA", "COUNT");
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        int top = b == STATS_BUCKETS - 1 ? MAX_STD_GPA : (b + 1) * STATS_BUCKET_GPA - 1;
+        printf(STATS_FMT_STRING, b * STATS_BUCKET_GPA / 100.0, top / 100.0, st.hist[b]);
+    }
+    return (int)st.count;
+}
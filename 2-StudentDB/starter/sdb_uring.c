@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Batched record I/O.  io_batch runs a list of reads and writes at fixed
+// offsets of the db.  With io_uring (set up with the raw syscalls, there is
+// no liburing here) up to URING_DEPTH requests are in flight at once and
+// completions are reaped in bulk, so a batch against a cold file overlaps
+// its disk reads instead of waiting for each one in turn.  Without io_uring
+// support, or with SDB_URING=off, the requests run one by one with
+// pread/pwrite.  Kernels older than 5.6 set up the ring but reject
+// IORING_OP_READ and IORING_OP_WRITE with -EINVAL; those requests are run
+// again with pread/pwrite and later batches skip the ring.
+
+typedef struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring;             // sq and cq rings, one mapping (IORING_FEAT_SINGLE_MMAP)
+    size_t ring_len, sqes_len;
+    unsigned entries;
+} uring_t;
+
+/*
+ * uring_exit - Unmaps the rings and closes the ring fd.
+ */
+static void uring_exit(uring_t *r) {
+    if (r->sqes != NULL) munmap(r->sqes, r->sqes_len);
+    if (r->ring != NULL) munmap(r->ring, r->ring_len);
+    if (r->fd != -1) close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/*
+ * uring_init - Creates a ring with room for entries requests.  Fails on
+ *              kernels without io_uring or with it disabled.
+ */
+static int uring_init(uring_t *r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        r->fd = -1;
+        return ERR_DB_OP;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        uring_exit(r);
+        return ERR_DB_OP;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    r->ring = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQ_RING);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        if (r->ring == MAP_FAILED) r->ring = NULL;
+        if (r->sqes == MAP_FAILED) r->sqes = NULL;
+        uring_exit(r);
+        return ERR_DB_FILE;
+    }
+
+    char *ring = r->ring;
+    r->sq_head = (unsigned *)(ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(ring + p.sq_off.array);
+    r->cq_head = (unsigned *)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    r->entries = p.sq_entries;
+    return NO_ERROR;
+}
+
+/*
+ * uring_queue - Adds req, number i of the batch, to the submission ring.
+ */
+static void uring_queue(uring_t *r, int fd, const io_req_t *req, int i) {
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->op == IO_WRITE ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)req->buf;
+    sqe->len = req->len;
+    sqe->off = req->offset;
+    sqe->user_data = i;
+    r->sq_array[idx] = idx;
+    // the kernel must see the entry before the new tail
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * uring_reap - Stores the results of all available completions in reqs,
+ *              returns how many there were.
+ */
+static int uring_reap(uring_t *r, io_req_t *reqs) {
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    for (; head != tail; head++, n++) {
+        const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        reqs[cqe->user_data].res = cqe->res;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * io_serial - Runs the requests one at a time.
+ */
+static int io_serial(int fd, io_req_t *reqs, int n) {
+    for (int i = 0; i < n; i++) {
+        ssize_t rc;
+        if (reqs[i].op == IO_WRITE) {
+            rc = pwrite(fd, reqs[i].buf, reqs[i].len, reqs[i].offset);
+        } else {
+            rc = pread(fd, reqs[i].buf, reqs[i].len, reqs[i].offset);
+        }
+        reqs[i].res = rc < 0 ? -errno : (int)rc;
+    }
+    return NO_ERROR;
+}
+
+static uring_t ring = {.fd = -1};
+static int uring_state = 0;     // 0 untried, 1 usable, -1 not supported
+
+/*
+ * io_close - Releases the ring, used when the db is closed.
+ */
+void io_close(void) {
+    if (uring_state > 0) {
+        uring_exit(&ring);
+    }
+    uring_state = 0;
+}
+
+/*
+ * io_batch - Runs n reads and writes against fd, in no particular order,
+ *            and stores each one's byte count (or -errno) in its res.
+ *            Returns ERR_DB_FILE only if the batch itself could not run.
+ */
+int io_batch(int fd, io_req_t *reqs, int n) {
+    int queued = 0, pending = 0, done = 0, inflight = 0;
+
+    if (uring_state == 0) {
+        char *mode = getenv(SDB_URING_ENV);
+        bool off = mode != NULL && strcmp(mode, "off") == 0;
+        uring_state = !off && uring_init(&ring, URING_DEPTH) == NO_ERROR ? 1 : -1;
+    }
+    if (uring_state < 0 || n == 0) {
+        return io_serial(fd, reqs, n);
+    }
+
+    while (done < n) {
+        while (queued < n && inflight < (int)ring.entries) {
+            uring_queue(&ring, fd, &reqs[queued], queued);
+            queued++;
+            pending++;
+            inflight++;
+        }
+
+        // queue everything added, then wait for at least one completion
+        int rc = syscall(__NR_io_uring_enter, ring.fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0 && errno != EINTR) {
+            uring_exit(&ring);      // waits for requests still using the buffers
+            uring_state = -1;
+            return ERR_DB_FILE;
+        }
+        if (rc > 0) pending -= rc;
+        int reaped = uring_reap(&ring, reqs);
+        done += reaped;
+        inflight -= reaped;
+    }
+
+    // a request the kernel did not run is retried; if pread/pwrite takes it
+    // the ring lacks the opcode and every later batch goes serial
+    for (int i = 0; i < n; i++) {
+        if (reqs[i].res != -EINVAL) continue;
+        io_serial(fd, &reqs[i], 1);
+        if (reqs[i].res >= 0 && uring_state > 0) {
+            uring_exit(&ring);
+            uring_state = -1;
+        }
+    }
+    return NO_ERROR;
+}
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Write-ahead log for add/delete.  Every change is appended to WAL_FILE as a
+// wal_record_t holding the new content of the record.  Records are buffered
+// and made durable with one fdatasync per group of wal_group_size changes
+// (group commit) and whenever the db is closed.  The db itself is only
+// fsync'd at a checkpoint, after which the log is emptied.  open_db replays
+// the log, so committed changes survive a crash even if the db pages did not
+// reach the disk.
+//
+// Several processes may append to the log at once.  Appends and the
+// truncate at a checkpoint are serialized with LOCK_WAL, and the log is only
+// replayed by a process that has the db to itself, see open_db.  LSNs come
+// from the clock so two changes of the same id made by different processes,
+// which the record lock already orders, replay in that order.
+
+int wal_enabled = 1;                    // SDB_WAL=off turns logging off
+int wal_group_size = WAL_DEF_GROUP;     // changes per fdatasync
+
+static int wal_fd = -1;
+static int wal_db_fd = -1;
+static wal_record_t *wal_buf = NULL;    // changes not yet written to the log
+static int wal_nbuf = 0, wal_cap = 0;
+static uint64_t wal_next_lsn = 1;
+static off_t wal_size = 0;              // bytes of valid log on disk
+
+/*
+ * wal_checksum - FNV-1a hash over everything in r after the crc field.
+ */
+uint32_t wal_checksum(const wal_record_t *r) {
+    const unsigned char *p = (const unsigned char *)&r->lsn;
+    const unsigned char *end = (const unsigned char *)(r + 1);
+    uint32_t h = 2166136261u;
+
+    for (; p < end; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * wal_config_from_env - Reads SDB_WAL (on|off) and SDB_WAL_GROUP, the number
+ *                       of changes made durable by a single fdatasync.
+ */
+void wal_config_from_env(void) {
+    char *v = getenv(SDB_WAL_ENV);
+
+    wal_enabled = !(v != NULL && strcmp(v, "off") == 0);
+    v = getenv(SDB_WAL_GROUP_ENV);
+    if (v != NULL && atoi(v) > 0) {
+        wal_group_size = atoi(v);
+    }
+}
+
+// orders replayed changes by id, keeping log order for the same id
+static int cmp_wal_id(const void *a, const void *b) {
+    const wal_record_t *ra = a, *rb = b;
+
+    if (ra->id != rb->id) return (ra->id > rb->id) - (ra->id < rb->id);
+    return (ra->lsn > rb->lsn) - (ra->lsn < rb->lsn);
+}
+
+/*
+ * wal_recover - Replays the log into the db in fd.  Reading stops at the
+ *               first torn or corrupt record, which is cut off so later
+ *               appends are not hidden behind it.  Only the last change of
+ *               each id is applied, and only if the db does not hold it
+ *               already.  Returns the number of records repaired.
+ */
+static int wal_recover(int fd) {
+    struct stat st;
+    wal_record_t *log;
+    size_t n = 0;
+    student_t cur;
+    int repaired = 0;
+
+    if (fstat(wal_fd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+    wal_size = 0;
+    if (st.st_size < (off_t)sizeof(wal_record_t)) {
+        return ftruncate(wal_fd, 0) == -1 ? ERR_DB_FILE : 0;
+    }
+
+    log = malloc(st.st_size);
+    if (log == NULL || pread(wal_fd, log, st.st_size, 0) != st.st_size) {
+        free(log);
+        return ERR_DB_FILE;
+    }
+
+    for (size_t max = st.st_size / sizeof(wal_record_t); n < max; n++) {
+        if (log[n].magic != WAL_MAGIC || log[n].crc != wal_checksum(&log[n])) break;
+        wal_next_lsn = log[n].lsn + 1;
+    }
+    wal_size = n * sizeof(wal_record_t);
+    if (wal_size != st.st_size && ftruncate(wal_fd, wal_size) == -1) {
+        free(log);
+        return ERR_DB_FILE;
+    }
+
+    qsort(log, n, sizeof(wal_record_t), cmp_wal_id);
+    for (size_t i = 0; i < n; i++) {
+        if (i + 1 < n && log[i + 1].id == log[i].id) continue;  // superseded
+
+        if (read_record(fd, log[i].id, &cur) != NO_ERROR) {
+            cur = EMPTY_STUDENT_RECORD;
+        }
+        if (memcmp(&cur, &log[i].rec, sizeof(student_t)) != 0) {
+            if (write_record(fd, log[i].id, &log[i].rec) != NO_ERROR) {
+                free(log);
+                return ERR_DB_FILE;
+            }
+            repaired++;
+        }
+    }
+
+    free(log);
+    return repaired;
+}
+
+/*
+ * wal_open - Opens the log for the db in fd and, if replay is true, replays
+ *            it.  Returns the number of records the replay repaired, or
+ *            ERR_DB_FILE.
+ */
+int wal_open(int fd, bool replay) {
+    wal_close();
+    if (!wal_enabled) {
+        return 0;
+    }
+
+    wal_fd = open(WAL_FILE, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (wal_fd == -1) {
+        return ERR_DB_FILE;
+    }
+    wal_db_fd = fd;
+    return replay ? wal_recover(fd) : 0;
+}
+
+/*
+ * wal_next - Returns the LSN for a new record: the current time in
+ *            nanoseconds, or one past the last LSN if the clock is behind.
+ */
+static uint64_t wal_next(void) {
+    struct timespec ts;
+    uint64_t now;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+    if (now < wal_next_lsn) {
+        now = wal_next_lsn;
+    }
+    wal_next_lsn = now + 1;
+    return now;
+}
+
+/*
+ * wal_append - Buffers a change without committing it.  op is WAL_OP_PUT with
+ *              the new record in s, or WAL_OP_DEL.  The change also goes to
+ *              the change log right away.
+ */
+int wal_append(int op, int id, const student_t *s) {
+    if (chg_append(op, id, s) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    if (wal_fd == -1) {
+        return NO_ERROR;
+    }
+
+    if (wal_nbuf == wal_cap) {
+        int cap = wal_cap ? wal_cap * 2 : 64;
+        wal_record_t *p = realloc(wal_buf, cap * sizeof(wal_record_t));
+        if (p == NULL) return ERR_DB_OP;
+        wal_buf = p;
+        wal_cap = cap;
+    }
+
+    wal_record_t *r = &wal_buf[wal_nbuf++];
+    memset(r, 0, sizeof(*r));
+    r->magic = WAL_MAGIC;
+    r->lsn = wal_next();
+    r->op = op;
+    r->id = id;
+    if (op == WAL_OP_PUT) {
+        r->rec = *s;
+    }
+    r->crc = wal_checksum(r);
+    return NO_ERROR;
+}
+
+/*
+ * wal_log - Buffers a change and commits the group once it holds
+ *           wal_group_size changes.
+ */
+int wal_log(int op, int id, const student_t *s) {
+    if (wal_append(op, id, s) != NO_ERROR) {
+        return ERR_DB_OP;
+    }
+    if (wal_nbuf >= wal_group_size) {
+        return wal_commit();
+    }
+    return NO_ERROR;
+}
+
+/*
+ * wal_commit - Writes all buffered changes with one write and makes them
+ *              durable with one fdatasync.  Checkpoints once the log grows
+ *              past WAL_CHECKPOINT_SIZE.
+ */
+int wal_commit(void) {
+    if (wal_fd == -1 || wal_nbuf == 0) {
+        return NO_ERROR;
+    }
+    if (chg_sync() != NO_ERROR) {
+        return ERR_DB_FILE;     // first, so every change the log replays is streamed
+    }
+
+    // a checkpoint must not truncate the log in the middle of the write, the
+    // sync can run concurrently with other appends
+    ssize_t want = wal_nbuf * sizeof(wal_record_t);
+    lock_meta(wal_db_fd, LOCK_WAL, F_WRLCK);
+    bool ok = write(wal_fd, wal_buf, want) == want;
+    wal_size = lseek(wal_fd, 0, SEEK_END);
+    unlock_meta(wal_db_fd, LOCK_WAL);
+    if (!ok || wal_size < 0 || fdatasync(wal_fd) == -1) {
+        return ERR_DB_FILE;
+    }
+    wal_nbuf = 0;
+
+    if (wal_size >= WAL_CHECKPOINT_SIZE) {
+        return wal_checkpoint();
+    }
+    return NO_ERROR;
+}
+
+/*
+ * wal_checkpoint - Commits, flushes the db to disk and empties the log since
+ *                  every change in it is now durable in the db itself.
+ */
+int wal_checkpoint(void) {
+    int rc = NO_ERROR;
+
+    if (wal_fd == -1) {
+        return NO_ERROR;
+    }
+
+    // the db fsync also covers records other processes logged before the
+    // lock was taken
+    lock_meta(wal_db_fd, LOCK_WAL, F_WRLCK);
+    if (wal_nbuf > 0) {
+        ssize_t want = wal_nbuf * sizeof(wal_record_t);
+        if (write(wal_fd, wal_buf, want) != want) rc = ERR_DB_FILE;
+        wal_nbuf = 0;
+    }
+    if (rc == NO_ERROR && (chg_sync() != NO_ERROR || bloom_sync() != NO_ERROR ||
+                           fsync(wal_db_fd) == -1 || ftruncate(wal_fd, 0) == -1)) {
+        rc = ERR_DB_FILE;
+    }
+    unlock_meta(wal_db_fd, LOCK_WAL);
+    wal_size = 0;
+    return rc;
+}
+
+/*
+ * wal_reset - Drops the log and any buffered changes, used before the db is
+ *             truncated so a crash can not replay old records into it.
+ */
+int wal_reset(void) {
+    int rc = NO_ERROR;
+
+    wal_nbuf = 0;
+    if (truncate(WAL_FILE, 0) == -1 && access(WAL_FILE, F_OK) == 0) {
+        rc = ERR_DB_FILE;
+    }
+    wal_size = 0;
+    return rc;
+}
+
+/*
+ * wal_close - Commits buffered changes and closes the log.
+ */
+int wal_close(void) {
+    int rc = wal_commit();
+
+    if (wal_fd != -1) {
+        close(wal_fd);
+    }
+    wal_fd = -1;
+    wal_db_fd = -1;
+    free(wal_buf);
+    wal_buf = NULL;
+    wal_nbuf = wal_cap = 0;
+    return rc;
+}
@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <ftw.h>
+
+#include "db.h"
+#include "sdbsc.h"
+
+// Benchmark driver for the student database.  It links against sdbsc.c
+// (built with -DSDB_NO_MAIN) and calls the db functions directly so process
+// startup is not part of the measurement.  Every run works on a scratch
+// directory created under the current directory, so the file system being
+// measured is the one the db normally lives on.  Results are printed one
+// per line as key=value pairs.
+
+static FILE *results;   // real stdout, the db functions print to /dev/null
+static char scratch[] = ".sdbbench.XXXXXX";
+
+/*
+ * now_sec - Monotonic clock in seconds.
+ */
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// nftw callback used to remove the scratch directory
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+/*
+ * enter_scratch - Creates the scratch directory and makes it the cwd.
+ */
+static int enter_scratch(void) {
+    if (mkdtemp(scratch) == NULL || chdir(scratch) == -1) {
+        fprintf(stderr, "sdbbench: cannot create scratch directory\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * leave_scratch - Returns to the parent directory and removes the scratch
+ *                 directory.
+ */
+static void leave_scratch(void) {
+    if (chdir("..") == 0) {
+        nftw(scratch, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+}
+
+/*
+ * bench_wal - Adds ops students one add_student call at a time, committing
+ *             the log every group changes, and reports the throughput.  A
+ *             group of 0 runs without the log for reference.
+ */
+static int bench_wal(int ops, int group) {
+    wal_enabled = group > 0;
+    wal_group_size = group > 0 ? group : 1;
+
+    int fd = open_db(DB_FILE, true);
+    if (fd < 0) return -1;
+
+    double start = now_sec();
+    for (int id = 1; id <= ops; id++) {
+        if (add_student(fd, id, "bench", "student", id % (MAX_STD_GPA + 1)) != NO_ERROR) {
+            close_db(fd);
+            return -1;
+        }
+    }
+    if (close_db(fd) != NO_ERROR) return -1;
+    double secs = now_sec() - start;
+
+    if (group > 0) {
+        fprintf(results, "bench=wal group=%d ops=%d secs=%.6f ops_per_sec=%.0f\n",
+                group, ops, secs, ops / secs);
+    } else {
+        fprintf(results, "bench=wal group=off ops=%d secs=%.6f ops_per_sec=%.0f\n",
+                ops, secs, ops / secs);
+    }
+    fflush(results);
+    return 0;
+}
+
+/*
+ * run_wal - wal [ops]: compares per-change fsync (group=1) with group commit.
+ */
+static int run_wal(int argc, char *argv[]) {
+    static const int groups[] = {0, 1, 8, 64, 512};
+    int ops = argc > 2 ? atoi(argv[2]) : 2000;
+
+    if (ops <= 0 || ops > MAX_STD_ID) {
+        fprintf(stderr, "sdbbench: ops must be between 1 and %d\n", MAX_STD_ID);
+        return EXIT_FAIL_ARGS;
+    }
+
+    for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); i++) {
+        if (bench_wal(ops, groups[i]) != 0) {
+            fprintf(stderr, "sdbbench: wal run with group %d failed\n", groups[i]);
+            return EXIT_FAIL_DB;
+        }
+    }
+    return EXIT_OK;
+}
+
+/*
+ * run_writer - Body of one writer process of bench_locks: adds every
+ *              writers-th id starting at first, interleaved with the other
+ *              writers so they keep touching neighbouring records.
+ */
+static int run_writer(int first, int writers, int ops) {
+    int fd = open_db(DB_FILE, false);
+    if (fd < 0) return EXIT_FAIL_DB;
+
+    for (int id = first; id <= ops; id += writers) {
+        if (add_student(fd, id, "bench", "student", id % (MAX_STD_GPA + 1)) != NO_ERROR) {
+            close_db(fd);
+            return EXIT_FAIL_DB;
+        }
+    }
+    return close_db(fd) == NO_ERROR ? EXIT_OK : EXIT_FAIL_DB;
+}
+
+// db_scan callback used to check the result of bench_locks
+static int count_rec(const student_t *s, void *arg) {
+    (void)s;
+    (*(int *)arg)++;
+    return 0;
+}
+
+/*
+ * bench_locks - Adds ops students from writers concurrent processes, each
+ *               with the db open on its own, and reports the throughput.
+ *               Fails if any add was lost.
+ */
+static int bench_locks(int ops, int writers) {
+    int fd = open_db(DB_FILE, true), failed = 0, count = 0;
+    if (fd < 0 || close_db(fd) != NO_ERROR) return -1;
+
+    fflush(results);
+    double start = now_sec();
+    for (int w = 0; w < writers; w++) {
+        pid_t pid = fork();
+        if (pid == -1) return -1;
+        if (pid == 0) _exit(run_writer(w + 1, writers, ops));
+    }
+    for (int w = 0; w < writers; w++) {
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_OK) {
+            failed++;
+        }
+    }
+    double secs = now_sec() - start;
+
+    fd = open_db(DB_FILE, false);
+    if (fd < 0) return -1;
+    if (db_scan(fd, count_rec, &count) != NO_ERROR) count = -1;
+    close_db(fd);
+    if (failed > 0 || count != ops) return -1;
+
+    fprintf(results, "bench=locks writers=%d ops=%d secs=%.6f ops_per_sec=%.0f\n",
+            writers, ops, secs, ops / secs);
+    fflush(results);
+    return 0;
+}
+
+/*
+ * run_locks - locks [ops]: add throughput of 1 to 16 concurrent writers.
+ */
+static int run_locks(int argc, char *argv[]) {
+    static const int writers[] = {1, 2, 4, 8, 16};
+    int ops = argc > 2 ? atoi(argv[2]) : 4000;
+
+    if (ops <= 0 || ops > MAX_STD_ID) {
+        fprintf(stderr, "sdbbench: ops must be between 1 and %d\n", MAX_STD_ID);
+        return EXIT_FAIL_ARGS;
+    }
+
+    for (size_t i = 0; i < sizeof(writers) / sizeof(writers[0]); i++) {
+        if (bench_locks(ops, writers[i]) != 0) {
+            fprintf(stderr, "sdbbench: locks run with %d writers failed\n", writers[i]);
+            return EXIT_FAIL_DB;
+        }
+    }
+    return EXIT_OK;
+}
+
+// latencies of one operation type in a bench_ops run
+typedef struct lat_set {
+    double *us;
+    size_t n, cap;
+} lat_set_t;
+
+/*
+ * lat_add - Records one latency in microseconds.
+ */
+static int lat_add(lat_set_t *l, double us) {
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        double *p = realloc(l->us, cap * sizeof(double));
+        if (p == NULL) return -1;
+        l->us = p;
+        l->cap = cap;
+    }
+    l->us[l->n++] = us;
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * lat_report - Prints throughput and latency percentiles of one operation
+ *              and empties the set.
+ */
+static void lat_report(lat_set_t *l, const char *engine, const char *layout, const char *pop,
+                       int size, const char *op) {
+    double total = 0;
+
+    if (l->n == 0) return;
+    qsort(l->us, l->n, sizeof(double), cmp_double);
+    for (size_t i = 0; i < l->n; i++) total += l->us[i];
+
+    fprintf(results, "bench=ops engine=%s layout=%s pop=%s size=%d op=%s ops=%zu ops_per_sec=%.0f "
+            "p50_us=%.1f p90_us=%.1f p99_us=%.1f max_us=%.1f\n",
+            engine, layout, pop, size, op, l->n, l->n / (total / 1e6),
+            l->us[l->n / 2], l->us[l->n * 90 / 100], l->us[l->n * 99 / 100], l->us[l->n - 1]);
+    fflush(results);
+    l->n = 0;
+}
+
+/*
+ * make_population - Fills ids with size distinct ids in random order.  A
+ *                   dense population is 1..size, a sparse one is spread
+ *                   over the whole id range.  The generator is seeded so
+ *                   every run uses the same workload.
+ */
+static void make_population(int *ids, int size, bool sparse) {
+    unsigned seed = 12345;
+    int range = sparse ? MAX_STD_ID : size;
+    int *all = malloc(range * sizeof(int));
+
+    for (int i = 0; i < range; i++) all[i] = i + 1;
+    for (int i = range - 1; i > 0; i--) {    // Fisher-Yates
+        int j = rand_r(&seed) % (i + 1);
+        int t = all[i]; all[i] = all[j]; all[j] = t;
+    }
+    memcpy(ids, all, size * sizeof(int));
+    free(all);
+}
+
+/*
+ * bench_ops - Runs the workload on one storage engine, layout and
+ *             population and reports every operation: size adds, size
+ *             gets of present and of absent ids, repeated counts, stats and prints, deleting every other
+ *             student and a full compression.
+ */
+static int bench_ops(int engine, int layout, bool sparse, int size) {
+    static const char *fnames[] = {"james", "mary", "john", "patricia", "robert", "linda"};
+    static const char *lnames[] = {"smith", "johnson", "williams", "brown", "jones", "garcia", "miller"};
+    const char *ename = engine == DB_STORAGE_MMAP ? "mmap" : "file";
+    const char *layname = layout == DB_LAYOUT_HASH ? "hash" : "direct";
+    const char *pop = sparse ? "sparse" : "dense";
+    int *ids = malloc(size * sizeof(int));
+    lat_set_t lat = {NULL, 0, 0};
+    student_t s;
+    int rc = 0, fd;
+    double t;
+
+    if (ids == NULL) return -1;
+    make_population(ids, size, sparse);
+    db_storage = engine;
+    db_new_layout = layout;
+    fd = open_db(DB_FILE, true);
+    if (fd < 0) {
+        free(ids);
+        return -1;
+    }
+
+    for (int i = 0; i < size && rc == 0; i++) {
+        char fname[16], lname[16];
+        snprintf(fname, sizeof(fname), "%s", fnames[ids[i] % 6]);
+        snprintf(lname, sizeof(lname), "%s%d", lnames[ids[i] % 7], ids[i] % 100);
+        t = now_sec();
+        rc = add_student(fd, ids[i], fname, lname, ids[i] % (MAX_STD_GPA + 1));
+        rc = rc == NO_ERROR ? lat_add(&lat, (now_sec() - t) * 1e6) : -1;
+    }
+    if (rc == 0) lat_report(&lat, ename, layname, pop, size, "add");
+
+    for (int i = size - 1; i >= 0 && rc == 0; i--) {
+        t = now_sec();
+        rc = get_student(fd, ids[i], &s);
+        rc = rc == NO_ERROR ? lat_add(&lat, (now_sec() - t) * 1e6) : -1;
+    }
+    if (rc == 0) lat_report(&lat, ename, layname, pop, size, "get");
+
+    // ids past every added one, answered by the filter in a hash layout db
+    for (int i = 0; i < size && rc == 0; i++) {
+        t = now_sec();
+        rc = get_student(fd, ids[i] + MAX_STD_ID, &s);
+        rc = rc == SRCH_NOT_FOUND ? lat_add(&lat, (now_sec() - t) * 1e6) : -1;
+    }
+    if (rc == 0) lat_report(&lat, ename, layname, pop, size, "miss");
+
+    for (int i = 0; i < 20 && rc == 0; i++) {
+        t = now_sec();
+        rc = count_db_records(fd) == size ? lat_add(&lat, (now_sec() - t) * 1e6) : -1;
+    }
+    if (rc == 0) lat_report(&lat, ename, layname, pop, size, "count");
+
+    for (int i = 0; i < 20 && rc == 0; i++) {
+        t = now_sec();
+        rc = db_stats(fd, 1) == size ? lat_add(&lat, (now_sec() - t) * 1e6) : -1;
+    }
+    if (rc == 0) lat_report(&lat, ename, layname, pop, size, "stats");
+
+    for (int i = 0; i < 5 && rc == 0; i++) {
+        t = now_sec();
+        rc = print_db(fd, PRINT_TEXT) == NO_ERROR ? lat_add(&lat, (now_sec() - t) * 1e6) : -1;
+        fflush(stdout);
+    }
+    if (rc == 0) lat_report(&lat, ename, layname, pop, size, "print");
+
+    for (int i = 0; i < size && rc == 0; i += 2) {
+        t = now_sec();
+        rc = del_student(fd, ids[i]);
+        rc = rc == NO_ERROR ? lat_add(&lat, (now_sec() - t) * 1e6) : -1;
+    }
+    if (rc == 0) lat_report(&lat, ename, layname, pop, size, "del");
+
+    if (rc == 0) {
+        t = now_sec();
+        fd = compress_db(fd, 0);
+        rc = fd >= 0 ? lat_add(&lat, (now_sec() - t) * 1e6) : -1;
+    }
+    if (rc == 0) lat_report(&lat, ename, layname, pop, size, "compress");
+
+    if (fd >= 0 && close_db(fd) != NO_ERROR) rc = -1;
+    free(lat.us);
+    free(ids);
+    return rc;
+}
+
+/*
+ * run_ops - ops [size] [dense|sparse]: per operation throughput and
+ *           latency for both storage engines and both layouts.
+ */
+static int run_ops(int argc, char *argv[]) {
+    static const int engines[] = {DB_STORAGE_MMAP, DB_STORAGE_FILE};
+    int size = argc > 2 ? atoi(argv[2]) : 20000;
+    const char *pop = argc > 3 ? argv[3] : NULL;
+
+    if (size <= 0 || size > MAX_STD_ID) {
+        fprintf(stderr, "sdbbench: size must be between 1 and %d\n", MAX_STD_ID);
+        return EXIT_FAIL_ARGS;
+    }
+    if (pop != NULL && strcmp(pop, "dense") != 0 && strcmp(pop, "sparse") != 0) {
+        fprintf(stderr, "sdbbench: population must be dense or sparse\n");
+        return EXIT_FAIL_ARGS;
+    }
+
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        for (int layout = DB_LAYOUT_DIRECT; layout <= DB_LAYOUT_HASH; layout++) {
+            for (int sparse = 0; sparse <= 1; sparse++) {
+                if (pop != NULL && (strcmp(pop, "sparse") == 0) != sparse) continue;
+                if (bench_ops(engines[e], layout, sparse, size) != 0) {
+                    fprintf(stderr, "sdbbench: ops run failed\n");
+                    return EXIT_FAIL_DB;
+                }
+            }
+        }
+    }
+    return EXIT_OK;
+}
+
+/*
+ * drop_cache - Writes the db out and asks the kernel to drop its pages, so
+ *              the next reads go to the disk.
+ */
+static int drop_cache(int fd) {
+    if (fsync(fd) == -1) return -1;
+    return posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0 ? 0 : -1;
+}
+
+/*
+ * bench_batch - Looks up the n students in ids against a cold db, one
+ *               get_student at a time (mode "get") or as one batch_find
+ *               with (mode "uring") or without (mode "serial") io_uring.
+ */
+static int bench_batch(const char *mode, const int *ids, int n) {
+    size_t len = (size_t)n * 12 + 1;
+    char *text = malloc(len), *p = text;
+    student_t s;
+    int rc = 0, fd;
+
+    if (text == NULL) return -1;
+    for (int i = 0; i < n; i++) p += sprintf(p, "%d\n", ids[i]);
+
+    setenv(SDB_URING_ENV, strcmp(mode, "uring") == 0 ? "on" : "off", 1);
+    fd = open_db(DB_FILE, false);
+    if (fd < 0 || drop_cache(fd) != 0) {
+        free(text);
+        return -1;
+    }
+
+    double start = now_sec();
+    if (strcmp(mode, "get") == 0) {
+        for (int i = 0; i < n && rc == 0; i++) {
+            rc = get_student(fd, ids[i], &s) == NO_ERROR ? 0 : -1;
+        }
+    } else {
+        FILE *in = fmemopen(text, p - text, "r");
+        rc = in != NULL && batch_find(fd, in) == n ? 0 : -1;
+        if (in != NULL) fclose(in);
+    }
+    double secs = now_sec() - start;
+    fflush(stdout);
+    if (close_db(fd) != NO_ERROR) rc = -1;
+    free(text);
+    if (rc != 0) return -1;
+
+    fprintf(results, "bench=batch mode=%s lookups=%d secs=%.6f lookups_per_sec=%.0f\n",
+            mode, n, secs, n / secs);
+    fflush(results);
+    return 0;
+}
+
+/*
+ * run_batch - batch [n]: n lookups of ids spread over the whole id range
+ *             against a cold file, one by one and batched.
+ */
+static int run_batch(int argc, char *argv[]) {
+    static const char *modes[] = {"get", "serial", "uring"};
+    int n = argc > 2 ? atoi(argv[2]) : 10000;
+    int *ids, fd, rc = EXIT_OK;
+
+    if (n <= 0 || n > MAX_STD_ID) {
+        fprintf(stderr, "sdbbench: n must be between 1 and %d\n", MAX_STD_ID);
+        return EXIT_FAIL_ARGS;
+    }
+    ids = malloc(n * sizeof(int));
+    if (ids == NULL) return EXIT_FAIL_DB;
+    make_population(ids, n, true);
+
+    // the file engine, so no mapping keeps the pages in memory
+    db_storage = DB_STORAGE_FILE;
+    db_new_layout = DB_LAYOUT_DIRECT;
+    fd = open_db(DB_FILE, true);
+    for (int i = 0; i < n && fd >= 0 && rc == EXIT_OK; i++) {
+        if (add_student(fd, ids[i], "bench", "student", ids[i] % (MAX_STD_GPA + 1)) != NO_ERROR) {
+            rc = EXIT_FAIL_DB;
+        }
+    }
+    if (fd < 0 || rc != EXIT_OK || close_db(fd) != NO_ERROR) {
+        fprintf(stderr, "sdbbench: batch setup failed\n");
+        free(ids);
+        return EXIT_FAIL_DB;
+    }
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]) && rc == EXIT_OK; i++) {
+        if (bench_batch(modes[i], ids, n) != 0) {
+            fprintf(stderr, "sdbbench: batch run with %s failed\n", modes[i]);
+            rc = EXIT_FAIL_DB;
+        }
+    }
+    free(ids);
+    return rc;
+}
+
+/*
+ * bench_scan - Times count_db_records and print_db (to /dev/null) on the
+ *              db in fd with a given number of scan threads.
+ */
+static int bench_scan(int fd, int threads, int size) {
+    char v[16];
+    int rc = 0;
+
+    snprintf(v, sizeof(v), "%d", threads);
+    setenv(SDB_SCAN_THREADS_ENV, v, 1);
+
+    double start = now_sec();
+    for (int i = 0; i < 10 && rc == 0; i++) {
+        rc = count_db_records(fd) == size ? 0 : -1;
+    }
+    double count_secs = (now_sec() - start) / 10;
+
+    start = now_sec();
+    for (int i = 0; i < 10 && rc == 0; i++) {
+        rc = print_db(fd, PRINT_TEXT) == NO_ERROR ? 0 : -1;
+        fflush(stdout);
+    }
+    double print_secs = (now_sec() - start) / 10;
+    if (rc != 0) return -1;
+
+    fprintf(results, "bench=scan threads=%d size=%d count_ms=%.3f print_ms=%.3f\n",
+            threads, size, count_secs * 1e3, print_secs * 1e3);
+    fflush(results);
+    return 0;
+}
+
+/*
+ * run_scan - scan [size]: full table scans of a db of size students with
+ *            1 to 8 threads.
+ */
+static int run_scan(int argc, char *argv[]) {
+    static const int threads[] = {1, 2, 4, 8};
+    int size = argc > 2 ? atoi(argv[2]) : MAX_STD_ID;
+    int fd, rc = EXIT_OK;
+
+    if (size <= 0 || size > MAX_STD_ID) {
+        fprintf(stderr, "sdbbench: size must be between 1 and %d\n", MAX_STD_ID);
+        return EXIT_FAIL_ARGS;
+    }
+
+    // loaded as one bulk load, size adds would take far longer than the scans
+    char *csv = malloc((size_t)size * 32), *p = csv;
+    if (csv == NULL) return EXIT_FAIL_DB;
+    for (int id = 1; id <= size; id++) {
+        p += sprintf(p, "%d,bench,student,%d\n", id, id % (MAX_STD_GPA + 1));
+    }
+    FILE *in = fmemopen(csv, p - csv, "r");
+    fd = open_db(DB_FILE, true);
+    if (in == NULL || fd < 0 || bulk_load(fd, in, false) != size) {
+        fprintf(stderr, "sdbbench: scan setup failed\n");
+        rc = EXIT_FAIL_DB;
+    }
+    if (in != NULL) fclose(in);
+    free(csv);
+
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]) && rc == EXIT_OK; i++) {
+        if (bench_scan(fd, threads[i], size) != 0) {
+            fprintf(stderr, "sdbbench: scan run with %d threads failed\n", threads[i]);
+            rc = EXIT_FAIL_DB;
+        }
+    }
+    if (fd >= 0) close_db(fd);
+    unsetenv(SDB_SCAN_THREADS_ENV);
+    return rc;
+}
+
+/*
+ * bench_usage - Prints the benchmarks that can be run.
+ */
+static void bench_usage(char *exename) {
+    fprintf(stderr, "usage: %s benchmark [options]. Where benchmark is:\n", exename);
+    fprintf(stderr, "\twal [ops]: add throughput with per-change fsync vs group commit\n");
+    fprintf(stderr, "\tlocks [ops]: add throughput of 1 to 16 concurrent writer processes\n");
+    fprintf(stderr, "\tops [size] [dense|sparse]: ops/sec and latency percentiles of add, get,\n");
+    fprintf(stderr, "\t    del, count, stats, print and compress on both storage engines and\n");
+    fprintf(stderr, "\t    layouts\n");
+    fprintf(stderr, "\tscan [size]: count and print of a db of size students with 1 to 8 threads\n");
+    fprintf(stderr, "\tbatch [n]: n lookups against a cold db, one by one and as a batch find\n");
+    fprintf(stderr, "\t    with and without io_uring\n");
+}
+
+int main(int argc, char *argv[]) {
+    int rc;
+
+    if (argc < 2) {
+        bench_usage(argv[0]);
+        exit(EXIT_FAIL_ARGS);
+    }
+
+    // keep the db functions' messages out of the results
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "sdbbench: cannot set up output\n");
+        exit(EXIT_FAIL_ARGS);
+    }
+    if (enter_scratch() != 0) {
+        exit(EXIT_FAIL_DB);
+    }
+
+    if (strcmp(argv[1], "wal") == 0) {
+        rc = run_wal(argc, argv);
+    } else if (strcmp(argv[1], "locks") == 0) {
+        rc = run_locks(argc, argv);
+    } else if (strcmp(argv[1], "ops") == 0) {
+        rc = run_ops(argc, argv);
+    } else if (strcmp(argv[1], "scan") == 0) {
+        rc = run_scan(argc, argv);
+    } else if (strcmp(argv[1], "batch") == 0) {
+        rc = run_batch(argc, argv);
+    } else {
+        bench_usage(argv[0]);
+        rc = EXIT_FAIL_ARGS;
+    }
+
+    leave_scratch();
+    fclose(results);
+    exit(rc);
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -5,42 +6,946 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "db.h"
 #include "sdbsc.h"
 
+// Storage engine used for the currently open database.  In DB_STORAGE_MMAP
+// mode the whole file is mapped and viewed as an array of student_t, so
+// record id lives at db_recs[id] (the same id*STUDENT_RECORD_SIZE layout
+// used on disk).  DB_STORAGE_FILE uses plain lseek/read/write calls.
+int db_storage = DB_STORAGE_MMAP;
+
+// Layout of the open db, read from the file by open_db, and the layout a db
+// created or truncated by open_db gets (SDB_LAYOUT).
+int db_layout = DB_LAYOUT_DIRECT;
+int db_new_layout = DB_LAYOUT_DIRECT;
+
+static student_t *db_recs = NULL;   // mapped view of the file, NULL if unmapped
+static size_t db_nrecs = 0;         // number of whole records in the mapping
+
 // Helper function to check if a record is empty (all zero bytes)
 bool is_empty_record(const student_t *student) {
     return memcmp(student, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) == 0;
 }
 
 /*
- * open_db - Opens the database file and creates it if needed.
+ * db_storage_from_env - Selects the storage engine from the SDB_STORAGE
+ *                       environment variable ("mmap" or "file"), and the
+ *                       layout of new dbs from SDB_LAYOUT ("direct" or
+ *                       "hash").
+ */
+int db_storage_from_env(void) {
+    char *mode = getenv(SDB_STORAGE_ENV);
+    char *layout = getenv(SDB_LAYOUT_ENV);
+
+    if (mode != NULL && strcmp(mode, "file") == 0) {
+        db_storage = DB_STORAGE_FILE;
+    } else {
+        db_storage = DB_STORAGE_MMAP;
+    }
+    if (layout != NULL && strcmp(layout, "hash") == 0) {
+        db_new_layout = DB_LAYOUT_HASH;
+    } else {
+        db_new_layout = DB_LAYOUT_DIRECT;
+    }
+    return db_storage;
+}
+
+/*
+ * db_unmap - Drops the mapped view of the database file, if any.
+ */
+static void db_unmap(void) {
+    if (db_recs != NULL) {
+        munmap(db_recs, db_nrecs * STUDENT_RECORD_SIZE);
+    }
+    db_recs = NULL;
+    db_nrecs = 0;
+}
+
+/*
+ * db_map - Maps the whole database file.  An empty file is left unmapped
+ *          until the first record is written.
+ */
+static int db_map(int fd) {
+    struct stat st;
+
+    db_unmap();
+    if (fstat(fd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+
+    size_t nrecs = st.st_size / STUDENT_RECORD_SIZE;
+    if (nrecs == 0) {
+        return NO_ERROR;
+    }
+
+    void *p = mmap(NULL, nrecs * STUDENT_RECORD_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        return ERR_DB_FILE;
+    }
+
+    db_recs = p;
+    db_nrecs = nrecs;
+    return NO_ERROR;
+}
+
+/*
+ * db_refresh - Remaps the file if another process changed its size.
+ */
+static int db_refresh(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+    if ((size_t)st.st_size / STUDENT_RECORD_SIZE == db_nrecs) {
+        return NO_ERROR;
+    }
+    return db_map(fd);
+}
+
+/*
+ * db_map_grow - Extends the file and the mapping so that slot id exists.  The
+ *               file is grown to exactly (id+1) records, the same size a
+ *               write() at id*STUDENT_RECORD_SIZE would have produced.
+ */
+static int db_map_grow(int fd, int id) {
+    size_t nrecs = (size_t)id + 1;
+    size_t new_len;
+    struct stat st;
+    void *p;
+
+    if (nrecs <= db_nrecs) {
+        return NO_ERROR;
+    }
+
+    // another writer may have grown the file past id already, and it must
+    // never be shrunk back
+    lock_meta(fd, LOCK_GROW, F_WRLCK);
+    int rc = fstat(fd, &st);
+    if (rc == 0 && (size_t)st.st_size < nrecs * STUDENT_RECORD_SIZE) {
+        rc = ftruncate(fd, nrecs * STUDENT_RECORD_SIZE);
+    } else if (rc == 0) {
+        nrecs = st.st_size / STUDENT_RECORD_SIZE;
+    }
+    unlock_meta(fd, LOCK_GROW);
+    if (rc == -1) {
+        return ERR_DB_FILE;
+    }
+    new_len = nrecs * STUDENT_RECORD_SIZE;
+
+    if (db_recs == NULL) {
+        p = mmap(NULL, new_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        p = mremap(db_recs, db_nrecs * STUDENT_RECORD_SIZE, new_len, MREMAP_MAYMOVE);
+    }
+    if (p == MAP_FAILED) {
+        db_recs = NULL;
+        db_nrecs = 0;
+        return ERR_DB_FILE;
+    }
+
+    db_recs = p;
+    db_nrecs = nrecs;
+    return NO_ERROR;
+}
+
+/*
+ * db_remap - Refreshes the mapping after the file was resized or written
+ *            with plain write calls.  A no-op for the file engine.
+ */
+int db_remap(int fd) {
+    if (db_storage != DB_STORAGE_MMAP || pack_active()) {
+        return NO_ERROR;
+    }
+    return db_map(fd);
+}
+
+/*
+ * read_slot - Reads the raw record stored in slot.  Returns SRCH_NOT_FOUND
+ *             if the slot lies beyond the end of the file.
+ */
+static int read_slot(int fd, size_t slot, student_t *s) {
+    if (db_storage == DB_STORAGE_MMAP) {
+        // another process may have written past the end of the mapping
+        if (slot >= db_nrecs && (db_refresh(fd) != NO_ERROR || slot >= db_nrecs)) {
+            return SRCH_NOT_FOUND;
+        }
+        *s = db_recs[slot];
+        return NO_ERROR;
+    }
+
+    off_t offset = (off_t)slot * STUDENT_RECORD_SIZE;
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        return ERR_DB_FILE;
+    }
+    if (read(fd, s, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE) {
+        return SRCH_NOT_FOUND;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * read_slots - Reads up to n raw records starting at slot into buf with one
+ *              copy or pread.  Returns the number read, fewer at the end of
+ *              the file.
+ */
+size_t read_slots(int fd, size_t slot, size_t n, student_t *buf) {
+    if (db_storage == DB_STORAGE_MMAP) {
+        if (slot + n > db_nrecs && db_refresh(fd) != NO_ERROR) {
+            return 0;
+        }
+        if (slot >= db_nrecs) return 0;
+        if (n > db_nrecs - slot) n = db_nrecs - slot;
+        memcpy(buf, &db_recs[slot], n * STUDENT_RECORD_SIZE);
+        return n;
+    }
+
+    ssize_t got = pread(fd, buf, n * STUDENT_RECORD_SIZE, (off_t)slot * STUDENT_RECORD_SIZE);
+    return got < 0 ? 0 : (size_t)got / STUDENT_RECORD_SIZE;
+}
+
+/*
+ * write_slot - Writes s into slot, growing the file if needed.
+ */
+int write_slot(int fd, size_t slot, const student_t *s) {
+    if (db_storage == DB_STORAGE_MMAP) {
+        if (db_map_grow(fd, slot) != NO_ERROR) {
+            return ERR_DB_FILE;
+        }
+        db_recs[slot] = *s;
+        return NO_ERROR;
+    }
+
+    off_t offset = (off_t)slot * STUDENT_RECORD_SIZE;
+    if (lseek(fd, offset, SEEK_SET) == -1 || write(fd, s, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE) {
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * db_end_slot - Returns the first slot past the end of the file, where a
+ *               compacted db appends new records.  Slot 0 is never used.
+ */
+long db_end_slot(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+    return st.st_size / STUDENT_RECORD_SIZE > 1 ? st.st_size / STUDENT_RECORD_SIZE : 1;
+}
+
+/*
+ * read_record - Reads the raw record of student id.  Returns SRCH_NOT_FOUND
+ *               if the id has no slot or the slot is beyond the end of file.
+ */
+int read_record(int fd, int id, student_t *s) {
+    if (pack_active()) {
+        return pack_get(id, s);
+    }
+    if (db_layout == DB_LAYOUT_HASH) {
+        return hash_get(fd, id, s);
+    }
+
+    long slot = slot_of(id);
+    if (slot < 0) {
+        return SRCH_NOT_FOUND;
+    }
+    return read_slot(fd, slot, s);
+}
+
+/*
+ * write_record - Writes s as the record of student id.  Without a slot map
+ *                the record goes to slot id.  In a compacted db a new id is
+ *                appended at the end of the file, and writing an empty record
+ *                releases the id's slot.  A hash layout db stores it in the
+ *                table, or removes the id for an empty record.
+ */
+int write_record(int fd, int id, const student_t *s) {
+    if (db_layout == DB_LAYOUT_HASH) {
+        return is_empty_record(s) ? hash_del(fd, id) : hash_put(fd, s);
+    }
+
+    long slot = slot_of(id);
+
+    if (slot_map == NULL) {
+        return write_slot(fd, slot, s);
+    }
+
+    bool empty = is_empty_record(s);
+    if (slot < 0) {
+        if (empty) return NO_ERROR;
+
+        // reserve the slot by growing the file so concurrent appends differ
+        lock_meta(fd, LOCK_GROW, F_WRLCK);
+        slot = db_end_slot(fd);
+        if (slot >= 0 && ftruncate(fd, (off_t)(slot + 1) * STUDENT_RECORD_SIZE) == -1) {
+            slot = ERR_DB_FILE;
+        }
+        unlock_meta(fd, LOCK_GROW);
+        if (slot < 0) return ERR_DB_FILE;
+    }
+    if (write_slot(fd, slot, s) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    slot_map_set(id, empty ? 0 : slot);
+    return NO_ERROR;
+}
+
+/*
+ * page_is_zero - Returns true if a SCAN_PAGE_SIZE block is all zero bytes.
+ */
+static bool page_is_zero(const void *page) {
+#ifdef __SSE2__
+    const __m128i *v = page;
+    __m128i a = _mm_setzero_si128(), b = a, c = a, d = a;
+
+    for (size_t i = 0; i < SCAN_PAGE_SIZE / sizeof(__m128i); i += 4) {
+        a = _mm_or_si128(a, _mm_loadu_si128(v + i));
+        b = _mm_or_si128(b, _mm_loadu_si128(v + i + 1));
+        c = _mm_or_si128(c, _mm_loadu_si128(v + i + 2));
+        d = _mm_or_si128(d, _mm_loadu_si128(v + i + 3));
+    }
+    a = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())) == 0xFFFF;
+#else
+    const uint64_t *w = page;
+    uint64_t acc = 0;
+
+    for (size_t i = 0; i < SCAN_PAGE_SIZE / sizeof(uint64_t); i++) {
+        acc |= w[i];
+    }
+    return acc == 0;
+#endif
+}
+
+/*
+ * live_mask4 - Returns a 4 bit mask with bit i set if recs[i] has a non-zero
+ *              id, testing the id fields of all four records at once.
+ */
+static unsigned live_mask4(const student_t *recs) {
+#ifdef __SSE2__
+    __m128i ids = _mm_set_epi32(recs[3].id, recs[2].id, recs[1].id, recs[0].id);
+    __m128i dead = _mm_cmpeq_epi32(ids, _mm_setzero_si128());
+    return ~(unsigned)_mm_movemask_ps(_mm_castsi128_ps(dead)) & 0xF;
+#else
+    return (recs[0].id != 0) | (recs[1].id != 0) << 1 |
+           (recs[2].id != 0) << 2 | (recs[3].id != 0) << 3;
+#endif
+}
+
+/*
+ * scan_block - Calls fn on every live record in recs[0..n), which hold slots
+ *              base and up.  Whole pages of zero bytes (never written, or
+ *              fully deleted) are skipped without looking at their records.
+ *              In a compacted db, copies the slot map does not point to are
+ *              skipped as well.
+ */
+static int scan_block(const student_t *recs, size_t n, size_t base, db_scan_fn fn, void *arg) {
+    const size_t per_page = SCAN_PAGE_SIZE / sizeof(student_t);
+    size_t i = 0;
+    int rc;
+
+    for (; i + per_page <= n; i += per_page) {
+        if (page_is_zero(&recs[i])) continue;
+
+        for (size_t j = i; j < i + per_page; j += 4) {
+            unsigned live = live_mask4(&recs[j]);
+            while (live != 0) {
+                int k = __builtin_ctz(live);
+                live &= live - 1;
+                if (!slot_is_current(&recs[j + k], base + j + k)) continue;
+                if ((rc = fn(&recs[j + k], arg)) != 0) return rc;
+            }
+        }
+    }
+
+    for (; i < n; i++) {
+        if (recs[i].id != DELETED_STUDENT_ID && slot_is_current(&recs[i], base + i)) {
+            if ((rc = fn(&recs[i], arg)) != 0) return rc;
+        }
+    }
+    return NO_ERROR;
+}
+
+/*
+ * next_extent - Finds the next allocated byte range of the file at or after
+ *               offset, widened to whole records.  Holes left by records that
+ *               were never written are skipped with SEEK_DATA/SEEK_HOLE; on
+ *               file systems without support the rest of the file is one
+ *               extent.  Returns false when there is no more data before
+ *               file_size, which may be the end of a part of the file.
+ */
+static bool next_extent(int fd, off_t offset, off_t file_size, off_t *start, off_t *end) {
+    off_t data, hole;
+
+    if (offset >= file_size) {
+        return false;
+    }
+
+    data = lseek(fd, offset, SEEK_DATA);
+    if (data == -1) {
+        if (errno == ENXIO) return false;   // only a hole is left
+        *start = offset;
+        *end = file_size;
+        return true;
+    }
+    if (data >= file_size) {
+        return false;   // file_size is the end of a part, the data is past it
+    }
+
+    hole = lseek(fd, data, SEEK_HOLE);
+    if (hole == -1 || hole > file_size) {
+        hole = file_size;
+    }
+
+    *start = data - data % STUDENT_RECORD_SIZE;
+    *end = hole + (STUDENT_RECORD_SIZE - hole % STUDENT_RECORD_SIZE) % STUDENT_RECORD_SIZE;
+    if (*start < offset) {
+        *start = offset;
+    }
+    if (*end > file_size) {
+        *end = file_size;
+    }
+    return true;
+}
+
+/*
+ * scan_range - Calls fn on every non-empty record in bytes [lo, hi) of the
+ *              file, in slot order, see db_scan.  lo is a multiple of the
+ *              record size.
+ */
+static int scan_range(int fd, off_t lo, off_t hi, db_scan_fn fn, void *arg) {
+    off_t start, end, offset = lo;
+    student_t *buf = NULL;
+    int rc = NO_ERROR;
+
+    if (db_storage == DB_STORAGE_FILE) {
+        buf = aligned_alloc(SCAN_PAGE_SIZE, SCAN_CHUNK_SIZE);
+        if (buf == NULL) {
+            return ERR_DB_FILE;
+        }
+    }
+
+    while (rc == NO_ERROR && next_extent(fd, offset, hi, &start, &end)) {
+        if (db_storage == DB_STORAGE_MMAP) {
+            rc = scan_block(&db_recs[start / STUDENT_RECORD_SIZE],
+                            (end - start) / STUDENT_RECORD_SIZE,
+                            start / STUDENT_RECORD_SIZE, fn, arg);
+            offset = end;
+            continue;
+        }
+
+        for (offset = start; offset < end && rc == NO_ERROR; ) {
+            size_t want = end - offset < SCAN_CHUNK_SIZE ? end - offset : SCAN_CHUNK_SIZE;
+            ssize_t got = pread(fd, buf, want, offset);
+            if (got < 0) {
+                rc = ERR_DB_FILE;
+                break;
+            }
+
+            size_t n = got / STUDENT_RECORD_SIZE;
+            if (n == 0) {
+                offset = end;
+                break;
+            }
+            rc = scan_block(buf, n, offset / STUDENT_RECORD_SIZE, fn, arg);
+            offset += n * STUDENT_RECORD_SIZE;
+        }
+    }
+
+    free(buf);
+    return rc;
+}
+
+/*
+ * scan_size - Returns the number of bytes of the db a scan visits, after
+ *             remapping if another process changed its size.
+ */
+static off_t scan_size(int fd) {
+    struct stat st;
+
+    if (db_storage == DB_STORAGE_MMAP && db_refresh(fd) != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+    if (fstat(fd, &st) == -1) {
+        return ERR_DB_FILE;
+    }
+    if (db_storage == DB_STORAGE_MMAP && (off_t)(db_nrecs * STUDENT_RECORD_SIZE) < st.st_size) {
+        st.st_size = db_nrecs * STUDENT_RECORD_SIZE;
+    }
+    return st.st_size;
+}
+
+/*
+ * db_scan - Calls fn on every non-empty record, in slot order.  Stops early
+ *           and returns fn's result if fn returns a non-zero value.  Only the
+ *           allocated extents of the file are visited, so the cost follows
+ *           the number of live records rather than the highest id.  The file
+ *           engine reads SCAN_CHUNK_SIZE blocks with pread instead of one
+ *           record per read() call.
+ */
+int db_scan(int fd, db_scan_fn fn, void *arg) {
+    off_t size;
+
+    if (pack_active()) {
+        return pack_scan(fn, arg);
+    }
+    if ((size = scan_size(fd)) < 0) {
+        return ERR_DB_FILE;
+    }
+    return scan_range(fd, 0, size, fn, arg);
+}
+
+/*
+ * scan_in_id_order - Returns true if db_scan visits the records in id
+ *                    order: slot id holds student id, or the db is packed
+ *                    (sorted by id).
+ */
+static bool scan_in_id_order(void) {
+    return pack_active() || (db_layout != DB_LAYOUT_HASH && slot_map == NULL);
+}
+
+// growable list of ids, filled by collect_id
+typedef struct id_list {
+    int *ids;
+    size_t n, cap;
+} id_list_t;
+
+// db_scan callback used by scan_hash_ids
+static int collect_id(const student_t *s, void *arg) {
+    id_list_t *l = arg;
+
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        int *p = realloc(l->ids, cap * sizeof(int));
+        if (p == NULL) return ERR_DB_OP;
+        l->ids = p;
+        l->cap = cap;
+    }
+    l->ids[l->n++] = s->id;
+    return 0;
+}
+
+// orders ids for scan_hash_ids
+static int cmp_int(const void *a, const void *b) {
+    int ia = *(const int *)a, ib = *(const int *)b;
+    return (ia > ib) - (ia < ib);
+}
+
+/*
+ * scan_hash_ids - db_scan_ids for a hash layout db, whose buckets follow
+ *                 the hash of the ids: the ids are collected and sorted,
+ *                 then every record is looked up in turn.
+ */
+static int scan_hash_ids(int fd, db_scan_fn fn, void *arg) {
+    id_list_t l = {NULL, 0, 0};
+    student_t s;
+    int rc = db_scan(fd, collect_id, &l);
+
+    if (rc == NO_ERROR) {
+        qsort(l.ids, l.n, sizeof(int), cmp_int);
+    }
+    for (size_t i = 0; i < l.n && rc == NO_ERROR; i++) {
+        rc = read_record(fd, l.ids[i], &s);
+        if (rc == NO_ERROR && s.id == l.ids[i]) {
+            rc = fn(&s, arg);
+        } else if (rc != ERR_DB_FILE) {
+            rc = NO_ERROR;      // deleted meanwhile
+        }
+    }
+    free(l.ids);
+    return rc;
+}
+
+/*
+ * db_scan_ids - db_scan in id order.  A compacted db keeps records where
+ *               compaction moved them and appends new ids at the end, so
+ *               the slot map is walked instead and every record is read
+ *               from the slot it points to.  A hash layout db is scanned
+ *               by scan_hash_ids.
+ */
+int db_scan_ids(int fd, db_scan_fn fn, void *arg) {
+    student_t s;
+    int rc;
+
+    if (scan_in_id_order()) {
+        return db_scan(fd, fn, arg);
+    }
+    if (db_layout == DB_LAYOUT_HASH) {
+        return scan_hash_ids(fd, fn, arg);
+    }
+    for (int id = MIN_STD_ID; id <= MAX_STD_ID; id++) {
+        if (slot_map[id] == 0) continue;
+        rc = read_record(fd, id, &s);
+        if (rc == ERR_DB_FILE) return ERR_DB_FILE;
+        if (rc != NO_ERROR || s.id != id) continue;     // deleted meanwhile
+        if ((rc = fn(&s, arg)) != 0) return rc;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * scan_threads - Returns how many threads db_scan_parts should use for the
+ *                db in fd: SDB_SCAN_THREADS if set, otherwise one per online
+ *                CPU but no more than one per SCAN_PART_MIN bytes, so small
+ *                dbs are not split.  A packed db is always scanned by one.
+ */
+int scan_threads(int fd) {
+    char *v = getenv(SDB_SCAN_THREADS_ENV);
+    long n;
+    off_t size;
+
+    if (pack_active()) {
+        return 1;
+    }
+    if (v != NULL && atoi(v) > 0) {
+        n = atoi(v);
+    } else {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        size = scan_size(fd);
+        if (size >= 0 && n > size / SCAN_PART_MIN) n = size / SCAN_PART_MIN;
+    }
+    if (n < 1) n = 1;
+    return n > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : (int)n;
+}
+
+typedef struct scan_part {
+    int fd;
+    off_t lo, hi;
+    db_scan_fn fn;
+    db_scan_done_fn done;
+    void *arg;
+    int rc;
+} scan_part_t;
+
+// thread body of db_scan_parts
+static void *scan_worker(void *arg) {
+    scan_part_t *p = arg;
+
+    p->rc = scan_range(p->fd, p->lo, p->hi, p->fn, p->arg);
+    if (p->done != NULL) {
+        p->rc = p->done(p->arg, p->rc);
+    }
+    return NULL;
+}
+
+/*
+ * db_scan_parts - db_scan split over nparts threads.  The file is cut into
+ *                 nparts page aligned ranges in slot order and range t is
+ *                 scanned with args[t], so the caller merges the results of
+ *                 args[0], args[1], ... to get what db_scan would produce.
+ *                 fn runs on several threads at once and must only touch
+ *                 its own arg.  done, if not NULL, is called for every range
+ *                 once it is scanned; ranges without a thread of their own
+ *                 are scanned after range 0 in order, so done may wait for
+ *                 the ranges before its own.  Returns the first non-zero
+ *                 result.
+ */
+int db_scan_parts(int fd, int nparts, db_scan_fn fn, db_scan_done_fn done, void **args) {
+    scan_part_t parts[SCAN_MAX_THREADS];
+    pthread_t tids[SCAN_MAX_THREADS];
+    int started = 0, rc = NO_ERROR;
+    off_t size;
+
+    if (nparts > SCAN_MAX_THREADS) nparts = SCAN_MAX_THREADS;
+    if (pack_active()) {
+        rc = pack_scan(fn, args[0]);
+        for (int t = 0; t < nparts && done != NULL; t++) {
+            rc = done(args[t], rc);
+        }
+        return rc;
+    }
+    if ((size = scan_size(fd)) < 0) {
+        return ERR_DB_FILE;
+    }
+
+    for (int t = 0; t < nparts; t++) {
+        parts[t].fd = fd;
+        parts[t].lo = size * t / nparts / SCAN_PAGE_SIZE * SCAN_PAGE_SIZE;
+        parts[t].fn = fn;
+        parts[t].done = done;
+        parts[t].arg = args[t];
+        parts[t].rc = NO_ERROR;
+        if (t > 0) parts[t - 1].hi = parts[t].lo;
+    }
+    parts[nparts - 1].hi = size;
+
+    // the calling thread takes the first range
+    for (int t = 1; t < nparts; t++, started++) {
+        if (pthread_create(&tids[t], NULL, scan_worker, &parts[t]) != 0) {
+            break;
+        }
+    }
+    scan_worker(&parts[0]);
+    for (int t = started + 1; t < nparts; t++) {
+        scan_worker(&parts[t]);     // no thread for it, scan it here
+    }
+    for (int t = 1; t <= started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+
+    for (int t = 0; t < nparts && rc == NO_ERROR; t++) {
+        rc = parts[t].rc;
+    }
+    return rc;
+}
+
+/*
+ * release_empty_page - Punches a hole over the SCAN_PAGE_SIZE page holding
+ *                      slot once every record in it has been deleted, so
+ *                      later scans skip it as a hole.  Best effort, errors
+ *                      are ignored since the zeroed records are still valid.
+ */
+static void release_empty_page(int fd, long slot) {
+    off_t page = (off_t)slot * STUDENT_RECORD_SIZE / SCAN_PAGE_SIZE * SCAN_PAGE_SIZE;
+    char buf[SCAN_PAGE_SIZE];
+    const void *p = buf;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || page + SCAN_PAGE_SIZE > st.st_size) {
+        return;     // never punch the tail, the file size must not change
+    }
+
+    // Keep writers of the ids in this page out until the hole is punched.
+    // Only try, waiting here while holding a record lock could deadlock
+    // with another delete.  This also drops the caller's record lock.
+    if (db_lock_range(fd, page, SCAN_PAGE_SIZE, F_WRLCK, false) != NO_ERROR) {
+        return;
+    }
+
+    if (db_storage == DB_STORAGE_MMAP) {
+        if ((size_t)(page + SCAN_PAGE_SIZE) <= db_nrecs * STUDENT_RECORD_SIZE) {
+            p = (const char *)db_recs + page;
+        } else {
+            p = NULL;
+        }
+    } else if (pread(fd, buf, SCAN_PAGE_SIZE, page) != SCAN_PAGE_SIZE) {
+        p = NULL;
+    }
+
+    if (p != NULL && page_is_zero(p)) {
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, page, SCAN_PAGE_SIZE);
+    }
+    db_lock_range(fd, page, SCAN_PAGE_SIZE, F_UNLCK, false);
+}
+
+/*
+ * open_db - Opens the database file and creates it if needed.
+ */
+int open_db(char *dbFile, bool should_truncate) {
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;  // rw-rw----
+    struct stat st, path_st;
+    bool alone;
+    int fd;
+
+    // Every open db holds LOCK_OPEN shared.  Only a process that gets it
+    // exclusively is alone with the db and may truncate it, reset stale
+    // sidecars or replay the log; otherwise other writers are active and
+    // everything they committed is already in the file.  -k and -u replace
+    // the file while holding the lock, so retry if it was renamed over.
+    for (;;) {
+        fd = open(dbFile, O_RDWR | O_CREAT, mode);
+        if (fd == -1) {
+            printf(M_ERR_DB_OPEN);
+            return ERR_DB_FILE;
+        }
+
+        alone = db_lock_range(fd, LOCK_OPEN, 1, F_WRLCK, should_truncate) == NO_ERROR;
+        if (!alone && lock_meta(fd, LOCK_OPEN, F_RDLCK) != NO_ERROR) {
+            printf(M_ERR_DB_OPEN);
+            close(fd);
+            return ERR_DB_FILE;
+        }
+        if (fstat(fd, &st) == 0 && stat(dbFile, &path_st) == 0 && st.st_ino == path_st.st_ino) {
+            break;
+        }
+        close(fd);
+    }
+
+    // a packed db is read only, there is nothing to replay or map
+    if (!should_truncate && pack_is_packed(fd)) {
+        if (pack_open(fd) != NO_ERROR) {
+            printf(M_ERR_DB_OPEN);
+            close(fd);
+            return ERR_DB_FILE;
+        }
+        if (alone) {
+            wal_reset();
+            lock_meta(fd, LOCK_OPEN, F_RDLCK);
+        }
+        return fd;
+    }
+
+    if (should_truncate) {
+        wal_reset();    // before truncating, a crash must not replay old changes
+        if (ftruncate(fd, 0) == -1) {
+            printf(M_ERR_DB_OPEN);
+            close(fd);
+            return ERR_DB_FILE;
+        }
+    }
+
+    // A new or truncated db must not inherit the log, slot map or index
+    // entries of a db file that was removed or truncated.  The slot map goes
+    // after the truncate so a crash in between still sees an empty db.
+    bool fresh = alone && (should_truncate || st.st_size == 0);
+    if (fresh) {
+        db_layout = db_new_layout;
+        wal_reset();
+        slot_map_reset();
+        lidx_reset(fd);
+        col_reset(fd);
+        bloom_reset();
+    } else if (slot_map_open() != NO_ERROR) {
+        printf(M_ERR_DB_OPEN);
+        close(fd);
+        return ERR_DB_FILE;
+    }
+    if ((fresh && db_layout == DB_LAYOUT_HASH ? hash_create(fd) : hash_open(fd)) != NO_ERROR) {
+        printf(M_ERR_DB_OPEN);
+        slot_map_close();
+        close(fd);
+        return ERR_DB_FILE;
+    }
+
+    if (db_storage == DB_STORAGE_MMAP && db_map(fd) != NO_ERROR) {
+        printf(M_ERR_DB_OPEN);
+        slot_map_close();
+        close(fd);
+        return ERR_DB_FILE;
+    }
+
+    // before the log replay, whose adds must set their filter bits
+    if (db_layout == DB_LAYOUT_HASH && bloom_open(fd, alone) != NO_ERROR) {
+        printf(M_ERR_DB_OPEN);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    int repaired = wal_open(fd, alone);
+    if (repaired < 0) {
+        printf(M_ERR_WAL_REPLAY);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+    if (chg_open() != NO_ERROR ||
+        (should_truncate && chg_append(CHG_OP_ZERO, 0, NULL) != NO_ERROR)) {
+        printf(M_ERR_CHANGES_OPEN);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    // records repaired from the log may be missing from the index and sidecar
+    if (repaired > 0) {
+        lidx_rebuild(fd);
+        col_rebuild(fd);
+    }
+
+    if (alone) {
+        lock_meta(fd, LOCK_OPEN, F_RDLCK);  // let other processes in
+    }
+    return fd;
+}
+
+/*
+ * close_db - Commits pending log records, releases the mapping (if any) and
+ *            closes the database file.
+ */
+int close_db(int fd) {
+    int rc = NO_ERROR;
+
+    if (wal_close() != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+    }
+    db_unmap();
+    pack_close();
+    col_close();
+    slot_map_close();
+    bloom_close();
+    io_close();
+    chg_close();
+    if (close(fd) == -1) {
+        rc = ERR_DB_FILE;
+    }
+    return rc;
+}
+
+/*
+ * db_reload - Reloads what is kept about the open db after another process
+ *             may have changed or replaced it: whether it is packed, its
+ *             layout, the slot map, the id filter and the mapping.
  */
-int open_db(char *dbFile, bool should_truncate) {
-    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;  // rw-rw----
-    int flags = O_RDWR | O_CREAT;
-    if (should_truncate) flags |= O_TRUNC;
-
-    int fd = open(dbFile, flags, mode);
-    if (fd == -1) {
-        printf(M_ERR_DB_OPEN);
+int db_reload(int fd) {
+    pack_close();
+    if (pack_is_packed(fd)) {
+        return pack_open(fd);
+    }
+    bloom_close();
+    if (hash_open(fd) != NO_ERROR || slot_map_open() != NO_ERROR || db_remap(fd) != NO_ERROR) {
         return ERR_DB_FILE;
     }
-    return fd;
+    // with the lock held exclusively a stale filter can be rebuilt
+    return db_layout == DB_LAYOUT_HASH ? bloom_open(fd, true) : NO_ERROR;
+}
+
+/*
+ * sync_dir - Flushes the directory entry of path to disk, used to make a
+ *            rename durable.
+ */
+int sync_dir(const char *path) {
+    char dir[PATH_MAX];
+    char *slash;
+    int dfd, rc;
+
+    strncpy(dir, path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        *slash = '\0';
+    }
+
+    dfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dfd == -1) return ERR_DB_FILE;
+    rc = fsync(dfd) == -1 ? ERR_DB_FILE : NO_ERROR;
+    close(dfd);
+    return rc;
 }
 
 /*
  * get_student - Fetches a student record by ID.
  */
 int get_student(int fd, int id, student_t *s) {
-    off_t offset = id * STUDENT_RECORD_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == -1) {
+    int rc;
+
+    if (id < 0) {
         printf(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
 
-    if (read(fd, s, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE) {
+    rc = read_record(fd, id, s);
+    if (rc == ERR_DB_FILE) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    if (rc != NO_ERROR) {
         return SRCH_NOT_FOUND;
     }
 
@@ -56,7 +961,30 @@ int get_student(int fd, int id, student_t *s) {
  */
 int add_student(int fd, int id, char *fname, char *lname, int gpa) {
     student_t student;
+
+    if (pack_active()) {
+        printf(M_ERR_DB_PACKED);
+        return ERR_DB_OP;
+    }
+
+    // make room first, growing the table waits for every other process to
+    // close the db and must not hold a record lock meanwhile
+    if (db_layout == DB_LAYOUT_HASH && hash_full(fd, 1)) {
+        if (db_lock_exclusive(fd) != NO_ERROR || hash_resize(fd, 1) != NO_ERROR) {
+            printf(M_ERR_DB_WRITE);
+            return ERR_DB_FILE;
+        }
+        lock_meta(fd, LOCK_OPEN, F_RDLCK);
+    }
+
+    // held until the record is written, a concurrent add of the same id
+    // must see it in the duplicate check
+    if (lock_record(fd, id, F_WRLCK) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
     if (get_student(fd, id, &student) == NO_ERROR) {
+        unlock_record(fd, id);
         printf(M_ERR_DB_ADD_DUP, id);
         return ERR_DB_OP;
     }
@@ -65,11 +993,21 @@ int add_student(int fd, int id, char *fname, char *lname, int gpa) {
     strncpy(new_student.fname, fname, sizeof(new_student.fname) - 1);
     strncpy(new_student.lname, lname, sizeof(new_student.lname) - 1);
 
-    off_t offset = id * STUDENT_RECORD_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == -1 || write(fd, &new_student, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE) {
+    if (write_record(fd, id, &new_student) != NO_ERROR ||
+        wal_log(WAL_OP_PUT, id, &new_student) != NO_ERROR) {
+        unlock_record(fd, id);
         printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
+    if (lidx_insert(fd, &new_student) != NO_ERROR) {
+        unlink(LNAME_IDX_FILE);     // rebuilt from the db on next use
+    }
+    student_t *run = &new_student;
+    if (col_write_run(fd, &run, 1) != NO_ERROR) {
+        col_close();
+        unlink(COLUMN_FILE);
+    }
+    unlock_record(fd, id);
 
     printf(M_STD_ADDED, id);
     return NO_ERROR;
@@ -80,31 +1018,70 @@ int add_student(int fd, int id, char *fname, char *lname, int gpa) {
  */
 int del_student(int fd, int id) {
     student_t student;
+
+    if (pack_active()) {
+        printf(M_ERR_DB_PACKED);
+        return ERR_DB_OP;
+    }
+
+    if (lock_record(fd, id, F_WRLCK) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
     if (get_student(fd, id, &student) != NO_ERROR) {
+        unlock_record(fd, id);
         printf(M_STD_NOT_FND_MSG, id);
         return ERR_DB_OP;
     }
+    long slot = slot_of(id);
 
-    off_t offset = id * STUDENT_RECORD_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == -1 || write(fd, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE) {
+    if (write_record(fd, id, &EMPTY_STUDENT_RECORD) != NO_ERROR ||
+        wal_log(WAL_OP_DEL, id, NULL) != NO_ERROR) {
+        unlock_record(fd, id);
         printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
+    if (lidx_remove(fd, &student) != NO_ERROR) {
+        unlink(LNAME_IDX_FILE);     // rebuilt from the db on next use
+    }
+    if (col_clear(fd, id) != NO_ERROR) {
+        col_close();
+        unlink(COLUMN_FILE);
+    }
+    if (db_layout == DB_LAYOUT_DIRECT) {
+        release_empty_page(fd, slot);   // last, it releases the record lock
+    }
+    unlock_record(fd, id);
 
     printf(M_STD_DEL_MSG, id);
     return NO_ERROR;
 }
 
+// db_scan callback used by count_db_records
+static int count_one(const student_t *s, void *arg) {
+    (void)s;
+    (*(int *)arg)++;
+    return 0;
+}
+
 /*
- * count_db_records - Counts the number of active student records.
+ * count_db_records - Counts the number of active student records, with
+ *                    scan_threads threads.
  */
 int count_db_records(int fd) {
-    student_t student;
-    int count = 0;
+    int counts[SCAN_MAX_THREADS] = {0}, count = 0;
+    void *args[SCAN_MAX_THREADS];
+    int nparts = scan_threads(fd);
 
-    lseek(fd, 0, SEEK_SET);
-    while (read(fd, &student, STUDENT_RECORD_SIZE) == STUDENT_RECORD_SIZE) {
-        if (!is_empty_record(&student)) count++;
+    for (int t = 0; t < nparts; t++) {
+        args[t] = &counts[t];
+    }
+    if (db_scan_parts(fd, nparts, count_one, NULL, args) < 0) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    for (int t = 0; t < nparts; t++) {
+        count += counts[t];
     }
 
     if (count == 0) {
@@ -117,25 +1094,53 @@ int count_db_records(int fd) {
 }
 
 /*
- * print_db - Prints all active student records.
+ * print_db - Prints all active student records in id order in format
+ *            (PRINT_TEXT, PRINT_CSV or PRINT_BIN), buffered, see
+ *            sdb_export.c.  With more than one scan thread every range of
+ *            the file is formatted into its own bounded buffer and the
+ *            ranges write them in slot order, so the output is the same.
  */
-int print_db(int fd) {
-    student_t student;
-    bool header_printed = false;
-
-    lseek(fd, 0, SEEK_SET);
-    while (read(fd, &student, STUDENT_RECORD_SIZE) == STUDENT_RECORD_SIZE) {
-        if (!is_empty_record(&student)) {
-            if (!header_printed) {
-                // Correct header format
-                printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
-                header_printed = true;
-            }
-            printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname, student.lname, student.gpa / 100.0);
+int print_db(int fd, int format) {
+    out_buf_t out, parts[SCAN_MAX_THREADS];
+    out_turn_t turn;
+    void *args[SCAN_MAX_THREADS];
+    int nparts = scan_threads(fd), opened = 0, rc = NO_ERROR;
+
+    if (out_open(&out, format) != NO_ERROR) {
+        printf(M_ERR_MEMORY);
+        return ERR_DB_OP;
+    }
+    // parts are written in slot order, which is only id order without a
+    // slot map or hash table
+    if (nparts == 1 || !scan_in_id_order()) {
+        rc = db_scan_ids(fd, out_record, &out);
+    } else {
+        out_turn_init(&turn);
+        for (; opened < nparts && rc == NO_ERROR; opened++) {
+            rc = out_open_part(&parts[opened], format, &turn, opened);
+            args[opened] = &parts[opened];
         }
+        if (rc == NO_ERROR) {
+            rc = out_flush(&out);   // the CSV header goes first
+        }
+        if (rc == NO_ERROR) {
+            rc = db_scan_parts(fd, nparts, out_record, out_part_done, args);
+        }
+        for (int t = 0; t < opened; t++) {
+            out.nrecs += parts[t].nrecs;
+            out_close(&parts[t]);
+        }
+        out_turn_destroy(&turn);
+    }
+    if (out_close(&out) != NO_ERROR && rc == NO_ERROR) {
+        rc = ERR_DB_FILE;
+    }
+    if (rc < 0) {
+        printf(rc == ERR_DB_OP ? M_ERR_MEMORY : M_ERR_DB_READ);
+        return rc == ERR_DB_OP ? ERR_DB_OP : ERR_DB_FILE;
     }
 
-    if (!header_printed) {
+    if (format == PRINT_TEXT && out.nrecs == 0) {
         printf(M_DB_EMPTY);
     }
 
@@ -157,48 +1162,371 @@ void print_student(student_t *s) {
 }
 
 /*
- * compress_db - Compresses the database by removing zeroed records.
+ * compress_db - Compresses the database in place by moving live records to
+ *               the front of the file, see sdb_compact.c.  With max_batches
+ *               > 0 it pauses after that many batches; running it again
+ *               resumes where it stopped.  Lookups keep working throughout
+ *               through the slot map.
  */
-int compress_db(int fd) {
-    int tmp_fd = open(TMP_DB_FILE, O_CREAT | O_WRONLY | O_TRUNC, 0660);
-    if (tmp_fd == -1) {
-        printf(M_ERR_DB_CREATE);
+int compress_db(int fd, long max_batches) {
+    long done, total;
+    int rc;
+
+    if (pack_active()) {
+        printf(M_ERR_DB_PACKED);
+        close_db(fd);
+        return ERR_DB_OP;
+    }
+    rc = db_lock_exclusive(fd);
+
+    // a hash table is compacted by rehashing it at the smallest size
+    if (rc == NO_ERROR && db_layout == DB_LAYOUT_HASH) {
+        rc = hash_resize(fd, 0) == NO_ERROR ? 1 : ERR_DB_FILE;
+    } else if (rc == NO_ERROR) {
+        rc = compact_db(fd, max_batches, &done, &total);
+    }
+
+    // the file may have shrunk underneath the mapping
+    if (rc < 0 || db_remap(fd) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        close_db(fd);
         return ERR_DB_FILE;
     }
 
-    student_t student;
-    while (read(fd, &student, STUDENT_RECORD_SIZE) == STUDENT_RECORD_SIZE) {
-        if (!is_empty_record(&student)) {
-            if (write(tmp_fd, &student, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE) {
-                printf(M_ERR_DB_WRITE);
-                close(tmp_fd);
-                return ERR_DB_FILE;
-            }
+    if (rc == 0) {
+        printf(M_DB_COMPRESS_PAUSED, done, total);
+    } else {
+        printf(M_DB_COMPRESSED_OK);
+    }
+    return fd;
+}
+
+// qsort comparator for bulk_load, orders record pointers by id (file offset)
+static int cmp_student_ptr(const void *a, const void *b) {
+    const student_t *sa = *(const student_t * const *)a;
+    const student_t *sb = *(const student_t * const *)b;
+    if (sa->id != sb->id) return (sa->id > sb->id) - (sa->id < sb->id);
+    return (sa > sb) - (sa < sb);   // same id: keep input order
+}
+
+#define BULK_SEPS ", \t\r\n"
+
+/*
+ * next_bulk_field - Returns the next field of the line at *p and moves *p
+ *                   past it, or NULL at the end of the line or on an
+ *                   unterminated quote (*bad is set).  A field in double
+ *                   quotes may hold separators, and "" stands for one quote,
+ *                   as in the csv written by -p csv.  Quoted fields are
+ *                   unescaped in place.
+ */
+static char *next_bulk_field(char **p, bool *bad) {
+    char *src = *p + strspn(*p, BULK_SEPS);
+    char *field = src, *dst = src;
+
+    if (*src == '\0') {
+        return NULL;
+    }
+    if (*src != '"') {
+        src += strcspn(src, BULK_SEPS);
+        *p = *src != '\0' ? src + 1 : src;
+        *src = '\0';
+        return field;
+    }
+
+    for (src++; ; src++) {
+        if (*src == '\0') {
+            *bad = true;    // a name with a newline is split by getline
+            return NULL;
+        }
+        if (*src == '"') {
+            if (src[1] != '"') break;
+            src++;
+        }
+        *dst++ = *src;
+    }
+    src++;  // closing quote
+    if (*src != '\0' && strchr(BULK_SEPS, *src) == NULL) {
+        *bad = true;    // text after the closing quote
+        return NULL;
+    }
+    *p = *src != '\0' ? src + 1 : src;
+    *dst = '\0';
+    return field;
+}
+
+/*
+ * parse_bulk_line - Parses one "id,first_name,last_name,gpa" line (commas or
+ *                   blanks separate fields, names may be quoted, see
+ *                   next_bulk_field) into s.  Returns false if the line does
+ *                   not have exactly four well formed fields.
+ */
+static bool parse_bulk_line(char *line, student_t *s) {
+    char *p = line, *end, *tok;
+    char *f[4];
+    bool bad = false;
+    int n = 0;
+
+    while ((tok = next_bulk_field(&p, &bad)) != NULL) {
+        if (n == 4) return false;
+        f[n++] = tok;
+    }
+    if (bad || n != 4) return false;
+
+    memset(s, 0, sizeof(*s));
+    long id = strtol(f[0], &end, 10);
+    if (*end != '\0' || id < INT_MIN || id > INT_MAX) return false;
+    long gpa = strtol(f[3], &end, 10);
+    if (*end != '\0' || gpa < INT_MIN || gpa > INT_MAX) return false;
+
+    s->id = (int)id;
+    s->gpa = (int)gpa;
+    strncpy(s->fname, f[1], sizeof(s->fname) - 1);
+    strncpy(s->lname, f[2], sizeof(s->lname) - 1);
+    return true;
+}
+
+/*
+ * bulk_is_header - Returns true if the first field of line is not a number,
+ *                  as in the "id,first_name,last_name,gpa" header of a csv.
+ */
+static bool bulk_is_header(const char *line) {
+    const char *id = line + strspn(line, " \t");
+    char *end;
+
+    strtol(id, &end, 10);
+    return end == id || strchr(", \t\r\n", *end) == NULL;
+}
+
+/*
+ * write_run - Writes n records to consecutive slots starting at slot using
+ *             as few pwritev calls as possible.  The records themselves are
+ *             not contiguous in memory, the iovec gathers them.
+ */
+static int write_run(int fd, student_t **run, int n, long slot) {
+    struct iovec iov[IOV_MAX];
+
+    for (int done = 0; done < n; ) {
+        int cnt = n - done < IOV_MAX ? n - done : IOV_MAX;
+        for (int i = 0; i < cnt; i++) {
+            iov[i].iov_base = run[done + i];
+            iov[i].iov_len = STUDENT_RECORD_SIZE;
+        }
+
+        off_t offset = (off_t)(slot + done) * STUDENT_RECORD_SIZE;
+        ssize_t want = (ssize_t)cnt * STUDENT_RECORD_SIZE;
+        if (pwritev(fd, iov, cnt, offset) != want) {
+            return ERR_DB_FILE;
         }
+        done += cnt;
     }
+    return NO_ERROR;
+}
 
-    close(fd);
+/*
+ * bulk_load - Loads many students from in (one per line, see
+ *             parse_bulk_line, or raw student_t records if binary is true)
+ *             with a single open database, skipping a leading csv header
+ *             line.  Records are validated with
+ *             validate_range, sorted by file offset and written with one
+ *             pwritev per run of consecutive ids.  Returns the number of
+ *             students added.
+ */
+int bulk_load(int fd, FILE *in, bool binary) {
+    student_t *recs = NULL, **order = NULL, existing;
+    size_t cap = 0, n = 0;
+    int line_no = 0, rejected = 0, added = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
 
-    if (rename(TMP_DB_FILE, DB_FILE) == -1) {
-        printf(M_ERR_DB_CREATE);
+    if (pack_active()) {
+        printf(M_ERR_DB_PACKED);
+        return ERR_DB_OP;
+    }
+    // runs are written without record locks, keep other processes out
+    if (db_lock_exclusive(fd) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
 
-    tmp_fd = open(DB_FILE, O_RDWR);
-    if (tmp_fd == -1) {
-        printf(M_ERR_DB_OPEN);
+    for (;;) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            student_t *p = realloc(recs, cap * sizeof(student_t));
+            if (p == NULL) {
+                printf(M_ERR_MEMORY);
+                free(recs);
+                free(line);
+                return ERR_DB_OP;
+            }
+            recs = p;
+        }
+
+        line_no++;
+        if (binary) {
+            if (fread(&recs[n], STUDENT_RECORD_SIZE, 1, in) != 1) break;
+            recs[n].fname[sizeof(recs[n].fname) - 1] = '\0';
+            recs[n].lname[sizeof(recs[n].lname) - 1] = '\0';
+        } else {
+            if (getline(&line, &line_cap, in) == -1) break;
+            if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') continue;
+            bool header = line_no == 1 && bulk_is_header(line);  // csv header
+            if (!parse_bulk_line(line, &recs[n])) {
+                if (header) continue;
+                printf(M_ERR_BULK_PARSE, line_no);
+                rejected++;
+                continue;
+            }
+        }
+
+        if (validate_range(recs[n].id, recs[n].gpa) != NO_ERROR) {
+            printf(M_ERR_BULK_RNG, line_no);
+            rejected++;
+            continue;
+        }
+        n++;
+    }
+    free(line);
+
+    order = malloc((n ? n : 1) * sizeof(student_t *));
+    if (order == NULL) {
+        printf(M_ERR_MEMORY);
+        free(recs);
+        return ERR_DB_OP;
+    }
+
+    // Sort by id so that the writes below go out in file offset order, then
+    // drop ids that repeat in the input or are already in the database
+    for (size_t i = 0; i < n; i++) order[i] = &recs[i];
+    qsort(order, n, sizeof(student_t *), cmp_student_ptr);
+
+    size_t keep = 0;
+    for (size_t i = 0; i < n; i++) {
+        int id = order[i]->id;
+        if ((keep > 0 && order[keep - 1]->id == id) ||
+            (read_record(fd, id, &existing) == NO_ERROR && existing.id != DELETED_STUDENT_ID)) {
+            printf(M_ERR_DB_ADD_DUP, id);
+            rejected++;
+            continue;
+        }
+        order[keep++] = order[i];
+    }
+
+    // a compacted db appends the whole load at the end of the file, a hash
+    // table is sized for it once and gets one record at a time
+    int rc = NO_ERROR;
+    long next_slot = slot_map != NULL ? db_end_slot(fd) : 0;
+    if (db_layout == DB_LAYOUT_HASH) {
+        rc = hash_resize(fd, (long)keep);
+        for (size_t i = 0; i < keep && rc == NO_ERROR; i++) {
+            rc = hash_put(fd, order[i]);
+            if (rc == NO_ERROR) rc = wal_append(WAL_OP_PUT, order[i]->id, order[i]);
+            if (rc == NO_ERROR) added++;
+        }
+        keep = 0;
+    }
+    for (size_t start = 0; start < keep && rc == NO_ERROR; ) {
+        size_t end = start + 1;
+        while (end < keep && order[end]->id == order[end - 1]->id + 1) end++;
+
+        long slot = slot_map != NULL ? next_slot : order[start]->id;
+        rc = write_run(fd, &order[start], (int)(end - start), slot);
+        for (size_t i = start; i < end && rc == NO_ERROR; i++) {
+            slot_map_set(order[i]->id, slot + (long)(i - start));
+            rc = wal_append(WAL_OP_PUT, order[i]->id, order[i]);
+        }
+        next_slot += end - start;
+        if (rc == NO_ERROR) {
+            added += (int)(end - start);
+            if (col_write_run(fd, &order[start], (int)(end - start)) != NO_ERROR) {
+                col_close();
+                unlink(COLUMN_FILE);
+            }
+        }
+        start = end;
+    }
+
+    free(order);
+    free(recs);
+
+    // the whole load is made durable by a single group commit
+    if (rc == NO_ERROR) {
+        rc = wal_commit();
+    }
+
+    // pwritev may have grown the file underneath the mapping
+    if (db_remap(fd) != NO_ERROR) {
+        rc = ERR_DB_FILE;
+    }
+    if (added > 0 && lidx_rebuild(fd) != NO_ERROR) {
+        unlink(LNAME_IDX_FILE);
+    }
+    if (rc != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
 
-    printf(M_DB_COMPRESSED_OK);
-    return tmp_fd;
+    printf(M_BULK_LOADED, added, rejected);
+    return added;
+}
+
+/*
+ * exec_request - Runs an add, count, delete, find or print request and
+ *                returns its exit code.  Used for the command line and by
+ *                the server, see sdb_server.c.
+ */
+int exec_request(int fd, const srv_request_t *req) {
+    student_t student = {0};
+    char fname[sizeof(req->fname)], lname[sizeof(req->lname)];
+    int rc;
+
+    switch (req->op) {
+        case 'a':
+            if (validate_range(req->id, req->gpa) != NO_ERROR) {
+                printf(M_ERR_STD_RNG);
+                return EXIT_FAIL_ARGS;
+            }
+            memcpy(fname, req->fname, sizeof(fname));
+            memcpy(lname, req->lname, sizeof(lname));
+            rc = add_student(fd, req->id, fname, lname, req->gpa);
+            return rc < 0 ? EXIT_FAIL_DB : EXIT_OK;
+
+        case 'c':
+            rc = count_db_records(fd);
+            return rc < 0 ? EXIT_FAIL_DB : EXIT_OK;
+
+        case 'd':
+            rc = del_student(fd, req->id);
+            return rc < 0 ? EXIT_FAIL_DB : EXIT_OK;
+
+        case 'f':
+            lock_record(fd, req->id, F_RDLCK);
+            rc = get_student(fd, req->id, &student);
+            unlock_record(fd, req->id);
+            if (rc == NO_ERROR) {
+                print_student(&student);
+                return EXIT_OK;
+            }
+            if (rc == SRCH_NOT_FOUND) {
+                printf(M_STD_NOT_FND_MSG, req->id);
+            } else {
+                printf(M_ERR_DB_READ);
+            }
+            return EXIT_FAIL_DB;
+
+        case 'p':
+            rc = print_db(fd, req->id);
+            return rc < 0 ? EXIT_FAIL_DB : EXIT_OK;
+    }
+    return EXIT_FAIL_ARGS;
 }
 
 /*
  * validate_range - Validates that ID and GPA are within allowable ranges.
  */
 int validate_range(int id, int gpa) {
-    if (id < MIN_STD_ID || id > MAX_STD_ID || gpa < MIN_STD_GPA || gpa > MAX_STD_GPA) {
+    int max_id = db_layout == DB_LAYOUT_HASH ? INT_MAX : MAX_STD_ID;
+
+    if (id < MIN_STD_ID || id > max_id || gpa < MIN_STD_GPA || gpa > MAX_STD_GPA) {
         return EXIT_FAIL_ARGS;
     }
     return NO_ERROR;
@@ -208,15 +1536,87 @@ int validate_range(int id, int gpa) {
  * usage - Prints the program's usage information.
  */
 void usage(char *exename) {
-    printf("usage: %s -[h|a|c|d|f|p|z] options. Where:\n", exename);
+    printf("usage: %s -[h|a|b|c|d|e|f|g|k|l|p|r|s|t|u|w|x|z|D|F|S] options. Where:\n", exename);
     printf("\t-h:  prints help\n");
     printf("\t-a id first_name last_name gpa(as 3 digit int): adds a student\n");
+    printf("\t-b [bin]: bulk loads students from stdin, one \"id,first_name,last_name,gpa\"\n");
+    printf("\t          per line (or raw 64 byte records with bin)\n");
     printf("\t-c:  counts the records in the database\n");
     printf("\t-d id: deletes a student\n");
+    printf("\t-e [lsn]: prints the changes logged after lsn as \"lsn,op,id,first_name,\n");
+    printf("\t          last_name,gpa\" lines, op is put, del or zero (-z)\n");
+    printf("\t-w [lsn]: like -e, then keeps printing changes as they are made\n");
     printf("\t-f id: finds and prints a student in the database\n");
-    printf("\t-p:  prints all records in the student database\n");
-    printf("\t-x:  compresses the database file (extra credit)\n");
+    printf("\t-k:  packs the database into the compact read only format\n");
+    printf("\t-u:  unpacks a packed database back to 64 byte records\n");
+    printf("\t-l last_name: finds and prints all students with a last name\n");
+    printf("\t-p [csv|bin]: prints all records in the student database, as csv that\n");
+    printf("\t              -b loads, or as raw 64 byte records for -b bin\n");
+    printf("\t-r lo_id hi_id: prints students with lo_id <= id <= hi_id\n");
+    printf("\t-g min_gpa [max_gpa]: prints students with a gpa in the range\n");
+    printf("\t-t [threads]: prints the student count, average, lowest and highest gpa\n");
+    printf("\t              and a gpa histogram, optionally using several threads\n");
+    printf("\t-s dest: writes a consistent copy of the db to dest (and dest.map for a\n");
+    printf("\t         compacted db), cloned without copying data where supported\n");
+    printf("\t-x [batches]: compresses the database file in place, optionally\n");
+    printf("\t              pausing after some batches (run -x again to resume)\n");
     printf("\t-z:  zero db file (remove all records)\n");
+    printf("\t-F:  finds and prints the students whose ids are read from stdin, one\n");
+    printf("\t     per line, with the reads of a batch in flight at once\n");
+    printf("\t-D:  deletes the students whose ids are read from stdin, one per line\n");
+    printf("\t-S [stop]: serves the db on %s until stopped, while it runs\n", SERVER_SOCK_FILE);
+    printf("\t           -a, -c, -d, -f and -p are sent to the server\n");
+    printf("environment:\n");
+    printf("\t%s=mmap|file: storage engine used to access the db (default mmap)\n", SDB_STORAGE_ENV);
+    printf("\t%s=direct|hash: layout of a new db, hash allows ids up to %d\n", SDB_LAYOUT_ENV, INT_MAX);
+    printf("\t          (default direct, ids up to %d)\n", MAX_STD_ID);
+    printf("\t%s=on|off: write-ahead log for adds and deletes (default on)\n", SDB_WAL_ENV);
+    printf("\t%s=n: changes made durable per log fsync (default %d)\n", SDB_WAL_GROUP_ENV, WAL_DEF_GROUP);
+    printf("\t%s=n: threads scanning the db for -c and -p (default one per CPU,\n", SDB_SCAN_THREADS_ENV);
+    printf("\t          at most one per %d MB of db)\n", SCAN_PART_MIN / (1024 * 1024));
+    printf("\t%s=on|off: change log read by -e and -w (default on)\n", SDB_CHANGES_ENV);
+    printf("\t%s=on|off: io_uring for -F and -D where supported (default on)\n", SDB_URING_ENV);
+}
+
+// sdbbench links against this file and provides its own main
+#ifndef SDB_NO_MAIN
+/*
+ * build_request - Fills in req for the options a server can run (-a, -c,
+ *                 -d, -f and -p).  Returns false for any other option or if
+ *                 the arguments are wrong.
+ */
+static bool build_request(int argc, char *argv[], srv_request_t *req) {
+    memset(req, 0, sizeof(*req));
+    req->magic = SRV_MAGIC;
+    req->op = argv[1][1];
+
+    switch (req->op) {
+        case 'a':
+            if (argc != 6) return false;
+            req->id = atoi(argv[2]);
+            req->gpa = atoi(argv[5]);
+            strncpy(req->fname, argv[3], sizeof(req->fname) - 1);
+            strncpy(req->lname, argv[4], sizeof(req->lname) - 1);
+            return true;
+
+        case 'd':
+        case 'f':
+            if (argc != 3) return false;
+            req->id = atoi(argv[2]);
+            return true;
+
+        case 'c':
+            return true;
+
+        case 'p':
+            if (argc == 2) return true;
+            if (argc != 3) return false;
+            if (strcmp(argv[2], "csv") == 0) req->id = PRINT_CSV;
+            else if (strcmp(argv[2], "bin") == 0) req->id = PRINT_BIN;
+            else return false;
+            return true;
+    }
+    return false;
 }
 
 /*
@@ -224,8 +1624,9 @@ void usage(char *exename) {
  */
 int main(int argc, char *argv[]) {
     char opt;
-    int fd, rc, exit_code = EXIT_OK, id, gpa;
-    student_t student = {0};
+    int fd, rc, exit_code = EXIT_OK, gpa;
+    srv_request_t req;
+    bool have_req;
 
     if (argc < 2 || argv[1][0] != '-') {
         usage(argv[0]);
@@ -239,74 +1640,148 @@ int main(int argc, char *argv[]) {
         exit(EXIT_OK);
     }
 
+    db_storage_from_env();
+    wal_config_from_env();
+    chg_config_from_env();
+
+    if (opt == 'S') {
+        if (argc == 2) exit(start_server());
+        if (argc == 3 && strcmp(argv[2], "stop") == 0) exit(stop_server());
+        usage(argv[0]);
+        exit(EXIT_FAIL_ARGS);
+    }
+
+    // the change stream only reads the change log
+    if (opt == 'e' || opt == 'w') {
+        if (argc > 3 || (argc == 3 && atoll(argv[2]) < 0)) {
+            usage(argv[0]);
+            exit(EXIT_FAIL_ARGS);
+        }
+        rc = stream_changes(argc == 3 ? atoll(argv[2]) : 0, opt == 'w');
+        exit(rc < 0 ? EXIT_FAIL_DB : EXIT_OK);
+    }
+
+    // a running server keeps the db open, let it do the work
+    have_req = build_request(argc, argv, &req);
+    if (have_req) {
+        rc = client_request(&req);
+        if (rc >= 0) exit(rc);
+    } else if (strchr("bDkusxz", opt) != NULL && opt != '\0' && server_running()) {
+        printf(M_ERR_SRV_BUSY);
+        exit(EXIT_FAIL_DB);
+    }
+
     fd = open_db(DB_FILE, false);
     if (fd < 0) exit(EXIT_FAIL_DB);
 
     switch (opt) {
         case 'a':
-            if (argc != 6) {
+        case 'c':
+        case 'd':
+        case 'f':
+        case 'p':
+            if (!have_req) {
                 usage(argv[0]);
                 exit_code = EXIT_FAIL_ARGS;
                 break;
             }
-            id = atoi(argv[2]);
-            gpa = atoi(argv[5]);
-            exit_code = validate_range(id, gpa);
-            if (exit_code == EXIT_FAIL_ARGS) {
-                printf(M_ERR_STD_RNG);
+            exit_code = exec_request(fd, &req);
+            break;
+
+        case 'b':
+            if (argc > 3 || (argc == 3 && strcmp(argv[2], "bin") != 0)) {
+                usage(argv[0]);
+                exit_code = EXIT_FAIL_ARGS;
                 break;
             }
-            rc = add_student(fd, id, argv[3], argv[4], gpa);
+            rc = bulk_load(fd, stdin, argc == 3);
             if (rc < 0) exit_code = EXIT_FAIL_DB;
             break;
 
-        case 'c':
-            rc = count_db_records(fd);
+        case 'F':
+        case 'D':
+            if (argc != 2) {
+                usage(argv[0]);
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+            rc = opt == 'F' ? batch_find(fd, stdin) : batch_del(fd, stdin);
             if (rc < 0) exit_code = EXIT_FAIL_DB;
             break;
 
-        case 'd':
+        case 'l':
             if (argc != 3) {
                 usage(argv[0]);
                 exit_code = EXIT_FAIL_ARGS;
                 break;
             }
-            id = atoi(argv[2]);
-            rc = del_student(fd, id);
+            rc = find_by_lname(fd, argv[2]);
             if (rc < 0) exit_code = EXIT_FAIL_DB;
             break;
 
-        case 'f':
-            if (argc != 3) {
+        case 'r':
+            if (argc != 4) {
                 usage(argv[0]);
                 exit_code = EXIT_FAIL_ARGS;
                 break;
             }
-            id = atoi(argv[2]);
-            rc = get_student(fd, id, &student);
-            if (rc == NO_ERROR) {
-                print_student(&student);
-            } else if (rc == SRCH_NOT_FOUND) {
-                printf(M_STD_NOT_FND_MSG, id);
-                exit_code = EXIT_FAIL_DB;
-            } else {
-                printf(M_ERR_DB_READ);
-                exit_code = EXIT_FAIL_DB;
-            }
+            rc = query_students(fd, atoi(argv[2]), atoi(argv[3]), MIN_STD_GPA, MAX_STD_GPA);
+            if (rc < 0) exit_code = EXIT_FAIL_DB;
             break;
 
-        case 'p':
-            rc = print_db(fd);
+        case 'g':
+            if (argc != 3 && argc != 4) {
+                usage(argv[0]);
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+            gpa = argc == 4 ? atoi(argv[3]) : MAX_STD_GPA;
+            rc = query_students(fd, MIN_STD_ID, INT_MAX, atoi(argv[2]), gpa);
             if (rc < 0) exit_code = EXIT_FAIL_DB;
             break;
 
         case 'x':
-            fd = compress_db(fd);
+            if (argc > 3) {
+                usage(argv[0]);
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+            fd = compress_db(fd, argc == 3 ? atol(argv[2]) : 0);
             if (fd < 0) exit_code = EXIT_FAIL_DB;
             break;
 
+        case 's':
+            if (argc != 3) {
+                usage(argv[0]);
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+            rc = snapshot_db(fd, argv[2]);
+            if (rc < 0) exit_code = EXIT_FAIL_DB;
+            break;
+
+        case 't':
+            if (argc > 3 || (argc == 3 && atoi(argv[2]) < 1)) {
+                usage(argv[0]);
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+            rc = db_stats(fd, argc == 3 ? atoi(argv[2]) : 1);
+            if (rc < 0) exit_code = EXIT_FAIL_DB;
+            break;
+
+        case 'k':
+            rc = pack_db(fd);
+            if (rc < 0) exit_code = EXIT_FAIL_DB;
+            break;
+
+        case 'u':
+            rc = unpack_db(fd);
+            if (rc < 0) exit_code = EXIT_FAIL_DB;
+            break;
+
         case 'z':
-            close(fd);
+            close_db(fd);
             fd = open_db(DB_FILE, true);
             if (fd < 0) {
                 exit_code = EXIT_FAIL_DB;
@@ -320,7 +1795,7 @@ int main(int argc, char *argv[]) {
             exit_code = EXIT_FAIL_ARGS;
     }
 
-    close(fd);
+    if (fd >= 0 && close_db(fd) != NO_ERROR) exit_code = EXIT_FAIL_DB;
     exit(exit_code);
 }
-
+#endif
@@ -1,19 +1,383 @@
 #ifndef __SDB_H__
 
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
 #include "db.h" //get student record type
 
+//storage engines, see db_storage_from_env()
+#define DB_STORAGE_MMAP     0   //file is mmap'd and used as a student_t array
+#define DB_STORAGE_FILE     1   //records accessed with lseek + read/write
+#define SDB_STORAGE_ENV     "SDB_STORAGE"
+extern int db_storage;
+
+//record placement, chosen when a db is created (SDB_LAYOUT) and read back
+//from the file when it is opened
+#define DB_LAYOUT_DIRECT    0   //student id lives in slot id
+#define DB_LAYOUT_HASH      1   //open addressing hash table, see sdb_hash.c
+#define SDB_LAYOUT_ENV      "SDB_LAYOUT"
+extern int db_layout;
+extern int db_new_layout;
+
+//full table scans read the file in SCAN_CHUNK_SIZE blocks and skip all-zero
+//SCAN_PAGE_SIZE pages without looking at the records inside them
+#define SCAN_CHUNK_SIZE     (1024*1024)
+#define SCAN_PAGE_SIZE      4096
+
+//db_scan_parts splits a scan over up to SCAN_MAX_THREADS threads, by
+//default one per CPU and SCAN_PART_MIN bytes of db
+#define SCAN_MAX_THREADS    16
+#define SCAN_PART_MIN       SCAN_CHUNK_SIZE
+#define SDB_SCAN_THREADS_ENV "SDB_SCAN_THREADS"
+
+//callback used to walk all non-empty records, return non-zero to stop
+typedef int (*db_scan_fn)(const student_t *s, void *arg);
+
+//called by db_scan_parts on the thread of a range once it has been scanned,
+//with the arg of the range and the result of its scan; returns the result
+typedef int (*db_scan_done_fn)(void *arg, int rc);
+
+//entry of the last name index (LNAME_IDX_FILE), kept sorted by
+//lname, fname and id so lookups by last name are a binary search
+typedef struct lname_entry {
+    char lname[32];
+    char fname[24];
+    int id;
+} lname_entry_t;
+
+//entry of the column sidecar (COLUMN_FILE), stored at id*sizeof(col_entry_t)
+typedef struct col_entry {
+    int id;
+    int gpa;
+} col_entry_t;
+
+//header of the column sidecar and the last name index.  In the sidecar it
+//takes the place of entry 0, which no student uses, in the index the
+//entries follow it.  Sidecars of another db file are rebuilt.
+typedef struct sidecar_hdr {
+    uint64_t db_ino;    //inode of the db file the sidecar was built from
+} sidecar_hdr_t;
+
+//aggregates of -t, see sdb_stats.c.  Histogram bucket b holds the gpas
+//from b * STATS_BUCKET_GPA, the last one up to MAX_STD_GPA
+#define STATS_BUCKETS       10
+#define STATS_BUCKET_GPA    50
+#define STATS_MAX_THREADS   64
+typedef struct db_stats {
+    long count;
+    long sum;
+    int min, max;
+    long hist[STATS_BUCKETS];
+} db_stats_t;
+
+//write-ahead log record, see sdb_wal.c.  rec holds the new content of the
+//record for WAL_OP_PUT and is zero for WAL_OP_DEL
+#define WAL_MAGIC           0x4c415753  //"SWAL"
+#define WAL_OP_PUT          1
+#define WAL_OP_DEL          2
+#define WAL_DEF_GROUP       64          //changes per fdatasync (group commit)
+#define WAL_CHECKPOINT_SIZE (1024*1024) //log size that triggers a checkpoint
+#define SDB_WAL_ENV         "SDB_WAL"
+#define SDB_WAL_GROUP_ENV   "SDB_WAL_GROUP"
+typedef struct wal_record {
+    uint32_t magic;
+    uint32_t crc;       //checksum of everything after this field
+    uint64_t lsn;
+    int32_t op;
+    int32_t id;
+    student_t rec;
+} wal_record_t;
+extern int wal_enabled;
+extern int wal_group_size;
+
+//change log (CHANGES_FILE) records are wal_record_t with their own magic
+//and the position in the log as LSN, see sdb_changes.c
+#define CHG_MAGIC           0x47484353  //"SCHG"
+#define CHG_OP_ZERO         3           //all records removed (-z)
+#define CHG_READ_BATCH      256         //records read at once by -e and -w
+#define CHG_POLL_MS         1000        //longest wait for new changes in -w
+#define SDB_CHANGES_ENV     "SDB_CHANGES"
+extern int chg_enabled;
+
+//header of the slot map (SLOT_MAP_FILE) of a compacted db, followed by an
+//int32 slot number for every id, see sdb_compact.c
+#define SLOT_MAP_MAGIC      0x50414d53  //"SMAP"
+#define COMPACT_BATCH       (SCAN_CHUNK_SIZE / 64)  //slots per compaction batch
+typedef struct slot_map_hdr {
+    uint32_t magic;
+    uint32_t active;    //a compaction was started and has not finished
+    int64_t src;        //next slot the compaction looks at
+    int64_t dst;        //end of the packed area
+    char pad[40];
+} slot_map_hdr_t;
+extern int32_t *slot_map;
+
+//header of a packed db, stored in slot 0 (always empty in the 64 byte
+//format), followed by the sections it points to, see sdb_pack.c.  A
+//packed_rec_t holds the id and gpa in one word and indexes into the name
+//dictionary
+#define PACK_MAGIC          0x4b415053  //"SPAK"
+#define PACK_VERSION        1
+#define PACK_BLOCK_RECS     256         //records per block of the block index
+#define PACK_ID_GPA(id, gpa) (((uint32_t)(id) << 9) | (uint32_t)(gpa))
+#define PACK_ID(v)          ((int)((v) >> 9))
+#define PACK_GPA(v)         ((int)((v) & 0x1ff))
+typedef struct pack_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nrecs;
+    uint32_t nblocks;
+    uint32_t nnames;
+    uint32_t block_recs;
+    uint64_t names_off;     //uint32 offset into strings of every name
+    uint64_t strings_off;   //NUL terminated names, sorted
+    uint64_t strings_len;
+    uint64_t index_off;     //uint32 first id of every block
+    uint64_t data_off;      //packed_rec_t of every record, sorted by id
+} pack_hdr_t;
+typedef struct packed_rec {
+    uint32_t id_gpa;
+    uint32_t fname;
+    uint32_t lname;
+} packed_rec_t;
+
+//header of a hash layout db, stored in slot 0.  Bucket b of the table of
+//1 << bits buckets is slot b + 1
+#define HASH_MAGIC          0x48534853  //"SHSH"
+#define HASH_MIN_BITS       10
+#define HASH_MAX_BITS       31
+#define HASH_WINDOW         64          //buckets read per probe step
+typedef struct hash_hdr {
+    uint32_t magic;
+    uint32_t bits;
+    uint32_t count;     //records stored
+    char pad[52];
+} hash_hdr_t;
+
+//header of the id filter of a hash layout db, followed by 1 << bits bits
+#define BLOOM_MAGIC         0x4d4c4253  //"SBLM"
+#define BLOOM_HASHES        7           //bits set per id
+#define BLOOM_BITS_SHIFT    4           //16 filter bits per table bucket
+typedef struct bloom_hdr {
+    uint32_t magic;
+    uint32_t bits;
+    uint64_t db_ino;    //inode of the db file the filter belongs to
+    char pad[48];
+} bloom_hdr_t;
+
+//meta locks, single bytes past the lock range of the largest id (hash
+//layout ids go up to INT_MAX), see sdb_lock.c
+#define LOCK_META_BASE      (((off_t)INT32_MAX + 1) * 64)
+#define LOCK_OPEN           (LOCK_META_BASE + 0)    //shared while open
+#define LOCK_GROW           (LOCK_META_BASE + 1)    //extending the file
+#define LOCK_WAL            (LOCK_META_BASE + 2)    //log append and truncate
+#define LOCK_LIDX           (LOCK_META_BASE + 3)    //last name index
+#define LOCK_COL            (LOCK_META_BASE + 4)    //column sidecar rebuild
+#define LOCK_HASH           (LOCK_META_BASE + 5)    //hash table buckets
+
+//output formats of -p, see sdb_export.c
+#define PRINT_TEXT          0
+#define PRINT_CSV           1
+#define PRINT_BIN           2
+#define OUT_BUF_SIZE        (256 * 1024)    //bytes handed to stdout at once
+#define OUT_LINE_MAX        256             //longest formatted record
+#define CSV_HEADER          "id,first_name,last_name,gpa\n"
+//the parts of a parallel print take turns writing to stdout, in order
+typedef struct out_turn {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next;           //index of the part that may write
+    bool hdr;           //text header written
+    int rc;             //first error, later parts write nothing
+} out_turn_t;
+
+typedef struct out_buf {
+    char *buf;
+    size_t len, cap;
+    bool part;          //one range of a parallel print, see out_open_part
+    int format;
+    long nrecs;         //records written so far
+    out_turn_t *turn;   //of a part, shared with the other parts
+    int index;          //of a part, its place in the output
+} out_buf_t;
+
+//request and response of the server protocol, see sdb_server.c.  op is the
+//command line option letter of the operation ('a', 'c', 'd', 'f' or 'p')
+//or SRV_OP_STOP.  For 'p' id holds the PRINT_* output format.  A response
+//header is followed by len bytes of output
+#define SRV_MAGIC           0x56525353  //"SSRV"
+#define SRV_OP_STOP         'q'
+#define SRV_IO_TIMEOUT      5           //seconds a client may stall the server
+typedef struct srv_request {
+    uint32_t magic;
+    int32_t op;
+    int32_t id;
+    int32_t gpa;
+    char fname[24];
+    char lname[32];
+} srv_request_t;
+typedef struct srv_response {
+    int32_t status;     //exit code of the operation
+    uint32_t len;
+} srv_response_t;
+
 //prototypes for functions go below for this assignment
+int db_storage_from_env(void);
 int open_db(char *dbFile, bool should_truncate);
+int close_db(int fd);
 int add_student(int fd, int id, char *fname, char *lname, int gpa);
 int get_student(int fd, int id, student_t *s);
 int del_student(int fd, int id);
-int compress_db(int fd);
+int compress_db(int fd, long max_batches);
 void print_student(student_t *s);
 int validate_range(int id, int gpa);
 int count_db_records(int fd);
-int print_db(int fd);
+int bulk_load(int fd, FILE *in, bool binary);
+int db_scan(int fd, db_scan_fn fn, void *arg);
+int db_scan_ids(int fd, db_scan_fn fn, void *arg);
+int scan_threads(int fd);
+int db_scan_parts(int fd, int nparts, db_scan_fn fn, db_scan_done_fn done, void **args);
+int db_remap(int fd);
+long db_end_slot(int fd);
+int sync_dir(const char *path);
+int read_record(int fd, int id, student_t *s);
+size_t read_slots(int fd, size_t slot, size_t n, student_t *buf);
+int write_slot(int fd, size_t slot, const student_t *s);
+int db_reload(int fd);
+int write_record(int fd, int id, const student_t *s);
+
+//in-place compaction and slot map, see sdb_compact.c
+int slot_map_open(void);
+int slot_map_reset(void);
+void slot_map_close(void);
+long slot_of(int id);
+void slot_map_set(int id, long slot);
+bool slot_is_current(const student_t *s, size_t slot);
+int compact_db(int fd, long max_batches, long *done, long *total);
+
+//hash layout, see sdb_hash.c
+int hash_create(int fd);
+int hash_open(int fd);
+int hash_get(int fd, int id, student_t *s);
+int hash_put(int fd, const student_t *s);
+int hash_del(int fd, int id);
+bool hash_full(int fd, long extra);
+int hash_resize(int fd, long extra);
+int hash_bloom_rebuild(int fd);
+
+//id filter of the hash layout, see sdb_bloom.c
+int bloom_build(uint64_t ino, uint32_t table_bits, const student_t *recs, size_t n);
+int bloom_open(int fd, bool rebuild);
+int bloom_reset(void);
+void bloom_close(void);
+bool bloom_maybe(int id);
+void bloom_add(int id);
+int bloom_sync(void);
+
+//packed read only format, see sdb_pack.c
+bool pack_active(void);
+bool pack_is_packed(int fd);
+int pack_open(int fd);
+void pack_close(void);
+int pack_get(int id, student_t *s);
+int pack_scan(db_scan_fn fn, void *arg);
+int pack_db(int fd);
+int unpack_db(int fd);
+
+//record and meta locks, see sdb_lock.c
+int db_lock_range(int fd, off_t start, off_t len, short type, bool wait);
+int lock_record(int fd, int id, short type);
+void unlock_record(int fd, int id);
+int lock_meta(int fd, off_t which, short type);
+void unlock_meta(int fd, off_t which);
+int db_lock_exclusive(int fd);
+int db_follow(int fd);
+
+//server mode, see sdb_server.c
+int exec_request(int fd, const srv_request_t *req);
+int start_server(void);
+int stop_server(void);
+int client_request(const srv_request_t *req);
+bool server_running(void);
+
+//write-ahead log, see sdb_wal.c
+void wal_config_from_env(void);
+int wal_open(int fd, bool replay);
+int wal_append(int op, int id, const student_t *s);
+int wal_log(int op, int id, const student_t *s);
+int wal_commit(void);
+int wal_checkpoint(void);
+int wal_reset(void);
+int wal_close(void);
+uint32_t wal_checksum(const wal_record_t *r);
+
+//change log, see sdb_changes.c
+void chg_config_from_env(void);
+int chg_open(void);
+int chg_append(int op, int id, const student_t *s);
+int chg_sync(void);
+void chg_close(void);
+int stream_changes(int64_t lsn, bool follow);
+
+//last name index, see sdb_index.c
+int lidx_rebuild(int fd);
+int lidx_reset(int fd);
+int lidx_insert(int fd, const student_t *s);
+int lidx_remove(int fd, const student_t *s);
+int find_by_lname(int fd, char *lname);
+
+//id and gpa column sidecar, see sdb_column.c
+int col_rebuild(int fd);
+int col_reset(int fd);
+void col_close(void);
+int col_write_run(int fd, student_t * const *run, int n);
+int col_clear(int fd, int id);
+int col_map(int fd, const col_entry_t **col, size_t *n);
+int query_students(int fd, int lo_id, int hi_id, int min_gpa, int max_gpa);
+int print_db(int fd, int format);
 void usage(char *);
 
+//aggregate statistics, see sdb_stats.c
+int db_stats(int fd, int nthreads);
+
+//snapshots, see sdb_snapshot.c
+#define SNAP_REFLINK        0   //FICLONE, extents shared with the db
+#define SNAP_COPY_RANGE     1   //copy_file_range of the allocated extents
+#define SNAP_READ_WRITE     2   //plain copy
+#define SNAP_CHUNK_SIZE     (1024 * 1024)
+int snapshot_db(int fd, const char *dest);
+
+//batched record I/O, see sdb_uring.c.  A request reads or writes len bytes
+//at offset; res is set to the byte count or -errno
+#define IO_READ             0
+#define IO_WRITE            1
+#define URING_DEPTH         256     //requests in flight at once
+#define SDB_URING_ENV       "SDB_URING"
+typedef struct io_req {
+    int op;
+    int res;
+    uint32_t len;
+    off_t offset;
+    void *buf;
+} io_req_t;
+int io_batch(int fd, io_req_t *reqs, int n);
+void io_close(void);
+
+//batch finds and deletes of ids read from stdin, see sdb_batch.c
+int batch_find(int fd, FILE *in);
+int batch_del(int fd, FILE *in);
+
+//buffered -p output, see sdb_export.c
+int out_open(out_buf_t *o, int format);
+int out_record(const student_t *s, void *arg);
+int out_change(const wal_record_t *r, out_buf_t *o);
+void out_turn_init(out_turn_t *t);
+void out_turn_destroy(out_turn_t *t);
+int out_open_part(out_buf_t *o, int format, out_turn_t *turn, int index);
+int out_part_done(void *arg, int rc);
+int out_flush(out_buf_t *o);
+int out_close(out_buf_t *o);
+
 //error codes to be returned from individual functions
 // NO_ERROR is returned if there are no errors
 // ERR_DB_FILE is returned if there is are any issues with the database file itself
@@ -44,15 +408,42 @@ void usage(char *);
 #define M_ERR_DB_WRITE    "Error writing DB file, exiting!\n"
 #define M_ERR_DB_ADD_DUP  "Cant add student with ID=%d, already exists in db.\n"
 #define M_ERR_STD_PRINT   "Cant print student. Student is NULL or ID is zero\n"
+#define M_ERR_WAL_REPLAY  "Error replaying write-ahead log, exiting!\n"
+#define M_ERR_MEMORY      "Out of memory, exiting!\n"
+#define M_ERR_BULK_PARSE  "Bulk load line %d is not \"id,first_name,last_name,gpa\", skipping.\n"
+#define M_ERR_BATCH_PARSE "Batch line %d is not a student id, skipping.\n"
+#define M_ERR_BULK_RNG    "Bulk load line %d has an ID or GPA out of allowable range, skipping.\n"
 
 #define M_STD_ADDED       "Student %d added to database.\n"
 #define M_STD_DEL_MSG     "Student %d was deleted from database.\n"
 #define M_STD_NOT_FND_MSG "Student %d was not found in database.\n"
+#define M_STD_LNAME_NOT_FND "No students with last name %s were found in database.\n"
+#define M_DB_NO_MATCH     "No students matched the query.\n"
 #define M_DB_COMPRESSED_OK "Database successfully compressed!\n"
+#define M_DB_COMPRESS_PAUSED "Database compression paused at slot %ld of %ld, run -x again to resume.\n"
 #define M_DB_ZERO_OK      "All database records removed!\n"
 #define M_DB_EMPTY        "Database contains no student records.\n"
 #define M_DB_RECORD_CNT   "Database contains %d student record(s).\n"
+#define M_BATCH_FOUND     "%d of %d student(s) found.\n"
+#define M_STATS_GPA       "GPA average %.2f, lowest %.2f, highest %.2f.\n"
+#define M_BULK_LOADED     "%d student(s) loaded into database, %d rejected.\n"
+#define M_DB_PACKED       "Database packed: %d student(s) in %ld bytes.\n"
+#define M_DB_ALREADY_PACKED "Database is already packed.\n"
+#define M_DB_UNPACKED     "Database unpacked: %d student(s).\n"
+#define M_DB_NOT_PACKED   "Database is not packed.\n"
+#define M_ERR_PACK_ID     "Database has ids above %d, which the packed format does not support.\n"
+#define M_DB_SNAPSHOT     "Snapshot of %ld bytes written to %s (%s).\n"
+#define M_ERR_CHANGES_OPEN "Error opening change log, exiting!\n"
+#define M_ERR_CHANGES_READ "Error reading change log, exiting!\n"
+#define M_ERR_SNAPSHOT    "Cant write snapshot to %s.\n"
+#define M_ERR_DB_PACKED   "Database is packed and read only, unpack it with -u first.\n"
 #define M_NOT_IMPL        "The requested operation is not implemented yet!\n"
+#define M_SRV_STARTED     "Server listening on %s, stop it with -S stop.\n"
+#define M_SRV_STOPPED     "Server stopped.\n"
+#define M_ERR_SRV_START   "Error starting server on %s, exiting!\n"
+#define M_ERR_SRV_NONE    "No server is running on %s.\n"
+#define M_ERR_SRV_COMM    "Error communicating with server, exiting!\n"
+#define M_ERR_SRV_BUSY    "The database is served by a running server, stop it with -S stop first.\n"
 
 //useful format strings for print students
 //For example to print the header in the required output:
@@ -61,4 +452,8 @@ void usage(char *);
 #define  STUDENT_PRINT_HDR_STRING   "%-6s %-24s %-32s %-3s\n"
 #define  STUDENT_PRINT_FMT_STRING   "%-6d %-24.24s %-32.32s %-3.2f\n"
 
+//gpa histogram of -t
+#define  STATS_HDR_STRING           "%-9s %s\n"
+#define  STATS_FMT_STRING           "%.2f-%.2f %ld\n"
+
 #endif
\ No newline at end of file
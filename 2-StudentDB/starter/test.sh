@@ -192,4 +192,719 @@ setup_file() {
         echo "Failed Output:  $output"
         return 1
     }
-}
\ No newline at end of file
+}
+
+@test "Zero db before storage engine checks" {
+    run ./sdbsc -z
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "All database records removed!" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+}
+
+@test "mmap and file storage engines share the same layout" {
+    run env SDB_STORAGE=mmap ./sdbsc -a 5 mapped student 300
+    [ "$status" -eq 0 ]
+
+    run env SDB_STORAGE=file ./sdbsc -a 700 plain student 250
+    [ "$status" -eq 0 ]
+
+    run env SDB_STORAGE=file ./sdbsc -f 5
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "5 mapped student 3.00" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+
+    run env SDB_STORAGE=mmap ./sdbsc -f 700
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "700 plain student 2.50" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+}
+
+@test "mmap engine grows the file to the same size as the file engine" {
+    run env SDB_STORAGE=mmap ./sdbsc -a 1000 grow me 100
+    [ "$status" -eq 0 ]
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "64064" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+}
+
+@test "Bulk load students from stdin" {
+    run ./sdbsc -z
+    [ "$status" -eq 0 ]
+
+    run bash -c 'printf "id,first_name,last_name,gpa\n10,amy,lee,400\n12,bob,ray,310\n11,cal,fox,275\n" | ./sdbsc -b'
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "3 student(s) loaded into database, 0 rejected." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -f 11
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "11 cal fox 2.75" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+}
+
+@test "Bulk load rejects bad, out of range and duplicate rows" {
+    run bash -c 'printf "12,dup,row,300\n13,ok,row,300\n14,bad,gpa,900\nnot a row\n13,dup,again,100\n" | ./sdbsc -b'
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Bulk load line 3 has an ID or GPA out of allowable range, skipping." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    [ "${lines[1]}" = "Bulk load line 4 is not \"id,first_name,last_name,gpa\", skipping." ]
+    [ "${lines[2]}" = "Cant add student with ID=12, already exists in db." ]
+    [ "${lines[3]}" = "Cant add student with ID=13, already exists in db." ]
+    [ "${lines[4]}" = "1 student(s) loaded into database, 4 rejected." ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 4 student record(s)." ]
+}
+
+@test "Bulk load only skips a first line that is a header" {
+    run ./sdbsc -z
+    run bash -c 'printf " 1,john,doe,345\n2,jane,roe,300\n" | ./sdbsc -b'
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "2 student(s) loaded into database, 0 rejected." ]
+
+    run bash -c 'printf "3,bad\n4,amy,lee,400\n" | ./sdbsc -b'
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Bulk load line 1 is not \"id,first_name,last_name,gpa\", skipping." ]
+    [ "${lines[1]}" = "1 student(s) loaded into database, 1 rejected." ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 3 student record(s)." ]
+}
+
+@test "Sparse db scans and page release keep records and file size" {
+    run ./sdbsc -z
+    run bash -c 'printf "1,a,one,100\n2,b,two,200\n70,c,seventy,300\n99999,d,last,400\n" | ./sdbsc -b'
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -d 1
+    run ./sdbsc -d 2
+    [ "$status" -eq 0 ]
+
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "6400000" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -p
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 70 c seventy 3.00 99999 d last 4.00" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+}
+
+@test "Find students by last name with the index" {
+    run ./sdbsc -z
+    run bash -c 'printf "1,ann,smith,300\n2,bob,jones,310\n3,al,smith,320\n4,cy,smithe,330\n" | ./sdbsc -b'
+    [ "$status" -eq 0 ]
+    run ./sdbsc -a 5 zed smith 340
+    [ "$status" -eq 0 ]
+    run ./sdbsc -d 1
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -l smith
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 3 al smith 3.20 5 zed smith 3.40" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -l nobody
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "No students with last name nobody were found in database." ]
+}
+
+@test "Last name index is rebuilt when missing and emptied by -z" {
+    rm -f student.lidx
+    run ./sdbsc -l jones
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "2 bob jones 3.10" ]
+
+    run ./sdbsc -z
+    run ./sdbsc -l jones
+    [ "$status" -eq 1 ]
+}
+
+@test "Range and gpa queries use the column sidecar" {
+    run ./sdbsc -z
+    run bash -c 'printf "10,a,one,350\n20,b,two,200\n30,c,three,420\n40,d,four,360\n" | ./sdbsc -b'
+    [ "$status" -eq 0 ]
+    run ./sdbsc -d 40
+    run ./sdbsc -a 25 e five 390
+
+    run ./sdbsc -r 15 35
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 20 b two 2.00 25 e five 3.90 30 c three 4.20" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -g 350
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 10 a one 3.50 25 e five 3.90 30 c three 4.20" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    rm -f student.col
+    run ./sdbsc -g 100 300
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "20 b two 2.00" ]
+
+    run ./sdbsc -r 41 500
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "No students matched the query." ]
+
+    # inverted and negative upper bounds are empty ranges, never clamped
+    run ./sdbsc -r 30 10
+    [ "$status" -eq 1 ]
+    [ "$output" = "No students matched the query." ]
+
+    run ./sdbsc -r 5 -1
+    [ "$status" -eq 1 ]
+    [ "$output" = "No students matched the query." ]
+}
+
+@test "Write-ahead log repairs records lost from the db file" {
+    run ./sdbsc -z
+    run ./sdbsc -a 5 amy lost 300
+    [ "$status" -eq 0 ]
+
+    # simulate the db page never reaching the disk, plus a torn log append
+    dd if=/dev/zero of=student.db bs=64 seek=5 count=1 conv=notrunc status=none
+    printf 'torn' >> student.wal
+
+    run ./sdbsc -f 5
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "5 amy lost 3.00" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -l lost
+    [ "$status" -eq 0 ]
+}
+
+@test "Truncating the db also empties the write-ahead log" {
+    run ./sdbsc -z
+    [ "$status" -eq 0 ]
+    run stat --format="%s" ./student.wal
+    [ "${lines[0]}" = "0" ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains no student records." ]
+}
+
+@test "Compression can pause and resume and keeps lookups working" {
+    run ./sdbsc -z
+    printf '1,f1,l1,100\n2,f2,l2,100\n20000,f20000,l20000,100\n' | ./sdbsc -b
+    run ./sdbsc -d 2
+
+    run ./sdbsc -x 1
+    [ "$status" -eq 0 ]
+    [[ "${lines[0]}" == "Database compression paused at slot"* ]]
+
+    run ./sdbsc -f 20000
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -x
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database successfully compressed!" ]
+
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "192" ]
+
+    run ./sdbsc -f 20000
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "20000 f20000 l20000 1.00" ]
+
+    run ./sdbsc -a 7 new one 250
+    [ "$status" -eq 0 ]
+    run ./sdbsc -f 7
+    [ "$status" -eq 0 ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 3 student record(s)." ]
+}
+
+@test "Compression moves every record of a batch in one run" {
+    run ./sdbsc -z
+    # slot 1 is free and every record moves down one slot, each into the
+    # slot the record before it is leaving
+    seq 2 3000 | awk '{ print $1 ",f" $1 ",l" $1 ",300" }' | ./sdbsc -b > /dev/null
+
+    run ./sdbsc -x 1
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database successfully compressed!" ]
+
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "192000" ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 2999 student record(s)." ]
+    run ./sdbsc -f 3000
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "3000 f3000 l3000 3.00" ]
+}
+
+@test "Compression keeps records that are already in place" {
+    run ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 99 jane smith 300
+
+    run ./sdbsc -x
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -f 1
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "1 john doe 3.45" ]
+    run ./sdbsc -f 99
+    [ "$status" -eq 0 ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 2 student record(s)." ]
+}
+
+@test "Print stays in id order after compression" {
+    run ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 99 jane smith 300
+    run ./sdbsc -x
+    [ "$status" -eq 0 ]
+
+    # a new id goes to the end of a compacted file
+    ./sdbsc -a 50 bob jones 250
+    run ./sdbsc -p
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 1 john doe 3.45 50 bob jones 2.50 99 jane smith 3.00" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run bash -c "./sdbsc -p csv | cut -d, -f1 | tr '\n' ' '"
+    [ "$output" = "id 1 50 99 " ]
+}
+
+@test "Server mode serves the usual options until stopped" {
+    run ./sdbsc -z
+    ./sdbsc -S > /dev/null 2>&1 3>&- &
+    for i in $(seq 50); do [ -S student.sock ] && break; sleep 0.1; done
+    [ -S student.sock ]
+
+    run ./sdbsc -a 1 john doe 345
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 1 added to database." ]
+
+    run ./sdbsc -a 1 john doe 345
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Cant add student with ID=1, already exists in db." ]
+
+    run ./sdbsc -f 1
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "1 john doe 3.45" ]
+
+    run ./sdbsc -z
+    [ "$status" -eq 1 ]
+
+    run ./sdbsc -S stop
+    [ "$status" -eq 0 ]
+    for i in $(seq 50); do [ -e student.sock ] || break; sleep 0.1; done
+    [ ! -e student.sock ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+}
+
+@test "Concurrent adds of the same id store it exactly once" {
+    run ./sdbsc -z
+    for i in $(seq 8); do
+        ./sdbsc -a 5 writer$i same 100 > student.out$i &
+    done
+    wait
+
+    run bash -c "cat student.out* | grep -c 'Student 5 added to database.'"
+    rm -f student.out*
+    [ "${lines[0]}" = "1" ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+    run ./sdbsc -l same
+    [ "${#lines[@]}" -eq 2 ]
+}
+
+@test "Packed database is smaller, read only and converts back" {
+    run ./sdbsc -z
+    for id in $(seq 1 200); do echo "$id,first,last$((id % 7)),$((id % 500))"; done | ./sdbsc -b
+    ./sdbsc -p > student.before
+
+    run ./sdbsc -k
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database packed: 200 student(s) in 2548 bytes." ]
+
+    run bash -c "./sdbsc -p | cmp - student.before"
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -f 150
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "150 first last3 1.50" ]
+
+    run ./sdbsc -a 201 new student 100
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Database is packed and read only, unpack it with -u first." ]
+    run ./sdbsc -x
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Database is packed and read only, unpack it with -u first." ]
+
+    run ./sdbsc -u
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database unpacked: 200 student(s)." ]
+
+    run bash -c "./sdbsc -p | cmp - student.before"
+    rm -f student.before
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -a 201 new student 100
+    [ "$status" -eq 0 ]
+}
+
+@test "Hash layout stores ids beyond the direct limit in a small file" {
+    run env SDB_LAYOUT=hash ./sdbsc -z
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -a 2000000000 big id 350
+    [ "$status" -eq 0 ]
+    for id in $(seq 1 1000); do echo "$((id * 1000003)),first,last,$((id % 400))"; done | ./sdbsc -b
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1001 student record(s)." ]
+
+    # 2048 buckets plus the header, not 2000000001 slots
+    size=$(stat -c %s student.db)
+    [ "$size" -eq 131136 ]
+
+    run ./sdbsc -f 2000000000
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "2000000000 big id 3.50" ]
+
+    for id in $(seq 1 900); do ./sdbsc -d $((id * 1000003)) > /dev/null; done
+    run bash -c "printf '%s\n' -3 2000000000 | ./sdbsc -D"
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student -3 was not found in database." ]
+    [ "${lines[1]}" = "Student 2000000000 was deleted from database." ]
+    ./sdbsc -a 2000000000 big id 350
+    run ./sdbsc -f 901002703
+    [ "$status" -eq 0 ]
+    run ./sdbsc -f 900002700
+    [ "$status" -eq 1 ]
+
+    run ./sdbsc -x
+    [ "$status" -eq 0 ]
+    size=$(stat -c %s student.db)
+    [ "$size" -eq 65600 ]
+
+    run ./sdbsc -r 1000000000 2100000000
+    [ "${#lines[@]}" -eq 3 ]
+    [ "$(echo -n "${lines[2]}" | tr -s '[:space:]' ' ')" = "2000000000 big id 3.50" ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 101 student record(s)." ]
+
+    # buckets follow the hash, -p and its exports still come in id order
+    run bash -c "./sdbsc -p csv | tail -n +2 | cut -d, -f1 | sort -c -n"
+    [ "$status" -eq 0 ]
+    run bash -c "./sdbsc -p | tail -n +2 | awk '{ print \$1 }' | sort -c -n"
+    [ "$status" -eq 0 ]
+    run bash -c "./sdbsc -p | wc -l"
+    [ "$output" = "102" ]
+}
+
+@test "Print as csv and binary loads back into the same database" {
+    run ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 3 jane "smith, jr" 5
+    ./sdbsc -a 99999 bob jones 0
+    ./sdbsc -p > student.before
+
+    run ./sdbsc -p csv
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "id,first_name,last_name,gpa" ]
+    [ "${lines[1]}" = "1,john,doe,345" ]
+    [ "${lines[2]}" = '3,jane,"smith, jr",5' ]
+    [ "${lines[3]}" = "99999,bob,jones,0" ]
+
+    ./sdbsc -p bin > student.bin
+    size=$(stat -c %s student.bin)
+    [ "$size" -eq 192 ]
+
+    run ./sdbsc -z
+    run bash -c "./sdbsc -b bin < student.bin"
+    rm -f student.bin
+    [ "${lines[0]}" = "3 student(s) loaded into database, 0 rejected." ]
+
+    run bash -c "./sdbsc -p | cmp - student.before"
+    rm -f student.before
+    [ "$status" -eq 0 ]
+}
+
+@test "Csv with quoted names loads back with -b" {
+    run ./sdbsc -z
+    ./sdbsc -a 5 "a,b" 'c"d' 300
+    ./sdbsc -a 6 "x y" z 412
+    ./sdbsc -p csv > student.before
+
+    run cat student.before
+    [ "${lines[1]}" = '5,"a,b","c""d",300' ]
+    [ "${lines[2]}" = '6,"x y",z,412' ]
+
+    run ./sdbsc -z
+    run bash -c "./sdbsc -b < student.before"
+    [ "${lines[0]}" = "2 student(s) loaded into database, 0 rejected." ]
+    run bash -c "./sdbsc -p csv | cmp - student.before"
+    rm -f student.before
+    [ "$status" -eq 0 ]
+
+    # an unterminated quote rejects the line instead of eating the rest
+    run bash -c "printf '7,\"ab,c,100\n8,d,e,200\n' | ./sdbsc -b"
+    [ "${lines[0]}" = 'Bulk load line 1 is not "id,first_name,last_name,gpa", skipping.' ]
+    [ "${lines[1]}" = "1 student(s) loaded into database, 1 rejected." ]
+}
+
+@test "Snapshot is a copy of the db that can be restored" {
+    run ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 99 jane smith 300
+    ./sdbsc -p > student.before
+
+    run ./sdbsc -s student.snap
+    [ "$status" -eq 0 ]
+    [[ "${lines[0]}" == "Snapshot of 6400 bytes written to student.snap ("* ]]
+    run cmp student.db student.snap
+    [ "$status" -eq 0 ]
+    [ ! -e student.snap.map ]
+
+    # a compacted db comes with its slot map
+    run ./sdbsc -x
+    run ./sdbsc -s student.snap
+    [ "$status" -eq 0 ]
+    [ -e student.snap.map ]
+
+    # the sidecars now describe the emptied db, once restored they must not
+    # be trusted
+    run ./sdbsc -z
+    mv student.snap student.db
+    mv student.snap.map student.map
+    run bash -c "./sdbsc -p | cmp - student.before"
+    rm -f student.before
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -t
+    [ "${lines[0]}" = "Database contains 2 student record(s)." ]
+    run ./sdbsc -r 1 99
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[2]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "99 jane smith 3.00" ]
+    run ./sdbsc -l smith
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "99 jane smith 3.00" ]
+}
+
+@test "Batch find and delete ids read from stdin" {
+    run ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 5 jane smith 300
+    ./sdbsc -a 99999 bob jones 250
+
+    run bash -c "printf '5\n7\nx\n1\n' | ./sdbsc -F"
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Batch line 3 is not a student id, skipping." ]
+    normalized_output=$(echo -n "${lines[2]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "5 jane smith 3.00" ]
+    normalized_output=$(echo -n "${lines[3]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "1 john doe 3.45" ]
+    [ "${lines[4]}" = "Student 7 was not found in database." ]
+    [ "${lines[5]}" = "2 of 3 student(s) found." ]
+
+    # the serial fallback gives the same answer
+    run bash -c "printf '5\n7\n1\n' | SDB_URING=off ./sdbsc -F"
+    [ "${lines[4]}" = "2 of 3 student(s) found." ]
+
+    run bash -c "printf '5\n5\n7\n1\n' | ./sdbsc -D"
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 5 was deleted from database." ]
+    [ "${lines[1]}" = "Student 5 was not found in database." ]
+    [ "${lines[2]}" = "Student 7 was not found in database." ]
+    [ "${lines[3]}" = "Student 1 was deleted from database." ]
+
+    # ids out of range are not found, the rest of the batch still goes
+    ./sdbsc -a 6 joe black 200
+    run bash -c "printf '6\n-3\n100001\n' | ./sdbsc -D"
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 6 was deleted from database." ]
+    [ "${lines[1]}" = "Student -3 was not found in database." ]
+    [ "${lines[2]}" = "Student 100001 was not found in database." ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+    run ./sdbsc -l smith
+    [ "${lines[0]}" = "No students with last name smith were found in database." ]
+}
+
+@test "Change log streams adds and deletes from an lsn" {
+    run ./sdbsc -z
+    run ./sdbsc -e
+    lsn=$(echo "${lines[-1]}" | cut -d, -f1)
+    [ "${lines[-1]}" = "$lsn,zero,,,," ]
+
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 5 "jane,ann" smith 300
+    ./sdbsc -d 1
+
+    run ./sdbsc -e "$lsn"
+    [ "$status" -eq 0 ]
+    [ "${#lines[@]}" -eq 3 ]
+    [ "${lines[0]}" = "$((lsn + 1)),put,1,john,doe,345" ]
+    [ "${lines[1]}" = "$((lsn + 2)),put,5,\"jane,ann\",smith,300" ]
+    [ "${lines[2]}" = "$((lsn + 3)),del,1,,," ]
+
+    # resuming after the last change seen prints nothing new
+    run ./sdbsc -e "$((lsn + 3))"
+    [ "${#lines[@]}" -eq 0 ]
+}
+
+@test "Stats report count, gpa range and histogram" {
+    run ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 2 jane smith 300
+    ./sdbsc -a 3 bob jones 49
+    ./sdbsc -a 4 ann lee 500
+    ./sdbsc -a 5 tim kim 200
+    ./sdbsc -d 5
+
+    run ./sdbsc -t
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database contains 4 student record(s)." ]
+    [ "${lines[1]}" = "GPA average 2.98, lowest 0.49, highest 5.00." ]
+    [ "${lines[3]}" = "0.00-0.49 1" ]
+    [ "${lines[4]}" = "0.50-0.99 0" ]
+    [ "${lines[9]}" = "3.00-3.49 2" ]
+    [ "${lines[12]}" = "4.50-5.00 1" ]
+
+    # threads only split the work
+    run bash -c "./sdbsc -t 3 | cmp - <(./sdbsc -t)"
+    [ "$status" -eq 0 ]
+}
+
+@test "Parallel scans print and count the same as one thread" {
+    run ./sdbsc -z
+    run bash -c "seq 1 3 30000 | awk '{print \$1 \",f\" \$1 \",l\" \$1 \",\" \$1 % 501}' | ./sdbsc -b"
+    [ "${lines[0]}" = "10000 student(s) loaded into database, 0 rejected." ]
+    ./sdbsc -d 4
+
+    SDB_SCAN_THREADS=1 ./sdbsc -p > student.before
+    run bash -c "SDB_SCAN_THREADS=4 ./sdbsc -p | cmp - student.before"
+    [ "$status" -eq 0 ]
+    SDB_SCAN_THREADS=1 ./sdbsc -p csv > student.before
+    run bash -c "SDB_SCAN_THREADS=3 ./sdbsc -p csv | cmp - student.before"
+    rm -f student.before
+    [ "$status" -eq 0 ]
+
+    run env SDB_SCAN_THREADS=4 ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 9999 student record(s)." ]
+
+    # a sparse db leaves parts that are all hole, their scan finds nothing
+    run ./sdbsc -z
+    ./sdbsc -a 1 john doe 300
+    ./sdbsc -a 99999 jane smith 310
+    run env SDB_SCAN_THREADS=4 ./sdbsc -c
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database contains 2 student record(s)." ]
+    run env SDB_SCAN_THREADS=4 ./sdbsc -p
+    [ "$status" -eq 0 ]
+    [ "${#lines[@]}" -eq 3 ]
+    [ "$(echo -n "${lines[2]}" | tr -s '[:space:]' ' ')" = "99999 jane smith 3.10" ]
+
+    run ./sdbsc -z
+    run env SDB_SCAN_THREADS=4 ./sdbsc -p
+    [ "${lines[0]}" = "Database contains no student records." ]
+}
+
+@test "Hash layout id filter stays in sync with adds, deletes, -x and -z" {
+    run env SDB_LAYOUT=hash ./sdbsc -z
+    [ -f student.bloom ]
+    for id in $(seq 1 1500); do echo "$((id * 7919)),f,l,100"; done | ./sdbsc -b
+
+    run ./sdbsc -f 7918
+    [ "$status" -eq 1 ]
+    run ./sdbsc -f 11878500
+    [ "$status" -eq 0 ]
+    ./sdbsc -d 7919
+    run ./sdbsc -f 7919
+    [ "$status" -eq 1 ]
+    run ./sdbsc -a 7919 back again 200
+    [ "$status" -eq 0 ]
+
+    # a lost filter, or one of the file -x replaced, is rebuilt from the table
+    cp student.bloom student.oldbloom
+    run ./sdbsc -a 5 new id 300
+    for id in $(seq 2 1400); do echo "$((id * 7919))"; done | ./sdbsc -D
+    run ./sdbsc -x
+    [ "$status" -eq 0 ]
+    mv student.oldbloom student.bloom
+    run ./sdbsc -f 5
+    [ "$status" -eq 0 ]
+    rm student.bloom
+    run ./sdbsc -f 7919
+    [ "$status" -eq 0 ]
+    [ -f student.bloom ]
+    run ./sdbsc -f 15838
+    [ "$status" -eq 1 ]
+
+    run ./sdbsc -z
+    run ./sdbsc -f 7919
+    [ "$status" -eq 1 ]
+    run ./sdbsc -a 7919 once more 300
+    [ "$status" -eq 0 ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+
+    # a filter that lost bits of records still in the log gets them back
+    # when the log is replayed, the header still vouches for it
+    run env SDB_LAYOUT=hash ./sdbsc -z
+    run ./sdbsc -a 7919 in log 300
+    [ "$status" -eq 0 ]
+    size=$(stat -c %s student.bloom)
+    dd if=/dev/zero of=student.bloom bs=64 seek=1 count=$((size / 64 - 1)) conv=notrunc status=none
+    run ./sdbsc -f 7919
+    [ "$status" -eq 0 ]
+    run ./sdbsc -a 7919 dup id 300
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Cant add student with ID=7919, already exists in db." ]
+}
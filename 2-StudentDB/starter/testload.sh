@@ -1,6 +1,10 @@
 #! /bin/bash
-./sdbsc -a 1      john doe 3.45
-./sdbsc -a 3      jane  doe  3.90
-./sdbsc -a 63     jim   doe  2.85
-./sdbsc -a 64     janet doe  3.10
-./sdbsc -a 99999  big   dude 2.05
\ No newline at end of file
+# Loads the sample students with a single sdbsc process, see -b in usage
+./sdbsc -b <<'END'
+id,first_name,last_name,gpa
+1,john,doe,345
+3,jane,doe,390
+63,jim,doe,285
+64,janet,doe,310
+99999,big,dude,205
+END
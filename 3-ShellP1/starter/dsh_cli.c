@@ -112,6 +112,10 @@ int main()
             case ERR_TOO_MANY_COMMANDS:
                 printf(CMD_ERR_PIPE_LIMIT, CMD_MAX);
                 break;
+
+            case ERR_CMD_ARGS_BAD:
+                printf(CMD_ERR_QUOTE);
+                break;
         }
     }
 
@@ -5,23 +5,158 @@
 
 #include "dshlib.h"
 
-// Helper function to trim leading and trailing whitespace
-static char* trim(char* str) {
-    if (str == NULL) return NULL;
-    
-    // Trim leading spaces
-    while(isspace((unsigned char)*str)) str++;
-    
-    if(*str == 0) return str;  // All spaces
-    
-    // Trim trailing spaces
-    char* end = str + strlen(str) - 1;
-    while(end > str && isspace((unsigned char)*end)) end--;
-    end[1] = '\0';
-    
-    return str;
+// State of the lexer while it reads one word of a command line
+typedef struct lexer {
+    char *r;        // next character to read
+    char *start;    // start of the word being read, in place
+    char *w;        // next character of the word, in place
+    char *heap;     // the word once it outgrew its place, or NULL
+    size_t len, cap; // bytes used and allocated in heap
+} lexer_t;
+
+// Appends n bytes to the word being read, after the bytes they came from
+// were consumed.  Removing quotes and escapes only shrinks a word, so it is
+// written in place over the part of the line already read; only an
+// expansion that does not fit there moves the word to a buffer of its own.
+static int lex_put(lexer_t *lx, const char *s, size_t n) {
+    if (lx->heap == NULL) {
+        if (lx->w + n <= lx->r) {
+            memmove(lx->w, s, n);
+            lx->w += n;
+            return OK;
+        }
+        size_t have = lx->w - lx->start;
+        lx->cap = 2 * (have + n) + 1;
+        lx->heap = malloc(lx->cap);
+        if (lx->heap == NULL) return ERR_MEMORY;
+        memcpy(lx->heap, lx->start, have);
+        lx->len = have;
+    }
+    if (lx->len + n >= lx->cap) {
+        size_t cap = 2 * (lx->len + n) + 1;
+        char *grown = realloc(lx->heap, cap);
+        if (grown == NULL) return ERR_MEMORY;
+        lx->heap = grown;
+        lx->cap = cap;
+    }
+    memcpy(lx->heap + lx->len, s, n);
+    lx->len += n;
+    return OK;
+}
+
+// Expands the $NAME or ${NAME} at lx->r into the word.  A '$' that starts
+// neither is kept as it is, and an unset variable expands to nothing.
+static int lex_var(lexer_t *lx) {
+    char *name = lx->r + 1;
+    int braced = (*name == '{');
+
+    name += braced;
+    char *end = name;
+    if (isalpha((unsigned char)*name) || *name == '_') {
+        while (isalnum((unsigned char)*end) || *end == '_') end++;
+    }
+    if (end == name || (braced && *end != '}')) {
+        lx->r++;
+        return lex_put(lx, "$", 1);
+    }
+
+    // Terminate the name for getenv, the line is restored right after
+    char saved = *end;
+    *end = '\0';
+    char *value = getenv(name);
+    *end = saved;
+
+    lx->r = end + braced;
+    return value ? lex_put(lx, value, strlen(value)) : OK;
+}
+
+// Reads the word at lx->r, up to an unquoted blank or '|', removing quotes
+// and backslash escapes and expanding variables outside single quotes.
+// *word is the word and *len its length, or *word is NULL if it expanded to
+// nothing without being quoted.  If the word outgrew its place it is in
+// lx->heap, which the caller frees.
+static int lex_word(lexer_t *lx, char **word, size_t *len) {
+    char quote = '\0';
+    int quoted = 0;
+    int rc = OK;
+
+    lx->start = lx->w = lx->r;
+    lx->heap = NULL;
+    lx->len = 0;
+
+    while (*lx->r && rc == OK) {
+        char c = *lx->r;
+
+        if (quote == SQUOTE_CHAR) {
+            lx->r++;
+            if (c == SQUOTE_CHAR) quote = '\0';
+            else rc = lex_put(lx, &c, 1);
+        } else if (c == SQUOTE_CHAR || c == QUOTE_CHAR) {
+            lx->r++;
+            if (!quote) {
+                quote = c;
+                quoted = 1;
+            } else if (c == quote) {
+                quote = '\0';
+            } else {
+                rc = lex_put(lx, &c, 1);    // ' inside "
+            }
+        } else if (c == ESCAPE_CHAR) {
+            // inside double quotes only \", \\ and \$ are escapes
+            char next = lx->r[1];
+            if (next == '\0' || (quote && next != QUOTE_CHAR &&
+                                 next != ESCAPE_CHAR && next != VAR_CHAR)) {
+                lx->r++;
+                rc = lex_put(lx, &c, 1);
+            } else {
+                lx->r += 2;
+                rc = lex_put(lx, &next, 1);
+            }
+        } else if (c == VAR_CHAR) {
+            rc = lex_var(lx);
+        } else if (!quote && (c == SPACE_CHAR || c == '\t' || c == PIPE_CHAR)) {
+            break;
+        } else {
+            lx->r++;
+            rc = lex_put(lx, &c, 1);
+        }
+    }
+
+    if (rc == OK && quote) rc = ERR_CMD_ARGS_BAD;
+    if (rc != OK) {
+        free(lx->heap);
+        lx->heap = NULL;
+        return rc;
+    }
+
+    *word = lx->heap ? lx->heap : lx->start;
+    *len = lx->heap ? lx->len : (size_t)(lx->w - lx->start);
+    if (*len == 0 && !quoted) *word = NULL;
+    return OK;
+}
+
+// Adds a word to cmd: the first one is the executable, the rest are joined
+// into args with single spaces
+static int add_word(command_t *cmd, const char *word, size_t len) {
+    if (cmd->exe[0] == '\0') {
+        if (len >= EXE_MAX) return ERR_CMD_OR_ARGS_TOO_BIG;
+        memcpy(cmd->exe, word, len);
+        cmd->exe[len] = '\0';
+        return OK;
+    }
+
+    size_t used = strlen(cmd->args);
+    if (used + len + 2 >= ARG_MAX) return ERR_CMD_OR_ARGS_TOO_BIG;
+    if (used > 0) cmd->args[used++] = SPACE_CHAR;
+    memcpy(cmd->args + used, word, len);
+    cmd->args[used + len] = '\0';
+    return OK;
 }
 
+// Splits cmd_line into commands at every unquoted '|' and each command into
+// words in a single pass.  Words are unquoted in place in cmd_line, which is
+// modified, and then copied into the command list.  Empty commands are
+// skipped.
 int build_cmd_list(char *cmd_line, command_list_t *clist)
 {
     if (cmd_line == NULL || clist == NULL) {
@@ -30,68 +165,41 @@ int build_cmd_list(char *cmd_line, command_list_t *clist)
 
     // Initialize command list
     memset(clist, 0, sizeof(command_list_t));
-    
-    // Create a copy of cmd_line since strtok modifies the string
-    char cmd_line_copy[ARG_MAX];
-    strncpy(cmd_line_copy, cmd_line, ARG_MAX - 1);
-    cmd_line_copy[ARG_MAX - 1] = '\0';
-    
-    // Trim the entire command line
-    char *trimmed_cmd = trim(cmd_line_copy);
-    
-    // Check for empty command
-    if (strlen(trimmed_cmd) == 0) {
-        return WARN_NO_CMDS;
-    }
 
-    // First split by pipe
-    char *saveptr1;
-    char *pipe_token = strtok_r(trimmed_cmd, "|", &saveptr1);
-    
-    while (pipe_token != NULL) {
-        // Check if we've exceeded maximum commands
-        if (clist->num >= CMD_MAX) {
-            return ERR_TOO_MANY_COMMANDS;
+    lexer_t lx = {.r = cmd_line};
+    command_t *cmd = NULL;      // command the next word belongs to
+    int rc = OK;
+
+    while (rc == OK) {
+        while (*lx.r == SPACE_CHAR || *lx.r == '\t') lx.r++;
+        if (*lx.r == '\0') break;
+
+        // A pipe starts the next command
+        if (*lx.r == PIPE_CHAR) {
+            lx.r++;
+            cmd = NULL;
+            continue;
         }
 
-        // Trim the command string
-        char *cmd_str = trim(pipe_token);
-        
-        // Split command into executable and args
-        char *saveptr2;
-        char *token = strtok_r(cmd_str, " ", &saveptr2);
-        
-        if (token != NULL) {
-            // Check executable length
-            if (strlen(token) >= EXE_MAX) {
-                return ERR_CMD_OR_ARGS_TOO_BIG;
-            }
-            strcpy(clist->commands[clist->num].exe, token);
-            
-            // Build args string
-            char arg_buffer[ARG_MAX] = "";
-            token = strtok_r(NULL, " ", &saveptr2);
-            while (token != NULL) {
-                if (strlen(arg_buffer) + strlen(token) + 2 >= ARG_MAX) {
-                    return ERR_CMD_OR_ARGS_TOO_BIG;
-                }
-                if (strlen(arg_buffer) > 0) {
-                    strcat(arg_buffer, " ");
-                }
-                strcat(arg_buffer, token);
-                token = strtok_r(NULL, " ", &saveptr2);
-            }
-            
-            if (strlen(arg_buffer) > 0) {
-                strcpy(clist->commands[clist->num].args, arg_buffer);
+        char *word;
+        size_t len;
+        rc = lex_word(&lx, &word, &len);
+        if (rc != OK || word == NULL) continue;
+
+        if (cmd == NULL) {
+            // Check if we've exceeded maximum commands
+            if (clist->num >= CMD_MAX) {
+                rc = ERR_TOO_MANY_COMMANDS;
+            } else {
+                cmd = &clist->commands[clist->num++];
             }
-            
-            clist->num++;
         }
-        
-        // Get next piped command
-        pipe_token = strtok_r(NULL, "|", &saveptr1);
+        if (rc == OK) rc = add_word(cmd, word, len);
+        free(lx.heap);
     }
 
-    return OK;
+    if (rc == OK && clist->num == 0) {
+        return WARN_NO_CMDS;
+    }
+    return rc;
 }
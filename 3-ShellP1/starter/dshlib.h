@@ -24,6 +24,10 @@ typedef struct command_list
 #define SPACE_CHAR ' '
 #define PIPE_CHAR '|'
 #define PIPE_STRING "|"
+#define QUOTE_CHAR '"'
+#define SQUOTE_CHAR '\''
+#define ESCAPE_CHAR '\\'
+#define VAR_CHAR '$'
 
 #define SH_PROMPT "dsh> "
 #define EXIT_CMD "exit"
@@ -33,6 +37,8 @@ typedef struct command_list
 #define WARN_NO_CMDS -1
 #define ERR_TOO_MANY_COMMANDS -2
 #define ERR_CMD_OR_ARGS_TOO_BIG -3
+#define ERR_CMD_ARGS_BAD -4
+#define ERR_MEMORY -5
 
 // starter code
 #define M_NOT_IMPL "The requested operation is not implemented yet!\n"
@@ -46,5 +52,6 @@ int build_cmd_list(char *cmd_line, command_list_t *clist);
 #define CMD_OK_HEADER "PARSED COMMAND LINE - TOTAL COMMANDS %d\n"
 #define CMD_WARN_NO_CMD "warning: no commands provided\n"
 #define CMD_ERR_PIPE_LIMIT "error: piping limited to %d commands\n"
+#define CMD_ERR_QUOTE "error: unterminated quote\n"
 
 #endif
\ No newline at end of file
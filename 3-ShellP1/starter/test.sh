@@ -209,4 +209,21 @@ EOF
     # Assertions
     [ "$status" -eq 0 ]
 
-}
\ No newline at end of file
+}
+
+@test "Quotes, escapes and variables" {
+    run env DSH_VAR=value ./dsh <<'EOF'
+cmd "a  b" 'c | d' e\ f "$DSH_VAR" '$DSH_VAR' x${DSH_VAR} | cmd2 $DSH_NOPE
+cmd "unterminated
+exit
+EOF
+
+    echo "Captured stdout:"
+    echo "Output: $output"
+    echo "Exit Status: $status"
+
+    [[ "$output" == *"<1> cmd [a  b c | d e f value \$DSH_VAR xvalue]"* ]]
+    [[ "$output" == *"<2> cmd2"* ]]
+    [[ "$output" == *"error: unterminated quote"* ]]
+    [ "$status" -eq 0 ]
+}
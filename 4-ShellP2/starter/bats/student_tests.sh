@@ -90,3 +90,11 @@ EOF
     [ "$output" = "2" ]  # Should print last return code
 }
 
+@test "Quotes, escapes and variables" {
+    run env DSH_VAR=value $test_shell <<'EOF'
+printf [%s] "a  b" 'c d' e\ f "$DSH_VAR" '$DSH_VAR' $DSH_NOPE x"$DSH_NOPE"
+echo "unterminated
+EOF
+    [[ "$output" == *"[a  b][c d][e f][value][\$DSH_VAR][x]"* ]]
+    [[ "$output" == *"error: unterminated quote"* ]]
+}
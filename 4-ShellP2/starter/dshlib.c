@@ -9,49 +9,195 @@
 #include <errno.h>  // Added to fix missing `errno` issue
 #include "dshlib.h"
 
+// State of the lexer while it reads one word of a command line
+typedef struct lexer {
+    char *r;            // next character to read
+    char *start;        // start of the word being read, in place
+    char *w;            // next character of the word, in place
+    word_buf_t *heap;   // the word once it outgrew its place, or NULL
+    size_t len, cap;    // bytes used and allocated in heap->text
+} lexer_t;
+
 /**
- * Trims leading and trailing spaces from a string.
+ * Appends n bytes to the word being read, after the bytes they came from
+ * were consumed.  Removing quotes and escapes only shrinks a word, so it is
+ * written in place over the part of the line already read; only an
+ * expansion that does not fit there moves the word to a buffer of its own.
  */
-void trim_spaces(char *str) {
-    char *start = str;
-    while (*start == SPACE_CHAR) start++;  // Trim leading spaces
+static int lex_put(lexer_t *lx, const char *s, size_t n) {
+    if (!lx->heap) {
+        if (lx->w + n <= lx->r) {
+            memmove(lx->w, s, n);
+            lx->w += n;
+            return OK;
+        }
+        size_t have = lx->w - lx->start;
+        lx->cap = 2 * (have + n) + 1;
+        lx->heap = malloc(sizeof(word_buf_t) + lx->cap);
+        if (!lx->heap) return ERR_MEMORY;
+        memcpy(lx->heap->text, lx->start, have);
+        lx->len = have;
+    }
+    if (lx->len + n >= lx->cap) {
+        size_t cap = 2 * (lx->len + n) + 1;
+        word_buf_t *grown = realloc(lx->heap, sizeof(word_buf_t) + cap);
+        if (!grown) return ERR_MEMORY;
+        lx->heap = grown;
+        lx->cap = cap;
+    }
+    memcpy(lx->heap->text + lx->len, s, n);
+    lx->len += n;
+    return OK;
+}
 
-    // Move trimmed string back to the original buffer
-    memmove(str, start, strlen(start) + 1);
+/**
+ * Expands the $NAME or ${NAME} at lx->r into the word.  A '$' that starts
+ * neither is kept as it is, and an unset variable expands to nothing.
+ */
+static int lex_var(lexer_t *lx) {
+    char *name = lx->r + 1;
+    int braced = (*name == '{');
 
-    // Trim trailing spaces
-    char *end = str + strlen(str) - 1;
-    while (end > str && *end == SPACE_CHAR) {
-        *end = '\0';
-        end--;
+    name += braced;
+    char *end = name;
+    if (isalpha((unsigned char)*name) || *name == '_') {
+        while (isalnum((unsigned char)*end) || *end == '_') end++;
+    }
+    if (end == name || (braced && *end != '}')) {
+        lx->r++;
+        return lex_put(lx, "$", 1);
     }
+
+    // Terminate the name for getenv, the line is restored right after
+    char saved = *end;
+    *end = '\0';
+    char *value = getenv(name);
+    *end = saved;
+
+    lx->r = end + braced;
+    return value ? lex_put(lx, value, strlen(value)) : OK;
 }
 
 /**
- * Parses user input into `cmd_buff_t` structure.
+ * Reads the word at lx->r, up to an unquoted blank.  Single quotes keep
+ * everything up to the closing quote; double quotes keep everything but
+ * $VAR expansion and the escapes \", \\ and \$; a backslash outside quotes
+ * escapes the next character.  *word is NULL if the word expanded to
+ * nothing without being quoted.  A word that outgrew its place is put on
+ * the words of cmd_buff.
  */
-int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
-    trim_spaces(cmd_line);  // Remove leading/trailing spaces
+static int lex_word(lexer_t *lx, cmd_buff_t *cmd_buff, char **word) {
+    char quote = '\0';
+    bool quoted = false;
+    int rc = OK;
 
-    if (strlen(cmd_line) == 0) {
-        return WARN_NO_CMDS;
+    lx->start = lx->w = lx->r;
+    lx->heap = NULL;
+    lx->len = 0;
+
+    while (*lx->r && rc == OK) {
+        char c = *lx->r;
+
+        if (quote == SQUOTE_CHAR) {
+            lx->r++;
+            if (c == SQUOTE_CHAR) quote = '\0';
+            else rc = lex_put(lx, &c, 1);
+        } else if (c == SQUOTE_CHAR || c == QUOTE_CHAR) {
+            lx->r++;
+            if (!quote) {
+                quote = c;
+                quoted = true;
+            } else if (c == quote) {
+                quote = '\0';
+            } else {
+                rc = lex_put(lx, &c, 1);  // ' inside "
+            }
+        } else if (c == ESCAPE_CHAR) {
+            char next = lx->r[1];
+            if (next == '\0' || (quote && next != QUOTE_CHAR &&
+                                 next != ESCAPE_CHAR && next != VAR_CHAR)) {
+                lx->r++;
+                rc = lex_put(lx, &c, 1);  // a backslash of its own
+            } else {
+                lx->r += 2;
+                rc = lex_put(lx, &next, 1);
+            }
+        } else if (c == VAR_CHAR) {
+            rc = lex_var(lx);
+        } else if (!quote && (c == SPACE_CHAR || c == '\t')) {
+            break;
+        } else {
+            lx->r++;
+            rc = lex_put(lx, &c, 1);
+        }
     }
 
-    // Allocate memory for the command buffer
-    cmd_buff->_cmd_buffer = strdup(cmd_line);
-    if (!cmd_buff->_cmd_buffer) {
-        return ERR_MEMORY;
+    if (rc == OK && quote) {
+        printf(CMD_ERR_QUOTE);
+        rc = ERR_CMD_ARGS_BAD;
+    }
+    if (rc != OK) {
+        free(lx->heap);
+        return rc;
     }
 
+    if (lx->heap) {
+        lx->heap->text[lx->len] = '\0';
+        lx->heap->next = cmd_buff->_words;
+        cmd_buff->_words = lx->heap;
+        *word = lx->heap->text;
+        return OK;
+    }
+
+    // A word that was not shortened ends at a blank, which the caller
+    // terminates
+    if (lx->w < lx->r) *lx->w = '\0';
+    *word = (lx->w == lx->start && !quoted) ? NULL : lx->start;
+    return OK;
+}
+
+/**
+ * Frees the words of a command that outgrew the command line.
+ */
+int free_cmd_buff(cmd_buff_t *cmd_buff) {
+    while (cmd_buff->_words) {
+        word_buf_t *next = cmd_buff->_words->next;
+        free(cmd_buff->_words);
+        cmd_buff->_words = next;
+    }
     cmd_buff->argc = 0;
-    char *token = strtok(cmd_buff->_cmd_buffer, " ");
-    while (token && cmd_buff->argc < CMD_ARGV_MAX - 1) {
-        cmd_buff->argv[cmd_buff->argc++] = token;
-        token = strtok(NULL, " ");
+    return OK;
+}
+
+/**
+ * Parses user input into `cmd_buff_t` structure.  The line is split into
+ * words in place, so argv points into cmd_line.
+ */
+int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
+    lexer_t lx = {.r = cmd_line};
+    int rc = OK;
+
+    cmd_buff->argc = 0;
+    cmd_buff->_cmd_buffer = NULL;
+    cmd_buff->_words = NULL;
+
+    while (rc == OK) {
+        while (*lx.r == SPACE_CHAR || *lx.r == '\t') *lx.r++ = '\0';
+        if (*lx.r == '\0') break;
+
+        char *word;
+        rc = lex_word(&lx, cmd_buff, &word);
+        if (rc == OK && word && cmd_buff->argc < CMD_ARGV_MAX - 1) {
+            cmd_buff->argv[cmd_buff->argc++] = word;
+        }
     }
     cmd_buff->argv[cmd_buff->argc] = NULL;  // Null-terminate argument list
 
-    return OK;
+    if (rc != OK) {
+        free_cmd_buff(cmd_buff);
+        return rc;
+    }
+    return cmd_buff->argc == 0 ? WARN_NO_CMDS : OK;
 }
 
 /**
@@ -148,6 +294,8 @@ int exec_local_cmd_loop() {
         if (parse_result == WARN_NO_CMDS) {
             printf(CMD_WARN_NO_CMD);
             continue;
+        } else if (parse_result != OK) {
+            continue;
         }
 
         if (exec_built_in_cmd(&cmd_buff) == BI_NOT_BI) {
@@ -157,7 +305,7 @@ int exec_local_cmd_loop() {
             }
         }
 
-        free(cmd_buff._cmd_buffer);
+        free_cmd_buff(&cmd_buff);
     }
 
     return OK;
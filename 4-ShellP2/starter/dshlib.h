@@ -10,11 +10,20 @@
 // Longest command that can be read from the shell
 #define SH_CMD_MAX EXE_MAX + ARG_MAX
 
+// A word that $VAR expansion made longer than its place in the command
+// line, kept on the words of its command until the command is freed
+typedef struct word_buf
+{
+    struct word_buf *next;
+    char text[];
+} word_buf_t;
+
 typedef struct cmd_buff
 {
     int  argc;
     char *argv[CMD_ARGV_MAX];
     char *_cmd_buffer;
+    word_buf_t *_words;
 } cmd_buff_t;
 
 /* WIP - Move to next assignment 
@@ -32,6 +41,10 @@ typedef struct command{
 #define SPACE_CHAR  ' '
 #define PIPE_CHAR   '|'
 #define PIPE_STRING "|"
+#define QUOTE_CHAR  '"'
+#define SQUOTE_CHAR '\''
+#define ESCAPE_CHAR '\\'
+#define VAR_CHAR    '$'
 
 #define SH_PROMPT "dsh2> "
 #define EXIT_CMD "exit"
@@ -75,6 +88,7 @@ int exec_cmd(cmd_buff_t *cmd);
 #define CMD_OK_HEADER       "PARSED COMMAND LINE - TOTAL COMMANDS %d\n"
 #define CMD_WARN_NO_CMD     "warning: no commands provided\n"
 #define CMD_ERR_PIPE_LIMIT  "error: piping limited to %d commands\n"
+#define CMD_ERR_QUOTE       "error: unterminated quote\n"
 
 void print_dragon();  // Add this line
 
@@ -72,6 +72,117 @@ teardown() {
   [[ "$output" == *"nonexistentcommand"* ]]
 }
 
+@test "Local: operators need no surrounding blanks" {
+  OUTPUT_FILE="${TEST_TEMP_DIR}/tight.txt"
+  run bash -c 'echo -e "echo one two>'"$OUTPUT_FILE"'\ncat<'"$OUTPUT_FILE"'|wc -w\necho three>>'"$OUTPUT_FILE"'" | ./dsh'
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"2"* ]]
+  [ "$(cat "$OUTPUT_FILE")" = "$(printf 'one two\nthree')" ]
+}
+
+@test "Local: empty pipeline stages are skipped" {
+  run bash -c 'echo "| echo skipped || cat |" | ./dsh'
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"skipped"* ]]
+}
+
+@test "Local: redirection without a file is an error" {
+  run bash -c 'echo -e "echo hi >\necho hi > | cat\n< '"$TEST_FILE"'" | ./dsh'
+  [ "$status" -eq 0 ]
+  [ "$(echo "$output" | grep -c "redirection syntax error")" -eq 3 ]
+}
+
+@test "Local: a stage that cannot start does not stall the pipeline" {
+  run bash -c 'echo -e "cat < /nonexistent/in | wc -l\nnosuchcmd | wc -l\necho hi | nosuchcmd\necho done" | ./dsh'
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"open: No such file or directory"* ]]
+  [[ "$output" == *"dsh: nosuchcmd: command not found"* ]]
+  [ "$(echo "$output" | grep -c "^0$")" -eq 2 ]
+  [[ "$output" == *"done"* ]]
+}
+
+@test "Local: pipelines and argument lists have no fixed limit" {
+  # Many more stages than CMD_MAX (8) and arguments than CMD_ARGV_MAX (9)
+  LONG_PIPE="echo test"
+  for i in $(seq 40); do LONG_PIPE="$LONG_PIPE | cat"; done
+  LONG_ARGS="echo"
+  for i in $(seq 300); do LONG_ARGS="$LONG_ARGS arg$i"; done
+  run bash -c 'printf "%s\n" "'"$LONG_PIPE"' | tr a-z A-Z" "'"$LONG_ARGS"' | wc -w" "'"$LONG_ARGS"''"${LONG_PIPE#echo test}"' | wc -w" | ./dsh'
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"TEST"* ]]
+  [ "$(echo "$output" | grep -c "300$")" -eq 2 ]
+  [[ "$output" != *"error"* ]]
+}
+
+@test "Builtins: pipelines of builtins start no process" {
+  # With nothing on PATH only builtin stages can run
+  run bash -c 'echo -e "dragon | wc -l\necho one two | cat | wc -w\ncat '"$TEST_FILE"' | head -n 1\nls | cat" | PATH=/nonexistent ./dsh'
+  [ "$status" -eq 0 ]
+  [ "$(echo "$output" | grep -c "^dsh3> 39$")" -eq 1 ]
+  [[ "$output" == *"dsh3> 2"* ]]
+  [[ "$output" == *"This is a test file content"* ]]
+  [[ "$output" == *"dsh: ls: command not found"* ]]
+}
+
+@test "Builtins: echo, cat, wc and head match coreutils" {
+  cat > "$TEST_TEMP_DIR/lines" <<EOF
+echo -n one two | wc -c
+cat dshlib.h dragon.c | wc
+wc -l dshlib.h dragon.c
+wc -lw dshlib.h
+wc < dshlib.h
+head -3 dshlib.h - < rshlib.h
+head -n 2 dshlib.h | cat - rshlib.h | head -n5
+cat -n rshlib.h | head -c 40 | wc -c
+head -n -2 dshlib.h | wc -l
+head -n 2 -n 1 dshlib.h
+head -n 5 -3 dshlib.h
+echo -nn hi | wc -c
+echo -n -n hi | wc -c
+cat /nonexistent | wc -l
+EOF
+  bash < "$TEST_TEMP_DIR/lines" > "$TEST_TEMP_DIR/expected" 2>&1
+  ./dsh < "$TEST_TEMP_DIR/lines" 2>&1 | sed -e 's/^\(dsh3> \)*//' -e '/^local mode$/d' -e '/^cmd loop returned/d' > "$TEST_TEMP_DIR/actual"
+  run diff <(grep -v '^$' "$TEST_TEMP_DIR/expected") <(grep -v '^$' "$TEST_TEMP_DIR/actual")
+  [ "$status" -eq 0 ]
+}
+
+@test "Lexer: quotes keep blanks and operators in one argument" {
+  run ./dsh <<'EOF'
+printf [%s] 'a | b' "c  > d" e\ f
+echo 'oops
+EOF
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"[a | b][c  > d][e f]"* ]]
+  [[ "$output" == *"error: unterminated quote"* ]]
+  [[ "$output" != *"Error parsing command"* ]]
+}
+
+@test "Lexer: quoting, escapes and expansion match bash on random lines" {
+  export FUZZ_V=val FUZZ_LONG=$(printf 'L%.0s' $(seq 1 200))
+  awk -v seed=4242 'BEGIN {
+    srand(seed)
+    n = split("ab@@x1@@-f@@\"a b\"@@\"p|q\"@@\"<r>\"@@\"$FUZZ_V\"@@\"${FUZZ_V}s\"@@\"e\\\"f\"@@\"g\\\\h\"@@\"\\$FUZZ_V\"@@\"i\\j\"@@\"its\x27\"@@\"\"@@\x27a b\x27@@\x27$FUZZ_V\x27@@\x27x\\y\x27@@\x27\"q\"\x27@@\x27\x27@@\\ @@\\|@@\\\"@@\\\x27@@\\$FUZZ_V@@\\\\@@$FUZZ_V@@${FUZZ_V}@@$FUZZ_NOPE@@$FUZZ_LONG@@\"$FUZZ_LONG$FUZZ_LONG\"", frag, "@@")
+    for (l = 0; l < 300; l++) {
+      line = "printf [%s]\\\\n"
+      words = 1 + int(rand() * 6)
+      for (i = 0; i < words; i++) {
+        word = ""
+        parts = 1 + int(rand() * 3)
+        for (j = 0; j < parts; j++) word = word frag[1 + int(rand() * n)]
+        line = line " " word
+      }
+      print line
+    }
+  }' > "$TEST_TEMP_DIR/lines"
+
+  bash < "$TEST_TEMP_DIR/lines" > "$TEST_TEMP_DIR/expected"
+  ./dsh < "$TEST_TEMP_DIR/lines" | sed -e 's/^\(dsh3> \)*//' -e '/^local mode$/d' -e '/^cmd loop returned/d' -e '/^$/d' > "$TEST_TEMP_DIR/actual"
+  run diff "$TEST_TEMP_DIR/expected" "$TEST_TEMP_DIR/actual"
+  [ "$status" -eq 0 ]
+  [ "$(wc -l < "$TEST_TEMP_DIR/expected")" -gt 300 ]
+}
+
 # ---- Remote Client-Server Tests ----
 
 @test "Remote: basic command execution" {
@@ -96,6 +207,13 @@ teardown() {
   [[ "$output" == *".c"* ]]
 }
 
+@test "Remote: parse errors reach the client" {
+  run bash -c 'echo "echo '"'"'oops" | ./dsh -c -p 8888'
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"error: unterminated quote"* ]]
+  [[ "$output" != *"command execution error"* ]]
+}
+
 @test "Remote: built-in cd command" {
   run bash -c 'echo -e "cd '"$TEST_TEMP_DIR"'\npwd\nexit" | ./dsh -c -p 8888'
   [ "$status" -eq 0 ]
@@ -121,16 +239,6 @@ teardown() {
   [[ "$output" == *"server_restarted"* ]]
 }
 
-# ---- Error Handling Tests ----
-
-@test "Error: too many piped commands" {
-  # Create a command with more pipes than CMD_MAX (8)
-  LONG_PIPE="echo test | cat | grep test | cat | grep test | cat | grep test | cat | grep test | cat"
-  run bash -c 'echo "'"$LONG_PIPE"'" | ./dsh'
-  [ "$status" -eq 0 ]
-  [[ "$output" == *"error: piping limited"* ]]
-}
-
 @test "Extra Credit: input redirection" {
   run bash -c 'echo "cat < '"$TEST_FILE"'" | ./dsh'
   [ "$status" -eq 0 ]
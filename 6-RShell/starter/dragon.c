@@ -374,12 +374,16 @@ const rle_pair_t DREXEL_DRAGON_RLE[] = {
     {' ', 0}  
 };
 
-extern void print_dragon() {
+extern void fprint_dragon(FILE *out) {
     const rle_pair_t *ptr = DREXEL_DRAGON_RLE;
     while (ptr->count != 0) {  
         for (int i = 0; i < ptr->count; i++) {
-            putchar(ptr->ch);  
+            putc(ptr->ch, out);  
         }
         ptr++; 
     }
 }
+
+extern void print_dragon() {
+    fprint_dragon(stdout);
+}
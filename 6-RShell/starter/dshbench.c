@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "dshlib.h"
+
+// Launch latency benchmark for pipelines.  It links against dshlib.c and
+// runs the same command line through spawn_pipeline, the launcher used by
+// dsh and the rsh server, and through a fork/execvp launcher like the one
+// it replaced, first with a small heap and then with heap_mb MiB of touched
+// heap and a few idle threads, which is what a long running threaded server
+// looks like.  Results are printed one per line as key=value pairs.
+
+#define BENCH_THREADS 8
+
+static int park_fd[2];  // the idle threads block reading this pipe
+
+// body of the idle threads, they only hold a stack and a thread slot
+static void *idle_thread(void *arg) {
+    char c;
+    (void)arg;
+    while (read(park_fd[0], &c, 1) == -1) {}
+    return NULL;
+}
+
+/*
+ * now_sec - Monotonic clock in seconds.
+ */
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * fork_pipeline - Runs clist the way execute_pipeline did before it used
+ *                 posix_spawn: fork, dup2 the pipes in the child, execvp.
+ *                 Redirections are left out, the bench does not use them,
+ *                 and like the old launcher it takes at most CMD_MAX stages.
+ */
+static int fork_pipeline(command_list_t *clist) {
+    int n_cmds = clist->num;
+    int pipes[CMD_MAX-1][2];
+    pid_t pids[CMD_MAX];
+    int status;
+
+    if (n_cmds > CMD_MAX) return ERR_EXEC_CMD;
+
+    for (int i = 0; i < n_cmds - 1; i++) {
+        if (pipe(pipes[i]) == -1) return ERR_EXEC_CMD;
+    }
+    for (int i = 0; i < n_cmds; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) return ERR_EXEC_CMD;
+        if (pids[i] == 0) {
+            if (i > 0) dup2(pipes[i-1][0], STDIN_FILENO);
+            if (i < n_cmds - 1) dup2(pipes[i][1], STDOUT_FILENO);
+            for (int j = 0; j < n_cmds - 1; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
+            _exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < n_cmds - 1; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    for (int i = 0; i < n_cmds; i++) {
+        waitpid(pids[i], &status, 0);
+    }
+    return OK;
+}
+
+/*
+ * bench_launch - Runs clist iters times with both launchers and reports the
+ *                mean time per pipeline in microseconds.
+ */
+static int bench_launch(command_list_t *clist, const char *line, int iters, long heap_mb) {
+    double start = now_sec();
+    for (int i = 0; i < iters; i++) {
+        if (fork_pipeline(clist) != OK) return -1;
+    }
+    double fork_us = (now_sec() - start) * 1e6 / iters;
+
+    start = now_sec();
+    for (int i = 0; i < iters; i++) {
+        if (spawn_pipeline(clist, -1, -1, "dshbench") != OK) return -1;
+    }
+    double spawn_us = (now_sec() - start) * 1e6 / iters;
+
+    printf("bench=launch heap_mb=%ld cmds=%d iters=%d fork_us=%.1f spawn_us=%.1f speedup=%.2f line=\"%s\"\n",
+           heap_mb, clist->num, iters, fork_us, spawn_us, fork_us / spawn_us, line);
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    long heap_mb = argc > 1 ? atol(argv[1]) : 1024;
+    int iters = argc > 2 ? atoi(argv[2]) : 200;
+    const char *lines[] = {argc > 3 ? argv[3] : "true", "true | true | true"};
+    int nlines = argc > 3 ? 1 : 2;
+    pthread_t tid;
+
+    if (heap_mb < 0 || iters <= 0) {
+        fprintf(stderr, "usage: %s [heap_mb] [iters] [command line]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // small process first, then the same with a large heap and threads
+    for (int phase = 0; phase < 2; phase++) {
+        long mb = phase == 0 ? 0 : heap_mb;
+        if (phase == 1) {
+            char *heap = malloc(heap_mb << 20);
+            if (heap == NULL || pipe(park_fd) == -1) {
+                fprintf(stderr, "dshbench: cannot allocate %ld MiB\n", heap_mb);
+                exit(EXIT_FAILURE);
+            }
+            memset(heap, 1, heap_mb << 20);
+            for (int t = 0; t < BENCH_THREADS; t++) {
+                if (pthread_create(&tid, NULL, idle_thread, NULL) == 0) pthread_detach(tid);
+            }
+        }
+        for (int l = 0; l < nlines; l++) {
+            char line[SH_CMD_MAX];
+            command_list_t clist;
+
+            snprintf(line, sizeof(line), "%s", lines[l]);
+            if (build_cmd_list(line, &clist) != OK) {
+                fprintf(stderr, "dshbench: cannot parse \"%s\"\n", lines[l]);
+                exit(EXIT_FAILURE);
+            }
+            if (bench_launch(&clist, lines[l], iters, mb) != 0) {
+                fprintf(stderr, "dshbench: launching \"%s\" failed\n", lines[l]);
+                exit(EXIT_FAILURE);
+            }
+            free_cmd_list(&clist);
+        }
+    }
+    exit(EXIT_SUCCESS);
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -5,10 +6,15 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>  
+#include <spawn.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "dshlib.h"
 #include <errno.h>
 
 extern void print_dragon(void);
+extern void fprint_dragon(FILE *out);
 
 /*
  * Allocates memory for a command buffer and initializes its fields.
@@ -16,8 +22,12 @@ extern void print_dragon(void);
 int alloc_cmd_buff(cmd_buff_t *cmd_buff) {
     cmd_buff->argc = 0;
     cmd_buff->_cmd_buffer = NULL;
+    cmd_buff->_words = NULL;
+    cmd_buff->_arena.blocks = NULL;
     
     // Initialize argument list
+    cmd_buff->argv = cmd_buff->_argv;
+    cmd_buff->_argv_cap = CMD_ARGV_MAX;
     for (int i = 0; i < CMD_ARGV_MAX; i++) {
         cmd_buff->argv[i] = NULL;
     }
@@ -40,10 +50,23 @@ int free_cmd_buff(cmd_buff_t *cmd_buff) {
         cmd_buff->_cmd_buffer = NULL;
     }
     
+    // Words that outgrew the command line
+    while (cmd_buff->_words) {
+        word_buf_t *next = cmd_buff->_words->next;
+        free(cmd_buff->_words);
+        cmd_buff->_words = next;
+    }
+    
     for (int i = 0; i < cmd_buff->argc; i++) {
         cmd_buff->argv[i] = NULL;
     }
     
+    // An argv that outgrew _argv, when the command was parsed on its own
+    arena_free(&cmd_buff->_arena);
+    cmd_buff->argv = cmd_buff->_argv;
+    cmd_buff->_argv_cap = CMD_ARGV_MAX;
+    cmd_buff->_argv[0] = NULL;
+    
     cmd_buff->argc = 0;
     return OK;
 }
@@ -57,7 +80,7 @@ int clear_cmd_buff(cmd_buff_t *cmd_buff) {
         cmd_buff->_cmd_buffer[0] = '\0';
     }
     
-    for (int i = 0; i < CMD_ARGV_MAX; i++) {
+    for (int i = 0; i < cmd_buff->_argv_cap; i++) {
         cmd_buff->argv[i] = NULL;
     }
     
@@ -65,124 +88,315 @@ int clear_cmd_buff(cmd_buff_t *cmd_buff) {
 }
 
 /*
- * Parses a command line into a command buffer, handling arguments and redirections.
+ * Returns size bytes from arena, aligned for any type, or NULL if out of
+ * memory.  A block that is too full is left as it is and a new one twice
+ * its size is started.
  */
-int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
-    size_t cmd_len = strlen(cmd_line);
+void *arena_alloc(arena_t *arena, size_t size) {
+    arena_block_t *b = arena->blocks;
     
-    // Reset redirection settings
-    cmd_buff->in_redir_type = REDIR_NONE;
-    cmd_buff->in_redir_file = NULL;
-    cmd_buff->out_redir_type = REDIR_NONE;
-    cmd_buff->out_redir_file = NULL;
+    size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+    if (!b || b->cap - b->used < size) {
+        size_t cap = b ? 2 * b->cap : ARENA_BLOCK_MIN;
+        if (cap < size) {
+            cap = size;
+        }
+        b = malloc(sizeof(arena_block_t) + cap);
+        if (!b) {
+            return NULL;
+        }
+        b->next = arena->blocks;
+        b->used = 0;
+        b->cap = cap;
+        arena->blocks = b;
+    }
     
-    // Allocate memory for command storage
-    cmd_buff->_cmd_buffer = (char *)malloc(cmd_len + 1);
-    if (!cmd_buff->_cmd_buffer) {
-        return ERR_MEMORY;
+    void *p = (char *)b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+/*
+ * Frees everything allocated from arena.
+ */
+void arena_free(arena_t *arena) {
+    while (arena->blocks) {
+        arena_block_t *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+// State of the lexer while it reads one word of a command line
+typedef struct lexer {
+    char *r;            // next character to read
+    char *start;        // start of the word being read, in place
+    char *w;            // next character of the word, in place
+    word_buf_t *heap;   // the word once it outgrew its place, or NULL
+    size_t len, cap;    // bytes used and allocated in heap->text
+} lexer_t;
+
+/*
+ * Appends n bytes to the word being read, after the bytes they came from
+ * were consumed.  Removing quotes and escapes only shrinks a word, so it is
+ * written in place over the part of the line already read; only an
+ * expansion that does not fit there moves the word to a buffer of its own.
+ */
+static int lex_put(lexer_t *lx, const char *s, size_t n) {
+    if (!lx->heap) {
+        if (lx->w + n <= lx->r) {
+            memmove(lx->w, s, n);
+            lx->w += n;
+            return OK;
+        }
+        size_t have = lx->w - lx->start;
+        lx->cap = 2 * (have + n) + 1;
+        lx->heap = malloc(sizeof(word_buf_t) + lx->cap);
+        if (!lx->heap) {
+            return ERR_MEMORY;
+        }
+        memcpy(lx->heap->text, lx->start, have);
+        lx->len = have;
+    }
+    if (lx->len + n >= lx->cap) {
+        size_t cap = 2 * (lx->len + n) + 1;
+        word_buf_t *grown = realloc(lx->heap, sizeof(word_buf_t) + cap);
+        if (!grown) {
+            return ERR_MEMORY;
+        }
+        lx->heap = grown;
+        lx->cap = cap;
     }
+    memcpy(lx->heap->text + lx->len, s, n);
+    lx->len += n;
+    return OK;
+}
+
+/*
+ * Expands the $NAME or ${NAME} at lx->r into the word.  A '$' that starts
+ * neither is kept as it is, and an unset variable expands to nothing.  The
+ * value stays part of the word, it is not split on blanks.
+ */
+static int lex_var(lexer_t *lx) {
+    char *name = lx->r + 1;
+    int braced = (*name == '{');
     
-    // Copy command to buffer
-    strcpy(cmd_buff->_cmd_buffer, cmd_line);
+    name += braced;
+    if (!isalpha((unsigned char)*name) && *name != '_') {
+        lx->r++;
+        return lex_put(lx, "$", 1);
+    }
     
-    // Detect redirection characters (<, >, >>) in the command
-    char *in_redir = strchr(cmd_buff->_cmd_buffer, REDIR_IN_CHAR);
-    char *out_redir = strchr(cmd_buff->_cmd_buffer, REDIR_OUT_CHAR);
-    char *append_redir = strstr(cmd_buff->_cmd_buffer, ">>");
+    char *end = name;
+    while (isalnum((unsigned char)*end) || *end == '_') {
+        end++;
+    }
+    if (braced && *end != '}') {
+        lx->r++;
+        return lex_put(lx, "$", 1);
+    }
+    
+    // Terminate the name for getenv, the line is restored right after
+    char saved = *end;
+    *end = '\0';
+    char *value = getenv(name);
+    *end = saved;
+    
+    lx->r = end + braced;
+    return value ? lex_put(lx, value, strlen(value)) : OK;
+}
 
-    // Handle output append redirection (>>)
-    if (append_redir) {
-        *append_redir = '\0';  // Terminate command at '>>'
-        append_redir += 2;     // Move past '>>'
-        
-        // Skip leading whitespace in filename
-        while (*append_redir && isspace(*append_redir)) {
-            append_redir++;
-        }
+/*
+ * Reads the word at lx->r, up to an unquoted blank, '|', '<' or '>'.
+ * Single quotes keep everything up to the closing quote; double quotes
+ * keep everything but $VAR expansion and the escapes \", \\ and \$; a
+ * backslash outside quotes escapes the next character.  The word is
+ * written in place (see lex_put) and *word points at it, or is NULL if the
+ * word expanded to nothing without being quoted.  A word that outgrew its
+ * place is put on the words of cmd_buff.  Returns ERR_CMD_QUOTE, without
+ * printing anything, if a quote is never closed.
+ */
+static int lex_word(lexer_t *lx, cmd_buff_t *cmd_buff, char **word) {
+    char quote = '\0';
+    int quoted = 0;
+    int rc = OK;
+    
+    lx->start = lx->w = lx->r;
+    lx->heap = NULL;
+    lx->len = 0;
+    
+    while (*lx->r && rc == OK) {
+        char c = *lx->r;
         
-        if (*append_redir) {
-            cmd_buff->out_redir_type = REDIR_APPEND;
-            cmd_buff->out_redir_file = append_redir;
-            
-            // Remove trailing spaces from filename
-            char *end = append_redir + strlen(append_redir) - 1;
-            while (end > append_redir && isspace(*end)) {
-                *end = '\0';
-                end--;
+        if (quote == SQUOTE_CHAR) {
+            lx->r++;
+            if (c == SQUOTE_CHAR) {
+                quote = '\0';
+            } else {
+                rc = lex_put(lx, &c, 1);
+            }
+        } else if (c == SQUOTE_CHAR || c == QUOTE_CHAR) {
+            lx->r++;
+            if (!quote) {
+                quote = c;
+                quoted = 1;
+            } else if (c == quote) {
+                quote = '\0';
+            } else {
+                rc = lex_put(lx, &c, 1);    // ' inside "
             }
+        } else if (c == ESCAPE_CHAR) {
+            char next = lx->r[1];
+            if (next == '\0' || (quote && next != QUOTE_CHAR &&
+                                 next != ESCAPE_CHAR && next != VAR_CHAR)) {
+                lx->r++;
+                rc = lex_put(lx, &c, 1);    // a backslash of its own
+            } else {
+                lx->r += 2;
+                rc = lex_put(lx, &next, 1);
+            }
+        } else if (c == VAR_CHAR) {
+            rc = lex_var(lx);
+        } else if (!quote && (c == SPACE_CHAR || c == '\t' || c == PIPE_CHAR ||
+                              c == REDIR_IN_CHAR || c == REDIR_OUT_CHAR)) {
+            break;
         } else {
-            printf(CMD_ERR_REDIR);
-            return ERR_CMD_ARGS_BAD;
+            lx->r++;
+            rc = lex_put(lx, &c, 1);
         }
-        
-        out_redir = NULL; // Prevent duplicate handling
     }
+    
+    if (rc == OK && quote) {
+        rc = ERR_CMD_QUOTE;
+    }
+    if (rc != OK) {
+        free(lx->heap);
+        return rc;
+    }
+    
+    if (lx->heap) {
+        lx->heap->text[lx->len] = '\0';
+        lx->heap->next = cmd_buff->_words;
+        cmd_buff->_words = lx->heap;
+        *word = lx->heap->text;
+        return OK;
+    }
+    
+    // A word that was not shortened ends at a delimiter, which is
+    // terminated when it is read
+    if (lx->w < lx->r) {
+        *lx->w = '\0';
+    }
+    *word = (lx->w == lx->start && !quoted) ? NULL : lx->start;
+    return OK;
+}
 
-    // Handle standard output redirection (>)
-    if (out_redir && !append_redir) {
-        *out_redir = '\0';  // Terminate command at '>'
-        out_redir++;        // Move past '>'
-        
-        // Skip leading spaces in filename
-        while (*out_redir && isspace(*out_redir)) {
-            out_redir++;
+/*
+ * Scans one command of a pipeline in a single pass, from *line up to the
+ * next unquoted '|' or the end of the line.  Words are read with lex_word,
+ * in place, so argv and the redirection files point into the line, which
+ * must outlive the command.  Blanks and the '|', '<' and '>' operators end
+ * words and are terminated when they are read, and the word after a
+ * redirection is its file.  argv starts in the command itself and moves to
+ * arena when it fills up.  On return *line is past the '|'.
+ */
+static int scan_cmd(char **line, cmd_buff_t *cmd_buff, arena_t *arena) {
+    lexer_t lx = {.r = *line};
+    char **redir_file = NULL;   // redirection still waiting for its file
+    int rc = OK;
+    
+    cmd_buff->argc = 0;
+    cmd_buff->argv = cmd_buff->_argv;
+    cmd_buff->_argv_cap = CMD_ARGV_MAX;
+    cmd_buff->_arena.blocks = NULL;
+    cmd_buff->_cmd_buffer = NULL;   // nothing to free, argv points into the line
+    cmd_buff->_words = NULL;
+    cmd_buff->in_redir_type = REDIR_NONE;
+    cmd_buff->in_redir_file = NULL;
+    cmd_buff->out_redir_type = REDIR_NONE;
+    cmd_buff->out_redir_file = NULL;
+    
+    while (rc == OK) {
+        while (*lx.r == SPACE_CHAR || *lx.r == '\t') {
+            *lx.r++ = '\0';
+        }
+        char c = *lx.r;
+        if (c == '\0' || c == PIPE_CHAR) {
+            break;
         }
         
-        if (*out_redir) {
-            cmd_buff->out_redir_type = REDIR_OUT;
-            cmd_buff->out_redir_file = out_redir;
-            
-            // Remove trailing spaces from filename
-            char *end = out_redir + strlen(out_redir) - 1;
-            while (end > out_redir && isspace(*end)) {
-                *end = '\0';
-                end--;
+        // Redirection operators: <, > and >>
+        if (c == REDIR_IN_CHAR || c == REDIR_OUT_CHAR) {
+            if (redir_file) {
+                break;      // operator where a file name should be
             }
-        } else {
-            printf(CMD_ERR_REDIR);
-            return ERR_CMD_ARGS_BAD;
+            *lx.r++ = '\0';
+            if (c == REDIR_IN_CHAR) {
+                cmd_buff->in_redir_type = REDIR_IN;
+                redir_file = &cmd_buff->in_redir_file;
+            } else {
+                cmd_buff->out_redir_type = REDIR_OUT;
+                if (*lx.r == REDIR_OUT_CHAR) {
+                    cmd_buff->out_redir_type = REDIR_APPEND;
+                    *lx.r++ = '\0';
+                }
+                redir_file = &cmd_buff->out_redir_file;
+            }
+            continue;
         }
-    }
-
-    // Handle input redirection (<)
-    if (in_redir) {
-        *in_redir = '\0';  // Terminate command at '<'
-        in_redir++;        // Move past '<'
         
-        // Skip leading spaces in filename
-        while (*in_redir && isspace(*in_redir)) {
-            in_redir++;
+        // A word, either the file of the last redirection or an argument
+        char *word;
+        rc = lex_word(&lx, cmd_buff, &word);
+        if (rc != OK || !word) {
+            continue;
         }
-        
-        if (*in_redir) {
-            cmd_buff->in_redir_type = REDIR_IN;
-            cmd_buff->in_redir_file = in_redir;
-            
-            // Remove trailing spaces from filename
-            char *end = in_redir + strlen(in_redir) - 1;
-            while (end > in_redir && isspace(*end)) {
-                *end = '\0';
-                end--;
+        if (redir_file) {
+            *redir_file = word;
+            redir_file = NULL;
+            continue;
+        }
+        if (cmd_buff->argc == cmd_buff->_argv_cap - 1) {
+            char **grown = arena_alloc(arena, 2 * cmd_buff->_argv_cap * sizeof(char *));
+            if (!grown) {
+                rc = ERR_MEMORY;
+                continue;
             }
-        } else {
-            printf(CMD_ERR_REDIR);
-            return ERR_CMD_ARGS_BAD;
+            memcpy(grown, cmd_buff->argv, cmd_buff->argc * sizeof(char *));
+            cmd_buff->argv = grown;
+            cmd_buff->_argv_cap *= 2;
         }
+        cmd_buff->argv[cmd_buff->argc++] = word;
     }
-
-    // Tokenize the command line into arguments
-    char *token = strtok(cmd_buff->_cmd_buffer, " \t");
-    while (token != NULL && cmd_buff->argc < CMD_ARGV_MAX - 1) {
-        cmd_buff->argv[cmd_buff->argc++] = token;
-        token = strtok(NULL, " \t");
-    }
-
+    
     // Ensure null termination
     cmd_buff->argv[cmd_buff->argc] = NULL;
+    if (rc != OK) {
+        return rc;
+    }
+    
+    if (*lx.r == PIPE_CHAR && !redir_file) {
+        *lx.r++ = '\0';
+    }
+    *line = lx.r;
     
+    // A redirection needs a file and a command to apply to
+    if (redir_file || (cmd_buff->argc == 0 &&
+        (cmd_buff->in_redir_type != REDIR_NONE || cmd_buff->out_redir_type != REDIR_NONE))) {
+        printf(CMD_ERR_REDIR);
+        return ERR_CMD_ARGS_BAD;
+    }
     return OK;
 }
 
+/*
+ * Parses a command line into a command buffer, handling arguments and
+ * redirections.  The line is tokenized in place, see scan_cmd.
+ */
+int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
+    return scan_cmd(&cmd_line, cmd_buff, &cmd_buff->_arena);
+}
+
 /*
  * Frees memory allocated for a command buffer.
  */
@@ -251,60 +465,65 @@ Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd) {
 }
 
 /*
- * Build a list of commands from a command line, handling pipes
+ * Doubles the room for commands in clist, moving them to its arena.  The
+ * old array stays in the arena until the line is freed.
  */
-int build_cmd_list(char *cmd_line, command_list_t *clist) {
-    char *saveptr;
-    char *token;
-    char *cmd_str = strdup(cmd_line);
-    int cmd_count = 0;
-    
-    if (!cmd_str) {
+static int grow_cmd_list(command_list_t *clist) {
+    cmd_buff_t *grown = arena_alloc(&clist->_arena, 2 * clist->_cap * sizeof(cmd_buff_t));
+    if (!grown) {
         return ERR_MEMORY;
     }
+    memcpy(grown, clist->commands, clist->num * sizeof(cmd_buff_t));
+    
+    // argv still held inline has to follow its command
+    for (int i = 0; i < clist->num; i++) {
+        if (clist->commands[i].argv == clist->commands[i]._argv) {
+            grown[i].argv = grown[i]._argv;
+        }
+    }
+    clist->commands = grown;
+    clist->_cap *= 2;
+    return OK;
+}
+
+/*
+ * Build a list of commands from a command line, handling pipes.  The line
+ * is scanned once and tokenized in place: the commands point into it, so
+ * it must not be reused until the list is done with.  The first CMD_MAX
+ * commands and CMD_ARGV_MAX - 1 arguments of each are held in the list
+ * itself, anything longer comes from the arena of the list, which
+ * free_cmd_list frees.  On error nothing is left to free.
+ */
+int build_cmd_list(char *cmd_line, command_list_t *clist) {
+    char *p = cmd_line;
     
     // Initialize command list
     clist->num = 0;
+    clist->_cap = CMD_MAX;
+    clist->commands = clist->_commands;
+    clist->_arena.blocks = NULL;
     
-    // Split command by pipe character
-    token = strtok_r(cmd_str, PIPE_STRING, &saveptr);
-    if (!token || strlen(token) == 0) {
-        free(cmd_str);
-        return WARN_NO_CMDS;
-    }
-    
-    // Process each command in the pipeline
-    while (token && cmd_count < CMD_MAX) {
-        // Trim leading whitespace
-        while (*token && isspace(*token)) {
-            token++;
+    // Process each command in the pipeline, skipping empty ones
+    while (*p) {
+        if (clist->num == clist->_cap && grow_cmd_list(clist) != OK) {
+            free_cmd_list(clist);
+            return ERR_MEMORY;
         }
-        
-        // Skip empty commands
-        if (*token) {
-            // Process this command
-            int rc = build_cmd_buff(token, &clist->commands[cmd_count]);
-            if (rc != OK) {
-                free(cmd_str);
-                return rc;
-            }
-            cmd_count++;
+        cmd_buff_t *cmd = &clist->commands[clist->num];
+        int rc = scan_cmd(&p, cmd, &clist->_arena);
+        if (rc != OK) {
+            free_cmd_buff(cmd);
+            free_cmd_list(clist);
+            return rc;
         }
-        
-        // Get next command
-        token = strtok_r(NULL, PIPE_STRING, &saveptr);
-    }
-    
-    // Check if we exceeded the maximum number of commands
-    if (token) {
-        free(cmd_str);
-        return ERR_TOO_MANY_COMMANDS;
+        if (cmd->argc == 0) {
+            free_cmd_buff(cmd);
+            continue;
+        }
+        clist->num++;
     }
     
-    clist->num = cmd_count;
-    free(cmd_str);
-    
-    return (cmd_count > 0) ? OK : WARN_NO_CMDS;
+    return (clist->num > 0) ? OK : WARN_NO_CMDS;
 }
 
 /*
@@ -319,117 +538,568 @@ int free_cmd_list(command_list_t *cmd_list) {
         free_cmd_buff(&cmd_list->commands[i]);
     }
     
+    arena_free(&cmd_list->_arena);
+    cmd_list->commands = cmd_list->_commands;
+    cmd_list->_cap = CMD_MAX;
     cmd_list->num = 0;
     return OK;
 }
 
 /*
- * Execute a command pipeline locally
+ * Opens the redirection file of a pipeline stage for the stream given by
+ * type (REDIR_IN, REDIR_OUT or REDIR_APPEND).  The fd is close-on-exec so
+ * it only reaches the stage it is duplicated into.
  */
-int execute_pipeline(command_list_t *clist) {
-    int n_cmds = clist->num;
-    int pipes[CMD_MAX-1][2]; // Pipes for connecting commands
-    pid_t pids[CMD_MAX];     // Process IDs for each command
-    int status = 0;
-    int rc = OK;
+static int open_redir(const char *file, int type) {
+    if (type == REDIR_IN) {
+        return open(file, O_RDONLY | O_CLOEXEC);
+    }
+    return open(file, O_WRONLY | O_CREAT | O_CLOEXEC |
+                (type == REDIR_APPEND ? O_APPEND : O_TRUNC), 0644);
+}
+
+/*
+ * Builtins that run as pipeline stages inside the shell.  Each one gets
+ * the stage's stdin, stdout and stderr as streams of its own and runs on a
+ * thread of its own, so a pipeline of builtins starts no process at all
+ * and a builtin next to external commands costs a thread, not a fork.
+ */
+typedef int (*stage_fn_t)(cmd_buff_t *cmd, FILE *in, FILE *out, FILE *err);
+
+/*
+ * A stage of a running pipeline: a process, or a builtin on a thread that
+ * owns in, out and err and closes them when it is done.
+ */
+typedef struct stage {
+    cmd_buff_t *cmd;
+    stage_fn_t fn;          // NULL for an external command
+    pid_t pid;              // -1 if no process was started
+    pthread_t thread;
+    int running;            // thread to join
+    int in, out, err;
+} stage_t;
+
+/*
+ * In a pipeline cd runs in a subshell of its own in sh, so it does not move
+ * the shell; all that is left is reporting a directory it could not enter.
+ */
+static int bi_cd(cmd_buff_t *cmd, FILE *in, FILE *out, FILE *err) {
+    const char *dir = cmd->argc > 1 ? cmd->argv[1] : getenv("HOME");
+    struct stat st;
+    (void)in; (void)out;
+    
+    if (!dir) {
+        return 0;
+    }
+    if (stat(dir, &st) == -1) {
+        fprintf(err, "cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(err, "cd: %s: %s\n", dir, strerror(ENOTDIR));
+        return 1;
+    }
+    return 0;
+}
+
+static int bi_dragon(cmd_buff_t *cmd, FILE *in, FILE *out, FILE *err) {
+    (void)cmd; (void)in; (void)err;
+    fprint_dragon(out);
+    return 0;
+}
+
+/*
+ * echo [-n] [arg ...] - Prints the arguments separated by blanks, -n leaves
+ * out the newline.
+ */
+static int bi_echo(cmd_buff_t *cmd, FILE *in, FILE *out, FILE *err) {
+    int first = 1, newline = 1;
+    (void)in; (void)err;
     
-    // Create pipes
-    for (int i = 0; i < n_cmds - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
-            perror("pipe");
-            return ERR_EXEC_CMD;
+    for (; first < cmd->argc && strcmp(cmd->argv[first], "-n") == 0; first++) {
+        newline = 0;
+    }
+    for (int i = first; i < cmd->argc; i++) {
+        fprintf(out, i > first ? " %s" : "%s", cmd->argv[i]);
+    }
+    if (newline) {
+        putc('\n', out);
+    }
+    return 0;
+}
+
+/*
+ * Opens the i-th file operand of a builtin, "-" and no operands at all
+ * being the stage's stdin.  Files are close-on-exec, like every fd the
+ * shell holds while it starts processes.
+ */
+static FILE *bi_open(cmd_buff_t *cmd, int first, int i, FILE *in, FILE *err) {
+    if (first >= cmd->argc || strcmp(cmd->argv[i], "-") == 0) {
+        return in;
+    }
+    FILE *f = fopen(cmd->argv[i], "re");
+    if (!f) {
+        fprintf(err, "%s: %s: %s\n", cmd->argv[0], cmd->argv[i], strerror(errno));
+    }
+    return f;
+}
+
+static void bi_close(FILE *f, FILE *in) {
+    if (f != in) {
+        fclose(f);
+    }
+}
+
+/*
+ * cat [file ...] - Copies the files, or stdin, to stdout.
+ */
+static int bi_cat(cmd_buff_t *cmd, FILE *in, FILE *out, FILE *err) {
+    char buf[BI_BUFF_SZ];
+    int rc = 0;
+    
+    for (int i = 1; i < cmd->argc || i == 1; i++) {
+        FILE *f = bi_open(cmd, 1, i, in, err);
+        if (!f) {
+            rc = 1;
+            continue;
+        }
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            if (fwrite(buf, 1, n, out) != n) {
+                bi_close(f, in);
+                return 1;       // the reader is gone
+            }
+        }
+        bi_close(f, in);
+    }
+    return rc;
+}
+
+/*
+ * wc [-lwc] [file ...] - Counts lines, words and bytes, laid out like
+ * coreutils wc: a single count of a single input is printed as it is,
+ * otherwise counts are as wide as the total size of the regular files, and
+ * at least 7 wide if an input is a pipe or a terminal.
+ */
+static int bi_wc(cmd_buff_t *cmd, FILE *in, FILE *out, FILE *err) {
+    int show[3] = {0, 0, 0};    // lines, words, bytes
+    long total[3] = {0, 0, 0};
+    int first = 1, rc = 0;
+    
+    for (; first < cmd->argc && cmd->argv[first][0] == '-' && cmd->argv[first][1]; first++) {
+        for (const char *o = cmd->argv[first] + 1; *o; o++) {
+            const char *at = strchr("lwc", *o);
+            if (!at) {
+                fprintf(err, "wc: invalid option -- '%c'\n", *o);
+                return 1;
+            }
+            show[at - "lwc"] = 1;
         }
     }
+    if (!show[0] && !show[1] && !show[2]) {
+        show[0] = show[1] = show[2] = 1;
+    }
     
-    // Execute commands
-    for (int i = 0; i < n_cmds; i++) {
-        pids[i] = fork();
-        
-        if (pids[i] < 0) {
-            // Fork error
-            perror("fork");
-            rc = ERR_EXEC_CMD;
-            break;
-            
-        } else if (pids[i] == 0) {
-            // Child process
-            
-            // Handle stdin (either from previous pipe or original stdin)
-            if (i > 0) {
-                // Read from previous pipe
-                dup2(pipes[i-1][0], STDIN_FILENO);
-            } else if (clist->commands[i].in_redir_type == REDIR_IN) {
-                // Input redirection
-                int fd = open(clist->commands[i].in_redir_file, O_RDONLY);
-                if (fd < 0) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
+    int nfiles = first < cmd->argc ? cmd->argc - first : 1;
+    int width = 1;
+    if (nfiles > 1 || show[0] + show[1] + show[2] > 1) {
+        long regular = 0;
+        int min_width = 1;
+        for (int i = first; i < cmd->argc || i == first; i++) {
+            struct stat st;
+            int ok = i < cmd->argc && strcmp(cmd->argv[i], "-") != 0 ?
+                     stat(cmd->argv[i], &st) == 0 : fstat(fileno(in), &st) == 0;
+            if (ok && S_ISREG(st.st_mode)) {
+                regular += st.st_size;
+            } else if (ok) {
+                min_width = 7;
             }
-            
-            // Handle stdout (either to next pipe or original stdout)
-            if (i < n_cmds - 1) {
-                // Write to next pipe
-                dup2(pipes[i][1], STDOUT_FILENO);
-            } else if (clist->commands[i].out_redir_type == REDIR_OUT) {
-                // Output redirection
-                int fd = open(clist->commands[i].out_redir_file, 
-                              O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd < 0) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
+        }
+        for (; regular >= 10; regular /= 10) {
+            width++;
+        }
+        if (width < min_width) {
+            width = min_width;
+        }
+    }
+    
+    for (int i = first; i < cmd->argc || i == first; i++) {
+        char buf[BI_BUFF_SZ];
+        long count[3] = {0, 0, 0};
+        int in_word = 0;
+        size_t n;
+        FILE *f = bi_open(cmd, first, i, in, err);
+        if (!f) {
+            rc = 1;
+            continue;
+        }
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            count[2] += n;
+            for (size_t k = 0; k < n; k++) {
+                unsigned char c = buf[k];
+                if (c == '\n') {
+                    count[0]++;
                 }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
-            } else if (clist->commands[i].out_redir_type == REDIR_APPEND) {
-                // Append redirection
-                int fd = open(clist->commands[i].out_redir_file, 
-                              O_WRONLY | O_CREAT | O_APPEND, 0644);
-                if (fd < 0) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
+                if (isspace(c)) {
+                    in_word = 0;
+                } else if (!in_word) {
+                    in_word = 1;
+                    count[1]++;
                 }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
             }
-            
-            // Close all pipes
-            for (int j = 0; j < n_cmds - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+        }
+        bi_close(f, in);
+        
+        const char *sep = "";
+        for (int k = 0; k < 3; k++) {
+            total[k] += count[k];
+            if (show[k]) {
+                fprintf(out, "%s%*ld", sep, width, count[k]);
+                sep = " ";
+            }
+        }
+        if (i < cmd->argc) {
+            fprintf(out, " %s", cmd->argv[i]);
+        }
+        putc('\n', out);
+    }
+    if (nfiles > 1) {
+        const char *sep = "";
+        for (int k = 0; k < 3; k++) {
+            if (show[k]) {
+                fprintf(out, "%s%*ld", sep, width, total[k]);
+                sep = " ";
             }
-            
-            // Execute the command
-            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
-            
-            // If execvp returns, it failed
-            fprintf(stderr, "dsh: %s: command not found\n", clist->commands[i].argv[0]);
-            exit(EXIT_FAILURE);
         }
+        fprintf(out, " total\n");
     }
+    return rc;
+}
+
+/*
+ * head [-n N | -N] [file ...] - Prints the first N lines (10 by default)
+ * of the files or of stdin, each file under a "==> name <==" header when
+ * there are several.
+ */
+static int bi_head(cmd_buff_t *cmd, FILE *in, FILE *out, FILE *err) {
+    long lines = 10;
+    int first = 1, rc = 0;
     
-    // Parent process
-    // Close all pipe file descriptors
-    for (int i = 0; i < n_cmds - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+    // the last count given wins
+    while (first < cmd->argc && cmd->argv[first][0] == '-' && cmd->argv[first][1]) {
+        const char *num = cmd->argv[first] + 1;
+        if (*num == 'n' && !num[1]) {
+            if (first + 1 >= cmd->argc) {
+                fprintf(err, "head: option requires an argument -- 'n'\n");
+                return 1;
+            }
+            num = cmd->argv[++first];
+        } else if (*num == 'n') {
+            num++;
+        }
+        char *end;
+        lines = strtol(num, &end, 10);
+        if (!*num || *end || lines < 0) {
+            fprintf(err, "head: invalid number of lines: '%s'\n", num);
+            return 1;
+        }
+        first++;
     }
     
-    // Wait for all child processes to complete
-    for (int i = 0; i < n_cmds; i++) {
-        waitpid(pids[i], &status, 0);
+    for (int i = first; i < cmd->argc || i == first; i++) {
+        char buf[BI_BUFF_SZ];
+        long left = lines;
+        size_t n;
+        FILE *f = bi_open(cmd, first, i, in, err);
+        if (!f) {
+            rc = 1;
+            continue;
+        }
+        if (cmd->argc - first > 1) {
+            fprintf(out, "%s==> %s <==\n", i > first ? "\n" : "",
+                    strcmp(cmd->argv[i], "-") == 0 ? "standard input" : cmd->argv[i]);
+        }
+        while (left > 0 && (n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            size_t k = 0;
+            while (k < n && left > 0) {
+                if (buf[k++] == '\n') {
+                    left--;
+                }
+            }
+            if (fwrite(buf, 1, k, out) != k) {
+                break;
+            }
+        }
+        bi_close(f, in);
     }
+    return rc;
+}
+
+// Builtins that stand in for a program take only the options listed, a
+// command with any other option runs the program instead.  As in getopt a
+// letter followed by ':' takes an argument, here always a count (a number
+// that is not negative), attached or in the next word; '#' allows a count
+// as the first option of its own, head's -N.
+static const struct {
+    const char *name;
+    stage_fn_t fn;
+    const char *opts;       // options understood, NULL for any
+    int whole;              // options are whole words, echo -n but not -nn
+} stage_builtins[] = {
+    {"cd", bi_cd, NULL, 0},
+    {"dragon", bi_dragon, NULL, 0},
+    {"echo", bi_echo, "n", 1},
+    {"cat", bi_cat, "", 0},
+    {"wc", bi_wc, "lwc", 0},
+    {"head", bi_head, "n:#", 0},
+};
+
+/*
+ * Returns 1 if arg is a count: decimal digits and nothing else.
+ */
+static int is_count(const char *arg) {
+    return arg != NULL && arg[0] && strspn(arg, "0123456789") == strlen(arg);
+}
+
+/*
+ * Returns 1 if every option of cmd is one of opts (see stage_builtins) and
+ * none of them follows an operand.
+ */
+static int takes_options(cmd_buff_t *cmd, const char *opts, int whole) {
+    int operands = 0;
     
+    for (int j = 1; j < cmd->argc; j++) {
+        const char *arg = cmd->argv[j];
+        if (arg[0] != '-' || !arg[1]) {
+            operands = 1;
+            continue;
+        }
+        if (operands || (whole && arg[2])) {
+            return 0;
+        }
+        if (j == 1 && strchr(opts, '#') && is_count(arg + 1)) {
+            continue;
+        }
+        for (const char *c = arg + 1; *c; c++) {
+            const char *o = strchr(opts, *c);
+            if (o == NULL || *c == ':' || *c == '#') {
+                return 0;
+            }
+            if (o[1] == ':') {
+                if (!is_count(c[1] ? c + 1 : cmd->argv[++j])) {
+                    return 0;
+                }
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * Returns the builtin that runs cmd as a stage, or NULL if there is none
+ * or cmd has options it does not take, or options after its operands.
+ */
+static stage_fn_t match_stage_builtin(cmd_buff_t *cmd) {
+    for (size_t i = 0; i < sizeof(stage_builtins) / sizeof(stage_builtins[0]); i++) {
+        if (strcmp(cmd->argv[0], stage_builtins[i].name) != 0) {
+            continue;
+        }
+        if (stage_builtins[i].opts &&
+            !takes_options(cmd, stage_builtins[i].opts, stage_builtins[i].whole)) {
+            return NULL;
+        }
+        return stage_builtins[i].fn;
+    }
+    return NULL;
+}
+
+/*
+ * Thread body of a builtin stage.  SIGPIPE is blocked so a stage writing
+ * to a reader that already quit gets EPIPE instead of killing the shell.
+ */
+static void *run_stage(void *arg) {
+    stage_t *st = arg;
+    sigset_t pipe_set;
+    
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+    
+    FILE *in = fdopen(st->in, "r");
+    FILE *out = fdopen(st->out, "w");
+    FILE *err = fdopen(st->err, "w");
+    if (in && out && err) {
+        setvbuf(err, NULL, _IONBF, 0);
+        st->fn(st->cmd, in, out, err);
+    }
+    
+    if (in) fclose(in); else close(st->in);
+    if (out) fclose(out); else close(st->out);
+    if (err) fclose(err); else close(st->err);
+    return NULL;
+}
+
+/*
+ * Moves *fd to a builtin stage, or gives it a close-on-exec copy of
+ * shared if *fd is not set.
+ */
+static int take_fd(int *fd, int shared) {
+    int taken = *fd;
+    
+    if (taken >= 0) {
+        *fd = -1;
+        return taken;
+    }
+    return fcntl(shared, F_DUPFD_CLOEXEC, 0);
+}
+
+/*
+ * Starts a builtin stage on a thread with the given stdin and stdout, which
+ * it takes over, and a copy of err_fd.
+ */
+static int start_stage(stage_t *st, int *in, int stdin_fd, int *out, int stdout_fd, int err_fd) {
+    st->in = take_fd(in, stdin_fd);
+    st->out = take_fd(out, stdout_fd);
+    st->err = fcntl(err_fd, F_DUPFD_CLOEXEC, 0);
+    
+    if (st->in >= 0 && st->out >= 0 && st->err >= 0 &&
+        pthread_create(&st->thread, NULL, run_stage, st) == 0) {
+        st->running = 1;
+        return OK;
+    }
+    if (st->in >= 0) close(st->in);
+    if (st->out >= 0) close(st->out);
+    if (st->err >= 0) close(st->err);
+    return ERR_EXEC_CMD;
+}
+
+/*
+ * Launches every stage of clist, connected by pipes, and waits for them.
+ * Builtin stages (see stage_builtins) run on threads of the shell, the
+ * others are started with posix_spawnp.  glibc spawns with
+ * clone(CLONE_VM|CLONE_VFORK), so unlike fork() the launch does not copy
+ * the page tables of the shell, which on the threaded server with a large
+ * heap is most of the cost of a command.  The pipes and redirection files
+ * are opened here, close-on-exec, and the file actions only dup2 them onto
+ * stdin and stdout of the stage that uses them.
+ *
+ * The last stage writes to out_fd and every stage to err_fd, or to the
+ * shell's own stdout and stderr where these are -1.  A stage that cannot be
+ * started is reported on its stderr as "<name>: <cmd>: command not found"
+ * and the rest of the pipeline still runs, as it did with fork.
+ */
+int spawn_pipeline(command_list_t *clist, int out_fd, int err_fd, const char *name) {
+    int n_cmds = clist->num;
+    stage_t short_stages[CMD_MAX];
+    stage_t *stages = short_stages;
+    int prev_rd = -1;        // Read end of the pipe from the previous stage
+    int started = 0;
+    int status = 0;
+    int rc = OK;
+
+    if (n_cmds > CMD_MAX) {
+        stages = arena_alloc(&clist->_arena, n_cmds * sizeof(stage_t));
+        if (!stages) {
+            return ERR_MEMORY;
+        }
+    }
+
+    for (int i = 0; i < n_cmds; i++) {
+        stage_t *st = &stages[i];
+        cmd_buff_t *cmd = &clist->commands[i];
+        int p[2] = {-1, -1};
+        int in = prev_rd, out = out_fd;
+        int in_file = -1, out_file = -1;
+        posix_spawn_file_actions_t fa;
+
+        st->cmd = cmd;
+        st->fn = match_stage_builtin(cmd);
+        st->pid = -1;
+        st->running = 0;
+        if (i < n_cmds - 1) {
+            if (pipe2(p, O_CLOEXEC) == -1) {
+                perror("pipe");
+                rc = ERR_EXEC_CMD;
+                break;
+            }
+            out = p[1];
+        }
+        started++;
+
+        // Input redirection applies to the first stage, output to the last
+        int redir_ok = 1;
+        if (i == 0 && cmd->in_redir_type == REDIR_IN) {
+            in = in_file = open_redir(cmd->in_redir_file, REDIR_IN);
+            redir_ok = in_file >= 0;
+        }
+        if (redir_ok && i == n_cmds - 1 && cmd->out_redir_type != REDIR_NONE) {
+            out = out_file = open_redir(cmd->out_redir_file, cmd->out_redir_type);
+            redir_ok = out_file >= 0;
+        }
+
+        if (!redir_ok) {
+            perror("open");
+        } else if (st->fn) {
+            if (start_stage(st, in_file >= 0 ? &in_file : &prev_rd, STDIN_FILENO,
+                            out_file >= 0 ? &out_file : &p[1],
+                            out_fd >= 0 ? out_fd : STDOUT_FILENO,
+                            err_fd >= 0 ? err_fd : STDERR_FILENO) != OK) {
+                perror("pthread_create");
+                rc = ERR_EXEC_CMD;
+            }
+        } else if (posix_spawn_file_actions_init(&fa) != 0) {
+            perror("posix_spawn");
+            rc = ERR_EXEC_CMD;
+        } else {
+            if (in >= 0) posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO);
+            if (out >= 0) posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+            if (err_fd >= 0) posix_spawn_file_actions_adddup2(&fa, err_fd, STDERR_FILENO);
+
+            if (posix_spawnp(&st->pid, cmd->argv[0], &fa, NULL, cmd->argv, environ) != 0) {
+                st->pid = -1;
+                dprintf(err_fd >= 0 ? err_fd : STDERR_FILENO,
+                        "%s: %s: command not found\n", name, cmd->argv[0]);
+            }
+            posix_spawn_file_actions_destroy(&fa);
+        }
+
+        // The stage has its own copies now
+        if (in_file >= 0) close(in_file);
+        if (out_file >= 0) close(out_file);
+        if (prev_rd >= 0) close(prev_rd);
+        if (p[1] >= 0) close(p[1]);
+        prev_rd = p[0];
+    }
+    if (prev_rd >= 0) {
+        close(prev_rd);
+    }
+
+    // Wait for all stages to complete
+    for (int i = 0; i < started; i++) {
+        if (stages[i].running) {
+            pthread_join(stages[i].thread, NULL);
+        } else if (stages[i].pid > 0) {
+            waitpid(stages[i].pid, &status, 0);
+        }
+    }
+
     return rc;
 }
 
+/*
+ * Execute a command pipeline locally
+ */
+int execute_pipeline(command_list_t *clist) {
+    return spawn_pipeline(clist, -1, -1, "dsh");
+}
+
 /*
  * Execute local commands (reusing from previous shell assignment)
  */
 int exec_local_cmd_loop() {
-    char cmd_line[SH_CMD_MAX];
+    char *cmd_line = NULL;      // grown by getline, lines have no length limit
+    size_t cmd_cap = 0;
     command_list_t cmd_list;
     int rc;
     
@@ -439,7 +1109,7 @@ int exec_local_cmd_loop() {
         fflush(stdout);
         
         // Read command
-        if (fgets(cmd_line, SH_CMD_MAX, stdin) == NULL) {
+        if (getline(&cmd_line, &cmd_cap, stdin) == -1) {
             printf("\n");
             break;
         }
@@ -454,19 +1124,24 @@ int exec_local_cmd_loop() {
         if (rc == WARN_NO_CMDS) {
             printf(CMD_WARN_NO_CMD);
             continue;
-        } else if (rc == ERR_TOO_MANY_COMMANDS) {
-            printf(CMD_ERR_PIPE_LIMIT, CMD_MAX);
+        } else if (rc == ERR_CMD_QUOTE) {
+            printf(CMD_ERR_QUOTE);
             continue;
         } else if (rc != OK) {
             printf("Error parsing command: %d\n", rc);
             continue;
         }
         
-        // Check for built-in commands (only check first command in pipeline)
-        Built_In_Cmds bi_result = exec_built_in_cmd(&cmd_list.commands[0]);
+        // A command on its own may be a builtin of the shell itself, in a
+        // pipeline builtins are stages (see stage_builtins)
+        Built_In_Cmds bi_result = BI_NOT_BI;
+        if (cmd_list.num == 1) {
+            bi_result = exec_built_in_cmd(&cmd_list.commands[0]);
+        }
         
         if (bi_result == BI_CMD_EXIT) {
             free_cmd_list(&cmd_list);
+            free(cmd_line);
             return OK_EXIT;
         } else if (bi_result != BI_EXECUTED) {
             // Execute pipeline
@@ -477,5 +1152,6 @@ int exec_local_cmd_loop() {
         free_cmd_list(&cmd_list);
     }
     
+    free(cmd_line);
     return OK;
 }
@@ -1,8 +1,11 @@
 #ifndef __DSHLIB_H__
     #define __DSHLIB_H__
+#include <stddef.h>
 //Constants for command structure sizes
 #define EXE_MAX 64
 #define ARG_MAX 256
+// Commands and argv entries held inline, longer pipelines and argument
+// lists grow into the arena of their command line
 #define CMD_MAX 8
 #define CMD_ARGV_MAX (CMD_MAX + 1)
 // Longest command that can be read from the shell
@@ -22,11 +25,40 @@ typedef struct command
     char args[ARG_MAX];
 } command_t;
 
+// A word that $VAR expansion made longer than its place in the command
+// line, kept on the words of its command until the command is freed
+typedef struct word_buf
+{
+    struct word_buf *next;
+    char text[];
+} word_buf_t;
+
+// Bump allocator for what a command line needs beyond the inline arrays
+// below.  Blocks are only added, and all of them are freed with the line.
+typedef struct arena_block
+{
+    struct arena_block *next;
+    size_t used, cap;
+    max_align_t data[];
+} arena_block_t;
+
+typedef struct arena
+{
+    arena_block_t *blocks;
+} arena_t;
+
+#define ARENA_BLOCK_MIN 4096    // bytes in the first block of an arena
+#define BI_BUFF_SZ 8192         // read buffer of the builtin pipeline stages
+
 typedef struct cmd_buff
 {
     int  argc;
-    char *argv[CMD_ARGV_MAX];
+    int  _argv_cap;             // entries argv has room for
+    char **argv;                // _argv, or arena memory once it is full
+    char *_argv[CMD_ARGV_MAX];
+    arena_t _arena;             // argv of a command parsed on its own
     char *_cmd_buffer;
+    word_buf_t *_words;
     
     // Extra credit - redirection
     RedirectionType in_redir_type;
@@ -46,7 +78,10 @@ typedef struct command{
 */
 typedef struct command_list{
     int num;
-    cmd_buff_t commands[CMD_MAX];
+    int _cap;                   // commands has room for
+    cmd_buff_t *commands;       // _commands, or arena memory once it is full
+    cmd_buff_t _commands[CMD_MAX];
+    arena_t _arena;             // per line memory of the list and its argvs
 }command_list_t;
 //Special character #defines
 #define SPACE_CHAR  ' '
@@ -54,6 +89,10 @@ typedef struct command_list{
 #define PIPE_STRING "|"
 #define REDIR_IN_CHAR '<'
 #define REDIR_OUT_CHAR '>'
+#define QUOTE_CHAR  '"'
+#define SQUOTE_CHAR '\''
+#define ESCAPE_CHAR '\\'
+#define VAR_CHAR    '$'
 #define SH_PROMPT "dsh3> "
 #define EXIT_CMD "exit"
 #define EXIT_SC     99
@@ -66,6 +105,7 @@ typedef struct command_list{
 #define ERR_MEMORY              -5
 #define ERR_EXEC_CMD            -6
 #define OK_EXIT                 -7
+#define ERR_CMD_QUOTE           -8      //unterminated quote, callers print CMD_ERR_QUOTE
 //prototypes
 int alloc_cmd_buff(cmd_buff_t *cmd_buff);
 int free_cmd_buff(cmd_buff_t *cmd_buff);
@@ -74,6 +114,8 @@ int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff);
 int close_cmd_buff(cmd_buff_t *cmd_buff);
 int build_cmd_list(char *cmd_line, command_list_t *clist);
 int free_cmd_list(command_list_t *cmd_lst);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_free(arena_t *arena);
 //built in command stuff
 typedef enum {
     BI_CMD_EXIT,
@@ -88,9 +130,11 @@ Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd);
 int exec_local_cmd_loop();
 int exec_cmd(cmd_buff_t *cmd);
 int execute_pipeline(command_list_t *clist);
+int spawn_pipeline(command_list_t *clist, int out_fd, int err_fd, const char *name);
 //output constants
 #define CMD_OK_HEADER       "PARSED COMMAND LINE - TOTAL COMMANDS %d\n"
 #define CMD_WARN_NO_CMD     "warning: no commands provided\n"
 #define CMD_ERR_PIPE_LIMIT  "error: piping limited to %d commands\n"
 #define CMD_ERR_REDIR       "error: redirection syntax error\n"
+#define CMD_ERR_QUOTE       "error: unterminated quote\n"
 #endif
@@ -13,9 +13,6 @@
 #include "dshlib.h"
 #include "rshlib.h"
 
-// Declaration for dragon function 
-extern void print_dragon(void);
-
 // Structure for thread arguments
 typedef struct {
     int client_socket;
@@ -323,10 +320,8 @@ int exec_client_requests(int cli_socket) {
             send_message_string(cli_socket, CMD_WARN_NO_CMD);
             send_message_eof(cli_socket);
             continue;
-        } else if (retcode == ERR_TOO_MANY_COMMANDS) {
-            char buffer[100];
-            sprintf(buffer, CMD_ERR_PIPE_LIMIT, CMD_MAX);
-            send_message_string(cli_socket, buffer);
+        } else if (retcode == ERR_CMD_QUOTE) {
+            send_message_string(cli_socket, CMD_ERR_QUOTE);
             send_message_eof(cli_socket);
             continue;
         } else if (retcode != OK) {
@@ -335,7 +330,8 @@ int exec_client_requests(int cli_socket) {
             continue;
         }
         
-        // Check for built-in commands (only process first command in pipeline)
+        // Check for built-in commands of the server itself (exit and a lone
+        // cd), dragon and the other builtins run as pipeline stages
         Built_In_Cmds builtin_result = BI_NOT_BI;
         
         if (cmd_list.num > 0) {
@@ -347,37 +343,7 @@ int exec_client_requests(int cli_socket) {
                 free_cmd_list(&cmd_list);
                 free(recv_buff);
                 return OK;
-            } else if (builtin_result == BI_CMD_DRAGON) {
-                // Capture dragon ASCII art output
-                FILE *temp_file = tmpfile();
-                if (!temp_file) {
-                    send_message_string(cli_socket, "Error creating temporary file for dragon output\n");
-                    send_message_eof(cli_socket);
-                    continue;
-                }
-                
-                // Redirect stdout, print dragon, then get it back
-                int stdout_fd = dup(STDOUT_FILENO);
-                dup2(fileno(temp_file), STDOUT_FILENO);
-                print_dragon();
-                fflush(stdout);
-                dup2(stdout_fd, STDOUT_FILENO);
-                close(stdout_fd);
-                
-                // Send the dragon output to client
-                rewind(temp_file);
-                char dragon_buffer[RDSH_COMM_BUFF_SZ];
-                size_t bytes_read;
-                while ((bytes_read = fread(dragon_buffer, 1, RDSH_COMM_BUFF_SZ - 1, temp_file)) > 0) {
-                    dragon_buffer[bytes_read] = '\0';
-                    send_message_string(cli_socket, dragon_buffer);
-                }
-                
-                fclose(temp_file);
-                send_message_eof(cli_socket);
-                
-                builtin_result = BI_EXECUTED;
-            } else if (builtin_result == BI_CMD_CD) {
+            } else if (builtin_result == BI_CMD_CD && cmd_list.num == 1) {
                 // Handle cd command
                 if (cmd_list.commands[0].argc < 2) {
                     char *home = getenv("HOME");
@@ -457,111 +423,12 @@ int send_message_eof(int cli_socket) {
  * Execute command pipeline with output redirected to socket
  */
 int rsh_execute_pipeline(int socket_fd, command_list_t *clist) {
-    int n_cmds = clist->num;
-    int pipes[CMD_MAX-1][2]; // Pipes for connecting commands
-    pid_t pids[CMD_MAX];     // Process IDs for each command
-    int status = 0;
-    int rc = OK;
-    
-    // Create pipes
-    for (int i = 0; i < n_cmds - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
-            perror("pipe");
-            return ERR_RDSH_CMD_EXEC;
-        }
-    }
-    
-    // Execute commands
-    for (int i = 0; i < n_cmds; i++) {
-        pids[i] = fork();
-        
-        if (pids[i] < 0) {
-            // Fork error
-            perror("fork");
-            rc = ERR_RDSH_CMD_EXEC;
-            break;
-            
-        } else if (pids[i] == 0) {
-            // Child process
-            
-            // Handle stdin (either from previous pipe or original stdin)
-            if (i > 0) {
-                // Read from previous pipe
-                dup2(pipes[i-1][0], STDIN_FILENO);
-            } else if (clist->commands[i].in_redir_type == REDIR_IN) {
-                // Input redirection
-                int fd = open(clist->commands[i].in_redir_file, O_RDONLY);
-                if (fd < 0) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
-            }
-            
-            // Handle stdout (either to next pipe or original stdout)
-            if (i < n_cmds - 1) {
-                // Write to next pipe
-                dup2(pipes[i][1], STDOUT_FILENO);
-            } else if (clist->commands[i].out_redir_type == REDIR_OUT) {
-                // Output redirection
-                int fd = open(clist->commands[i].out_redir_file, 
-                              O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd < 0) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
-            } else if (clist->commands[i].out_redir_type == REDIR_APPEND) {
-                // Append redirection
-                int fd = open(clist->commands[i].out_redir_file, 
-                              O_WRONLY | O_CREAT | O_APPEND, 0644);
-                if (fd < 0) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
-            } else {
-                // For the last command in the pipeline, redirect stdout to socket
-                if (i == n_cmds - 1) {
-                    dup2(socket_fd, STDOUT_FILENO);
-                }
-            }
-            
-            // Always redirect stderr to socket
-            dup2(socket_fd, STDERR_FILENO);
-            
-            // Close all pipes
-            for (int j = 0; j < n_cmds - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
-            
-            // Execute the command
-            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
-            
-            // If execvp returns, it failed
-            fprintf(stderr, "rdsh: %s: command not found\n", clist->commands[i].argv[0]);
-            exit(EXIT_FAILURE);
-        }
-    }
-    
-    // Parent process
-    // Close all pipe file descriptors
-    for (int i = 0; i < n_cmds - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
-    }
-    
-    // Wait for all child processes to complete
-    for (int i = 0; i < n_cmds; i++) {
-        waitpid(pids[i], &status, 0);
-    }
-    
+    // Stages are spawned, not forked, so the server's threads and heap
+    // are not copied for every command
+    int rc = spawn_pipeline(clist, socket_fd, socket_fd, "rdsh");
+
     // Send EOF to indicate end of output
     send_message_eof(socket_fd);
-    
-    return rc;
+
+    return rc == OK ? OK : ERR_RDSH_CMD_EXEC;
 }